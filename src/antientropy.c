@@ -0,0 +1,669 @@
+// need this for pthread_cond_timedwait() and lstat() under -std=c99
+#define _XOPEN_SOURCE 700
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "antientropy.h"
+#include "hash.h"
+#include "log.h"
+
+// paths are kept in buckets by the top TABLE_BITS of their hash, so the
+// buckets of one key range (leaf) are next to each other
+#define TABLE_BITS (AE_BITS + 6)
+#define TABLE_SIZE (1 << TABLE_BITS)
+
+// heap layout: node 1 is the root, node i has children 2i and 2i+1 and
+// the leaves are nodes AE_LEAVES..2*AE_LEAVES-1
+struct ae_tree
+{
+    uint64_t node[2 * AE_LEAVES];
+};
+
+// a path the trees know about.  h[d] is what it adds to drive d's want
+// tree and h[numDrives + d] what it adds to its have tree, 0 for nothing.
+// Only the anti-entropy thread changes h or frees entries.
+struct ae_entry
+{
+    struct ae_entry *next;
+    struct ae_entry *nextPending;
+    int pending;
+    char *path;
+    uint64_t h[];
+};
+
+struct ae_drive
+{
+    int suspect;                        // a failure since the last good sync
+    int unreachable;                    // its root failed the last probe
+    unsigned char dirty[AE_LEAVES];     // key ranges that saw a failure
+    struct ae_tree want;
+    struct ae_tree have;
+};
+
+// the master's side of a path
+struct ae_master
+{
+    int exists;
+    struct stat st;
+    int numPlaced;
+    int *placed;
+};
+
+// one path a pass visits
+struct ae_work
+{
+    struct ae_entry *entry;
+    struct stat replica;
+    int wanted;
+    int present;
+};
+
+static int numDrives = 0;
+static char *rootdir = NULL;
+static char *backup = NULL;
+static long intervalMs = 0;
+static ae_walk walkFn = NULL;
+static ae_placed placedFn = NULL;
+static ae_repair repairFn = NULL;
+static struct ae_drive *drives = NULL;
+static struct ae_entry **table = NULL;
+static struct ae_entry *pending = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t thread;
+static int running = 0;
+
+static int bucketOf(const char *path)
+{
+    return hashFunction(path) >> (sizeof(unsigned long) * 8 - TABLE_BITS);
+}
+
+// the key range path falls in
+static int leafOf(const char *path)
+{
+    return bucketOf(path) >> (TABLE_BITS - AE_BITS);
+}
+
+// what a path contributes to its leaf: name, type and, for files and
+// links, size; a directory's size depends on the filesystem it is on.
+// Leaves combine entries with XOR, so the order they are found in is
+// irrelevant.  Never 0, which stands for nothing.
+static uint64_t entryHash(const char *path, const struct stat *st)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const unsigned char *p;
+    for (p = (const unsigned char *) path; *p != '\0'; p++)
+        h = (h ^ *p) * 0x100000001b3ULL;
+    h ^= (uint64_t) (st->st_mode & S_IFMT) << 32;
+    if (S_ISREG(st->st_mode) || S_ISLNK(st->st_mode))
+        h ^= (uint64_t) st->st_size * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h != 0 ? h : 1;
+}
+
+static uint64_t nodeHash(uint64_t left, uint64_t right)
+{
+    uint64_t h = left * 0x9e3779b97f4a7c15ULL + right;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    return h ^ (h >> 31);
+}
+
+static void treeBuild(struct ae_tree *t)
+{
+    int i;
+    for (i = AE_LEAVES - 1; i >= 1; i--)
+        t->node[i] = nodeHash(t->node[2 * i], t->node[2 * i + 1]);
+}
+
+// make what path adds to t h instead of *was, and rehash up to the root
+static void treeSet(struct ae_tree *t, const char *path, uint64_t *was, uint64_t h)
+{
+    int i;
+    if (*was == h)
+        return;
+    i = AE_LEAVES + leafOf(path);
+    t->node[i] ^= *was ^ h;
+    *was = h;
+    for (i /= 2; i >= 1; i /= 2)
+        t->node[i] = nodeHash(t->node[2 * i], t->node[2 * i + 1]);
+}
+
+// mark the leaves under node i where a and b disagree
+static void treeDiff(const struct ae_tree *a, const struct ae_tree *b, int i, unsigned char *differ)
+{
+    if (a->node[i] == b->node[i])
+        return;
+    if (i >= AE_LEAVES)
+    {
+        differ[i - AE_LEAVES] = 1;
+        return;
+    }
+    treeDiff(a, b, 2 * i, differ);
+    treeDiff(a, b, 2 * i + 1, differ);
+}
+
+// the entry for path, made if it's new.  Called with lock held.
+static struct ae_entry *lookup(const char *path)
+{
+    int b = bucketOf(path);
+    struct ae_entry *e;
+    for (e = table[b]; e != NULL; e = e->next)
+        if (strcmp(e->path, path) == 0)
+            return e;
+    e = calloc(1, sizeof(struct ae_entry) + 2 * numDrives * sizeof(uint64_t));
+    if (e == NULL)
+        return NULL;
+    e->path = strdup(path);
+    if (e->path == NULL)
+    {
+        free(e);
+        return NULL;
+    }
+    e->next = table[b];
+    table[b] = e;
+    return e;
+}
+
+// Called with lock held.
+static void markPending(struct ae_entry *e)
+{
+    if (e->pending)
+        return;
+    e->pending = 1;
+    e->nextPending = pending;
+    pending = e;
+}
+
+// drop e once no tree has anything of it.  Called with lock held.
+static void maybeFree(struct ae_entry *e)
+{
+    struct ae_entry **p;
+    int i;
+    if (e->pending)
+        return;
+    for (i = 0; i < 2 * numDrives; i++)
+        if (e->h[i] != 0)
+            return;
+    for (p = &table[bucketOf(e->path)]; *p != e; p = &(*p)->next)
+        ;
+    *p = e->next;
+    free(e->path);
+    free(e);
+}
+
+// what the master has at path now.  -1 if it can't tell.
+static int lookMaster(const char *path, struct ae_master *m)
+{
+    char fpath[PATH_MAX];
+    snprintf(fpath, PATH_MAX, "%s%s", rootdir, path);
+    m->numPlaced = 0;
+    m->exists = lstat(fpath, &m->st) == 0;
+    if (!m->exists)
+        return errno == ENOENT ? 0 : -1;
+    m->numPlaced = placedFn(path, m->placed, numDrives);
+    return 0;
+}
+
+static int isPlaced(const struct ae_master *m, int drive)
+{
+    int i;
+    for (i = 0; i < m->numPlaced; i++)
+        if (m->placed[i] == drive)
+            return 1;
+    return 0;
+}
+
+static void setHave(struct ae_entry *e, int drive, const struct stat *st)
+{
+    uint64_t h = st != NULL ? entryHash(e->path, st) : 0;
+    treeSet(&drives[drive].have, e->path, &e->h[numDrives + drive], h);
+}
+
+// bring e's hashes on drive up to date; w gets what was found.  A
+// directory the master has is wanted wherever it is, since paths under it
+// may be placed on the drive.
+static void lookDrive(struct ae_entry *e, int drive, const struct ae_master *m, struct ae_work *w)
+{
+    char fpath[PATH_MAX];
+    snprintf(fpath, PATH_MAX, "%s/%d%s", backup, drive, e->path);
+    w->entry = e;
+    w->present = lstat(fpath, &w->replica) == 0;
+    w->wanted = m->exists && (isPlaced(m, drive) ||
+                              (S_ISDIR(m->st.st_mode) && w->present && S_ISDIR(w->replica.st_mode)));
+    treeSet(&drives[drive].want, e->path, &e->h[drive], w->wanted ? entryHash(e->path, &m->st) : 0);
+    setHave(e, drive, w->present ? &w->replica : NULL);
+}
+
+// Look again at every path reported changed since the last time, on the
+// master and on every drive.
+static void takePending(void)
+{
+    struct ae_master m;
+    struct ae_work w;
+    struct ae_entry *e;
+    struct ae_entry **list;
+    int count = 0;
+    int i, d;
+
+    pthread_mutex_lock(&lock);
+    for (e = pending; e != NULL; e = e->nextPending)
+        count++;
+    list = malloc((count > 0 ? count : 1) * sizeof(struct ae_entry *));
+    if (list == NULL)
+    {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    // changes from here on go on the next list
+    for (i = 0, e = pending; e != NULL; e = e->nextPending)
+    {
+        list[i++] = e;
+        e->pending = 0;
+    }
+    pending = NULL;
+    pthread_mutex_unlock(&lock);
+
+    m.placed = malloc(numDrives * sizeof(int));
+    for (i = 0; i < count && m.placed != NULL; i++)
+    {
+        if (lookMaster(list[i]->path, &m) < 0)
+            continue;
+        for (d = 0; d < numDrives; d++)
+            lookDrive(list[i], d, &m, &w);
+    }
+    free(m.placed);
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < count; i++)
+        maybeFree(list[i]);
+    pthread_mutex_unlock(&lock);
+    free(list);
+}
+
+static void buildEntry(void *ctx, const char *path, const struct stat *st)
+{
+    pthread_mutex_lock(&lock);
+    lookup(path);
+    pthread_mutex_unlock(&lock);
+}
+
+// Every path under dir on drive, and with have set what it adds to the
+// drive's have tree too.  Our own files (hints, objects, temporary
+// names) are left out.
+static void buildDrive(int drive, const char *dir, int have)
+{
+    struct ae_entry *e;
+    char fpath[PATH_MAX];
+    char path[PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+    DIR *dp;
+
+    snprintf(fpath, PATH_MAX, "%s/%d%s", backup, drive, dir);
+    dp = opendir(fpath);
+    if (dp == NULL)
+        return;
+    while ((de = readdir(dp)) != NULL)
+    {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 ||
+            strstr(de->d_name, ".pfs-") != NULL)
+            continue;
+        snprintf(path, PATH_MAX, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, de->d_name);
+        snprintf(fpath, PATH_MAX, "%s/%d%s", backup, drive, path);
+        if (lstat(fpath, &st) < 0)
+            continue;
+        pthread_mutex_lock(&lock);
+        e = lookup(path);
+        if (e != NULL && have)
+            setHave(e, drive, &st);
+        pthread_mutex_unlock(&lock);
+        if (S_ISDIR(st.st_mode))
+            buildDrive(drive, path, have);
+    }
+    closedir(dp);
+}
+
+// Forget what drive was last seen to hold and list it again, for when it
+// may have changed behind our back: emptied, restored from an older
+// copy or edited outside pfs.
+static void rescanDrive(int drive)
+{
+    struct ae_entry *e;
+    struct ae_entry *next;
+    int b;
+
+    pthread_mutex_lock(&lock);
+    for (b = 0; b < TABLE_SIZE; b++)
+        for (e = table[b]; e != NULL; e = e->next)
+            e->h[numDrives + drive] = 0;
+    memset(&drives[drive].have, 0, sizeof(struct ae_tree));
+    treeBuild(&drives[drive].have);
+    pthread_mutex_unlock(&lock);
+
+    buildDrive(drive, "/", 1);
+
+    pthread_mutex_lock(&lock);
+    for (b = 0; b < TABLE_SIZE; b++)
+        for (e = table[b]; e != NULL; e = next)
+        {
+            next = e->next;
+            maybeFree(e);
+        }
+    pthread_mutex_unlock(&lock);
+}
+
+// The trees at startup: every path on the master or any drive is looked
+// at once, as if it had just changed.
+static void build(void)
+{
+    struct ae_entry *e;
+    int b, d;
+    walkFn(buildEntry, NULL);
+    for (d = 0; d < numDrives && running; d++)
+        buildDrive(d, "/", 0);
+    pthread_mutex_lock(&lock);
+    for (b = 0; b < TABLE_SIZE; b++)
+        for (e = table[b]; e != NULL; e = e->next)
+            markPending(e);
+    pthread_mutex_unlock(&lock);
+    takePending();
+}
+
+static int byPath(const void *a, const void *b)
+{
+    return strcmp(((const struct ae_work *) a)->entry->path, ((const struct ae_work *) b)->entry->path);
+}
+
+// does the copy on the drive need replacing?
+static int stale(const struct ae_work *w, const struct stat *master, int dirty)
+{
+    if (!w->present || (w->replica.st_mode & S_IFMT) != (master->st_mode & S_IFMT))
+        return 1;
+    if (!S_ISREG(master->st_mode))
+        return 0;
+    if (w->replica.st_size != master->st_size)
+        return 1;
+    // an update to this range failed; anything older than the master
+    // copy may have missed it
+    return dirty && (w->replica.st_mtim.tv_sec < master->st_mtim.tv_sec ||
+                     (w->replica.st_mtim.tv_sec == master->st_mtim.tv_sec &&
+                      w->replica.st_mtim.tv_nsec < master->st_mtim.tv_nsec));
+}
+
+// Bring drive in line with the master now.  Returns the number of paths
+// repaired, or -1 if any repair failed (the drive stays suspect).
+static int syncDrive(int drive)
+{
+    unsigned char dirty[AE_LEAVES];
+    unsigned char differ[AE_LEAVES];
+    char fpath[PATH_MAX];
+    struct ae_work *work = NULL;
+    struct ae_master m;
+    struct ae_entry *e;
+    int count = 0;
+    int cap = 0;
+    int ranges = 0;
+    int repaired = 0;
+    int failed = 0;
+    int i, b;
+
+    // failures from here on belong to the next pass
+    pthread_mutex_lock(&lock);
+    memcpy(dirty, drives[drive].dirty, AE_LEAVES);
+    memset(drives[drive].dirty, 0, AE_LEAVES);
+    drives[drive].suspect = 0;
+    pthread_mutex_unlock(&lock);
+
+    memset(differ, 0, AE_LEAVES);
+    treeDiff(&drives[drive].want, &drives[drive].have, 1, differ);
+
+    // just the paths in the ranges that differ
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < AE_LEAVES; i++)
+    {
+        if (!differ[i] && !dirty[i])
+            continue;
+        ranges++;
+        for (b = i << (TABLE_BITS - AE_BITS); b < (i + 1) << (TABLE_BITS - AE_BITS); b++)
+            for (e = table[b]; e != NULL; e = e->next)
+            {
+                if (count == cap)
+                {
+                    int more = cap > 0 ? 2 * cap : 256;
+                    struct ae_work *grown = realloc(work, more * sizeof(struct ae_work));
+                    if (grown == NULL)
+                        continue;
+                    work = grown;
+                    cap = more;
+                }
+                work[count].entry = e;
+                work[count].wanted = work[count].present = 0;
+                count++;
+            }
+    }
+    pthread_mutex_unlock(&lock);
+    log_msg("anti-entropy: drive %d, %d of %d key ranges to check, %d paths\n",
+            drive, ranges, AE_LEAVES, count);
+    if (count == 0)
+    {
+        free(work);
+        return 0;
+    }
+
+    // parents are made before their children and removed after them
+    qsort(work, count, sizeof(struct ae_work), byPath);
+    m.placed = malloc(numDrives * sizeof(int));
+    for (i = 0; i < count && m.placed != NULL; i++)
+    {
+        struct ae_work *w = &work[i];
+        e = w->entry;
+        if (lookMaster(e->path, &m) < 0)
+            continue;
+        lookDrive(e, drive, &m, w);
+        if (!w->wanted || !stale(w, &m.st, dirty[leafOf(e->path)]))
+            continue;
+        if (repairFn(drive, e->path, &m.st) == 0)
+        {
+            repaired++;
+            lookDrive(e, drive, &m, w);
+        }
+        else
+        {
+            log_msg("ERROR anti-entropy: could not repair %s on drive %d\n", e->path, drive);
+            aeSuspect(drive, e->path);
+            failed = 1;
+        }
+    }
+    free(m.placed);
+    for (i = count - 1; i >= 0; i--)
+    {
+        struct ae_work *w = &work[i];
+        if (w->wanted || !w->present)
+            continue;
+        if (repairFn(drive, w->entry->path, NULL) == 0)
+        {
+            // a directory with anything left in it stays for now
+            snprintf(fpath, PATH_MAX, "%s/%d%s", backup, drive, w->entry->path);
+            w->present = lstat(fpath, &w->replica) == 0;
+            setHave(w->entry, drive, w->present ? &w->replica : NULL);
+            repaired += !w->present;
+        }
+        else
+        {
+            log_msg("ERROR anti-entropy: could not remove %s from drive %d\n", w->entry->path, drive);
+            failed = 1;
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < count; i++)
+        maybeFree(work[i].entry);
+    pthread_mutex_unlock(&lock);
+    free(work);
+    log_msg("anti-entropy: drive %d, %d paths repaired\n", drive, repaired);
+    return failed ? -1 : repaired;
+}
+
+// path changed on the master and, maybe, on the drives
+void aeChanged(const char *path)
+{
+    struct ae_entry *e;
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&lock);
+    e = lookup(path);
+    if (e != NULL)
+        markPending(e);
+    pthread_mutex_unlock(&lock);
+}
+
+// path and everything known under it changed, as when a directory is
+// renamed away.  The paths it went to are reported with aeChanged().
+void aeChangedTree(const char *path)
+{
+    size_t len = strlen(path);
+    struct ae_entry *e;
+    int b;
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&lock);
+    for (b = 0; b < TABLE_SIZE; b++)
+        for (e = table[b]; e != NULL; e = e->next)
+            if (strncmp(e->path, path, len) == 0 && (e->path[len] == '\0' || e->path[len] == '/'))
+                markPending(e);
+    pthread_mutex_unlock(&lock);
+}
+
+// a replica update of path on drive failed
+void aeSuspect(int drive, const char *path)
+{
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE) || drive < 0 || drive >= numDrives)
+        return;
+    pthread_mutex_lock(&lock);
+    drives[drive].dirty[leafOf(path)] = 1;
+    drives[drive].suspect = 1;
+    pthread_mutex_unlock(&lock);
+}
+
+static void *aeThread(void *arg)
+{
+    struct timespec lastFull;
+    char root[PATH_MAX];
+    int i;
+
+    build();
+    clock_gettime(CLOCK_MONOTONIC, &lastFull);
+    pthread_mutex_lock(&lock);
+    while (running)
+    {
+        // look for drives to sync once a second
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += 1;
+        pthread_cond_timedwait(&wake, &lock, &until);
+        if (!running)
+            break;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long sinceFull = (now.tv_sec - lastFull.tv_sec) * 1000 + (now.tv_nsec - lastFull.tv_nsec) / 1000000;
+        int full = intervalMs > 0 && sinceFull >= intervalMs;
+        if (full)
+            lastFull = now;
+
+        pthread_mutex_unlock(&lock);
+        takePending();
+        pthread_mutex_lock(&lock);
+        for (i = 0; i < numDrives && running; i++)
+        {
+            if (!full && !drives[i].suspect)
+                continue;
+            pthread_mutex_unlock(&lock);
+            // still unreachable: try again later.  What a drive holds
+            // may have changed while it was away.
+            snprintf(root, PATH_MAX, "%s/%d", backup, i);
+            if (access(root, W_OK) == 0)
+            {
+                if (full || drives[i].unreachable)
+                    rescanDrive(i);
+                drives[i].unreachable = 0;
+                syncDrive(i);
+            }
+            else
+                drives[i].unreachable = 1;
+            pthread_mutex_lock(&lock);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int aeInit(int drivesCount, const char *masterDir, const char *backupDir, long interval,
+           ae_walk walk, ae_placed placed, ae_repair repair)
+{
+    int i;
+    drives = calloc(drivesCount, sizeof(struct ae_drive));
+    table = calloc(TABLE_SIZE, sizeof(struct ae_entry *));
+    rootdir = strdup(masterDir);
+    backup = strdup(backupDir);
+    if (drives == NULL || table == NULL || rootdir == NULL || backup == NULL)
+    {
+        free(drives);
+        free(table);
+        free(rootdir);
+        free(backup);
+        return -1;
+    }
+    for (i = 0; i < drivesCount; i++)
+    {
+        treeBuild(&drives[i].want);
+        treeBuild(&drives[i].have);
+    }
+    numDrives = drivesCount;
+    intervalMs = interval;
+    walkFn = walk;
+    placedFn = placed;
+    repairFn = repair;
+    running = 1;
+    if (pthread_create(&thread, NULL, aeThread, NULL) != 0)
+    {
+        running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void aeDestroy()
+{
+    struct ae_entry *e;
+    int b;
+    if (!running)
+        return;
+    pthread_mutex_lock(&lock);
+    running = 0;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    for (b = 0; b < TABLE_SIZE; b++)
+        while ((e = table[b]) != NULL)
+        {
+            table[b] = e->next;
+            free(e->path);
+            free(e);
+        }
+    free(table);
+    free(drives);
+    free(rootdir);
+    free(backup);
+}
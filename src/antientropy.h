@@ -0,0 +1,42 @@
+#ifndef _ANTIENTROPY_H_
+#define _ANTIENTROPY_H_
+
+#include <sys/stat.h>
+
+// anti-entropy.  A background thread brings backup drives back in line
+// with the master.  For each drive it keeps two Merkle trees over the
+// ring's key space, one of what the master says the drive should hold
+// and one of what is actually there.  Both are built once at startup,
+// from a walk of the master and a listing of each drive, and after that
+// only the paths reported through aeChanged() are looked at again.  A
+// pass compares the stored trees top down and only visits the paths under
+// the key ranges whose hashes differ: missing or stale copies are
+// repaired and copies the drive shouldn't hold are removed.  Key ranges
+// where a replica update failed are always visited, since a missed
+// overwrite doesn't have to change a size.
+//
+// A drive is synced as soon as it is reachable again after a failure,
+// and every drive is synced every intervalMs if that is > 0.  Both times
+// the drive's have tree is first rebuilt from a fresh listing, since it
+// may have been emptied, restored or edited outside pfs meanwhile.
+#define AE_BITS 10
+#define AE_LEAVES (1 << AE_BITS)
+
+typedef void (*ae_emit)(void *ctx, const char *path, const struct stat *st);
+// call emit with the stat of every path on the master, parents before
+// children
+typedef void (*ae_walk)(ae_emit emit, void *ctx);
+// the drives that should hold a copy of path
+typedef int (*ae_placed)(const char *path, int *drives, int max);
+// copy path, whose master copy is st, onto drive, or remove it from
+// drive if st is NULL; 0 or -1
+typedef int (*ae_repair)(int drive, const char *path, const struct stat *st);
+
+int aeInit(int numDrives, const char *rootdir, const char *backup, long intervalMs,
+           ae_walk walk, ae_placed placed, ae_repair repair);
+void aeChanged(const char *path);
+void aeChangedTree(const char *path);
+void aeSuspect(int drive, const char *path);
+void aeDestroy();
+
+#endif
@@ -0,0 +1,263 @@
+// need this for clock_gettime() under -std=c99
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "attrcache.h"
+#include "hash.h"
+
+struct attr_entry
+{
+    char *path;
+    unsigned long hash;
+    struct stat st;
+    int negative;               // path doesn't exist
+    long long expires;
+    struct attr_entry *next;    // in its bucket
+    struct attr_entry *older;   // in the shard's age list
+    struct attr_entry *newer;
+};
+
+struct attr_shard
+{
+    pthread_mutex_t lock;
+    struct attr_entry **buckets;
+    int numBuckets;             // a power of two
+    int count;
+    int cap;
+    unsigned long gen;
+    struct attr_entry *oldest;
+    struct attr_entry *newest;
+} __attribute__((aligned(64)));
+
+static struct attr_shard *shards = NULL;
+static long long ttlNs = 0;
+
+static long long nowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static struct attr_shard *shardOf(unsigned long hash)
+{
+    return &shards[hash % ATTR_SHARDS];
+}
+
+static struct attr_entry **bucketOf(struct attr_shard *s, unsigned long hash)
+{
+    return &s->buckets[(hash / ATTR_SHARDS) & (s->numBuckets - 1)];
+}
+
+// Caller holds s->lock
+static struct attr_entry *find(struct attr_shard *s, const char *path, unsigned long hash)
+{
+    struct attr_entry *e;
+    for (e = *bucketOf(s, hash); e != NULL; e = e->next)
+    {
+        if (e->hash == hash && !strcmp(e->path, path))
+            return e;
+    }
+    return NULL;
+}
+
+// Caller holds s->lock
+static void unlinkEntry(struct attr_shard *s, struct attr_entry *e)
+{
+    struct attr_entry **p = bucketOf(s, e->hash);
+    while (*p != e)
+        p = &(*p)->next;
+    *p = e->next;
+    if (e->older != NULL)
+        e->older->newer = e->newer;
+    else
+        s->oldest = e->newer;
+    if (e->newer != NULL)
+        e->newer->older = e->older;
+    else
+        s->newest = e->older;
+    s->count--;
+    free(e->path);
+    free(e);
+}
+
+int attrCacheInit(int maxEntries, long ttlMs)
+{
+    int i;
+    int perShard = maxEntries / ATTR_SHARDS > 0 ? maxEntries / ATTR_SHARDS : 1;
+    int numBuckets = 1;
+    while (numBuckets < perShard)
+        numBuckets *= 2;
+
+    if (posix_memalign((void **) &shards, 64, ATTR_SHARDS * sizeof(struct attr_shard)) != 0)
+    {
+        shards = NULL;
+        return -1;
+    }
+    memset(shards, 0, ATTR_SHARDS * sizeof(struct attr_shard));
+    for (i = 0; i < ATTR_SHARDS; i++)
+    {
+        struct attr_shard *s = &shards[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->numBuckets = numBuckets;
+        s->cap = perShard;
+        s->buckets = calloc(numBuckets, sizeof(struct attr_entry *));
+        if (s->buckets == NULL)
+        {
+            attrCacheDestroy();
+            return -1;
+        }
+    }
+    ttlNs = ttlMs * 1000000LL;
+    return 0;
+}
+
+// 1 with *st filled in, 0 if path is known not to exist, -1 if it isn't
+// cached.  *gen is what to hand attrCachePut() with the answer.
+int attrCacheGet(const char *path, struct stat *st, unsigned long *gen)
+{
+    if (shards == NULL)
+        return -1;
+    unsigned long hash = hashFunction(path);
+    struct attr_shard *s = shardOf(hash);
+    int res = -1;
+
+    pthread_mutex_lock(&s->lock);
+    *gen = s->gen;
+    struct attr_entry *e = find(s, path, hash);
+    if (e != NULL && e->expires <= nowNs())
+        unlinkEntry(s, e);
+    else if (e != NULL)
+    {
+        if (!e->negative)
+            *st = e->st;
+        res = !e->negative;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return res;
+}
+
+// Cache path's stat, or that it doesn't exist if st is NULL, unless it
+// may have changed since gen
+static void put(const char *path, unsigned long hash, const struct stat *st, unsigned long gen)
+{
+    // a change through one name of a hard linked file leaves the others
+    // stale, so they aren't kept
+    if (st != NULL && !S_ISDIR(st->st_mode) && st->st_nlink > 1)
+        return;
+    struct attr_shard *s = shardOf(hash);
+
+    pthread_mutex_lock(&s->lock);
+    if (s->gen != gen)
+    {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    struct attr_entry *e = find(s, path, hash);
+    if (e != NULL)
+        unlinkEntry(s, e);
+    if (s->count >= s->cap)
+        unlinkEntry(s, s->oldest);
+    e = malloc(sizeof(struct attr_entry));
+    if (e == NULL || (e->path = strdup(path)) == NULL)
+    {
+        free(e);
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    e->hash = hash;
+    e->negative = st == NULL;
+    if (st != NULL)
+        e->st = *st;
+    e->expires = nowNs() + ttlNs;
+    struct attr_entry **bucket = bucketOf(s, hash);
+    e->next = *bucket;
+    *bucket = e;
+    e->older = s->newest;
+    e->newer = NULL;
+    if (s->newest != NULL)
+        s->newest->newer = e;
+    else
+        s->oldest = e;
+    s->newest = e;
+    s->count++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+// as put(), with gen from the attrCacheGet() that missed
+void attrCachePut(const char *path, const struct stat *st, unsigned long gen)
+{
+    if (shards != NULL)
+        put(path, hashFunction(path), st, gen);
+}
+
+void attrCacheStamp(struct attr_stamp *stamp)
+{
+    int i;
+    for (i = 0; shards != NULL && i < ATTR_SHARDS; i++)
+    {
+        pthread_mutex_lock(&shards[i].lock);
+        stamp->gen[i] = shards[i].gen;
+        pthread_mutex_unlock(&shards[i].lock);
+    }
+}
+
+// as put(), for a stat read after stamp was taken
+void attrCacheFill(const char *path, const struct stat *st, const struct attr_stamp *stamp)
+{
+    if (shards == NULL)
+        return;
+    unsigned long hash = hashFunction(path);
+    put(path, hash, st, stamp->gen[hash % ATTR_SHARDS]);
+}
+
+// path has changed or gone
+void attrCacheInvalidate(const char *path)
+{
+    if (shards == NULL)
+        return;
+    unsigned long hash = hashFunction(path);
+    struct attr_shard *s = shardOf(hash);
+    pthread_mutex_lock(&s->lock);
+    s->gen++;
+    struct attr_entry *e = find(s, path, hash);
+    if (e != NULL)
+        unlinkEntry(s, e);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// everything may have changed, e.g. a directory was renamed
+void attrCacheClear()
+{
+    int i;
+    if (shards == NULL)
+        return;
+    for (i = 0; i < ATTR_SHARDS; i++)
+    {
+        struct attr_shard *s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        s->gen++;
+        while (s->oldest != NULL)
+            unlinkEntry(s, s->oldest);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+void attrCacheDestroy()
+{
+    int i;
+    if (shards == NULL)
+        return;
+    attrCacheClear();
+    for (i = 0; i < ATTR_SHARDS; i++)
+    {
+        pthread_mutex_destroy(&shards[i].lock);
+        free(shards[i].buckets);
+    }
+    free(shards);
+    shards = NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef _ATTRCACHE_H_
+#define _ATTRCACHE_H_
+
+#include <sys/stat.h>
+
+// stat cache.  getattr answers are kept in memory, keyed by path and
+// split over shards with a lock each, so concurrent lookups rarely
+// contend.  Paths that don't exist are cached too.  Entries expire after
+// ttlMs, are evicted oldest first once a shard is full, and are dropped
+// by the callbacks that change them.  Every shard has a generation that
+// drops bump, so an answer looked up before a change can't be put back
+// after it.
+#define ATTR_SHARDS 64
+
+// every shard's generation at one moment, for filling in the paths a
+// directory listing turned up
+struct attr_stamp
+{
+    unsigned long gen[ATTR_SHARDS];
+};
+
+int attrCacheInit(int maxEntries, long ttlMs);
+int attrCacheGet(const char *path, struct stat *st, unsigned long *gen);
+void attrCachePut(const char *path, const struct stat *st, unsigned long gen);
+void attrCacheStamp(struct attr_stamp *stamp);
+void attrCacheFill(const char *path, const struct stat *st, const struct attr_stamp *stamp);
+void attrCacheInvalidate(const char *path);
+void attrCacheClear();
+void attrCacheDestroy();
+
+#endif
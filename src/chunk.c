@@ -0,0 +1,166 @@
+// need this for pread()
+#define _XOPEN_SOURCE 500
+
+#include <errno.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "chunk.h"
+
+#define CHUNK_BUFFER (1024 * 1024)
+
+// FastCDC masks: more bits (harder to match) below the average size and
+// fewer above it, which pulls chunk sizes in towards the average
+#define MASK_S 0x0003590703530000ULL    // 15 bits
+#define MASK_L 0x0000d90003530000ULL    // 11 bits
+
+static uint64_t gear[256];
+static pthread_once_t gearOnce = PTHREAD_ONCE_INIT;
+
+// fixed seed: manifests are kept across restarts, so the cut points
+// must never change
+static void gearInit()
+{
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    int i;
+    for (i = 0; i < 256; i++)
+    {
+        // splitmix64
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// length of the chunk starting at p, n bytes of which are available
+static size_t cutPoint(const unsigned char *p, size_t n)
+{
+    uint64_t fp = 0;
+    size_t normal = CHUNK_AVG;
+    size_t i;
+
+    if (n <= CHUNK_MIN)
+        return n;
+    if (n > CHUNK_MAX)
+        n = CHUNK_MAX;
+    if (normal > n)
+        normal = n;
+
+    // nothing below the minimum can be a cut point, so don't hash it
+    for (i = CHUNK_MIN; i < normal; i++)
+    {
+        fp = (fp << 1) + gear[p[i]];
+        if (!(fp & MASK_S))
+            return i;
+    }
+    for (; i < n; i++)
+    {
+        fp = (fp << 1) + gear[p[i]];
+        if (!(fp & MASK_L))
+            return i;
+    }
+    return n;
+}
+
+// Split everything in fd into chunks, in file order.  *chunks is
+// allocated; the caller frees it.  Returns the number of chunks, or -1
+// with errno set.
+int chunkFile(int fd, struct chunk **chunks)
+{
+    unsigned char *buf = malloc(CHUNK_BUFFER + CHUNK_MAX);
+    size_t have = 0;        // bytes in buf
+    size_t pos = 0;         // start of the next chunk in buf
+    uint64_t offset = 0;    // file offset of buf[pos]
+    off_t readAt = 0;
+    int eof = 0;
+    int n = 0;
+    int cap = 64;
+
+    pthread_once(&gearOnce, gearInit);
+    *chunks = malloc(cap * sizeof(struct chunk));
+    if (buf == NULL || *chunks == NULL)
+    {
+        free(buf);
+        free(*chunks);
+        *chunks = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    while (!eof || pos < have)
+    {
+        // keep at least one maximum sized chunk ahead of pos
+        if (!eof && have - pos < CHUNK_MAX)
+        {
+            memmove(buf, buf + pos, have - pos);
+            have -= pos;
+            pos = 0;
+            while (!eof && have < CHUNK_BUFFER)
+            {
+                ssize_t r = pread(fd, buf + have, CHUNK_BUFFER + CHUNK_MAX - have, readAt);
+                if (r < 0)
+                {
+                    int saved = errno;
+                    free(buf);
+                    free(*chunks);
+                    *chunks = NULL;
+                    errno = saved;
+                    return -1;
+                }
+                if (r == 0)
+                    eof = 1;
+                have += r;
+                readAt += r;
+            }
+            if (pos == have)
+                break;
+        }
+
+        size_t len = cutPoint(buf + pos, have - pos);
+        if (n == cap)
+        {
+            struct chunk *more = realloc(*chunks, 2 * cap * sizeof(struct chunk));
+            if (more == NULL)
+            {
+                free(buf);
+                free(*chunks);
+                *chunks = NULL;
+                errno = ENOMEM;
+                return -1;
+            }
+            *chunks = more;
+            cap *= 2;
+        }
+        (*chunks)[n].offset = offset;
+        (*chunks)[n].len = len;
+        EVP_Digest(buf + pos, len, (*chunks)[n].hash, NULL, EVP_sha256(), NULL);
+        n++;
+        pos += len;
+        offset += len;
+    }
+    free(buf);
+    return n;
+}
+
+static int chunkCompare(const void *a, const void *b)
+{
+    return memcmp(((const struct chunk *) a)->hash, ((const struct chunk *) b)->hash, CHUNK_HASH_LEN);
+}
+
+// order chunks by hash, for chunkFind()
+void chunkSort(struct chunk *chunks, int n)
+{
+    qsort(chunks, n, sizeof(struct chunk), chunkCompare);
+}
+
+// a chunk of sorted with the given hash, or NULL
+const struct chunk *chunkFind(const struct chunk *sorted, int n, const unsigned char *hash)
+{
+    struct chunk key;
+    memcpy(key.hash, hash, CHUNK_HASH_LEN);
+    return bsearch(&key, sorted, n, sizeof(struct chunk), chunkCompare);
+}
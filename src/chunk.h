@@ -0,0 +1,28 @@
+#ifndef _CHUNK_H_
+#define _CHUNK_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// content-defined chunking.  Cut points come from a rolling Gear hash
+// over the data itself (FastCDC, with normalized chunk sizes), so an
+// edit only changes the chunks it touches: everything before and after
+// it is cut the same way as before, even when bytes were inserted.
+#define CHUNK_MIN (2 * 1024)
+#define CHUNK_AVG (8 * 1024)
+#define CHUNK_MAX (64 * 1024)
+#define CHUNK_HASH_LEN 32   // SHA-256
+
+// one entry of a file's manifest; also the on-disk form kept in the index
+struct chunk
+{
+    uint64_t offset;
+    uint32_t len;
+    unsigned char hash[CHUNK_HASH_LEN];
+} __attribute__((packed));
+
+int chunkFile(int fd, struct chunk **chunks);
+const struct chunk *chunkFind(const struct chunk *sorted, int n, const unsigned char *hash);
+void chunkSort(struct chunk *chunks, int n);
+
+#endif
@@ -0,0 +1,193 @@
+// need this for copy_file_range() and splice()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "clone.h"
+
+#define CLONE_CHUNK (1024 * 1024)
+
+int cloneFile(int fd, int fd2)
+{
+    struct stat st;
+    off_t offIn = 0;
+    off_t offOut = 0;
+
+#ifdef FICLONE
+    // shares the extents, so no data is copied at all
+    if (ioctl(fd2, FICLONE, fd) == 0)
+        return 0;
+#endif
+    if (fstat(fd, &st) < 0)
+        return -1;
+
+    // every fallback below carries on from wherever the previous one
+    // stopped, so a partial copy is never redone
+#ifdef HAVE_COPY_FILE_RANGE
+    while (offIn < st.st_size)
+    {
+        ssize_t n = copy_file_range(fd, &offIn, fd2, &offOut, st.st_size - offIn, 0);
+        if (n <= 0)
+            break;
+    }
+    if (offIn >= st.st_size)
+        return 0;
+#endif
+
+#ifdef HAVE_SPLICE
+    int pipefd[2];
+    if (pipe(pipefd) == 0)
+    {
+        while (offIn < st.st_size)
+        {
+            size_t len = st.st_size - offIn < CLONE_CHUNK ? st.st_size - offIn : CLONE_CHUNK;
+            ssize_t n = splice(fd, &offIn, pipefd[1], NULL, len, SPLICE_F_MOVE);
+            if (n <= 0)
+                break;
+            while (n > 0)
+            {
+                ssize_t m = splice(pipefd[0], NULL, fd2, &offOut, n, SPLICE_F_MOVE);
+                if (m <= 0)
+                {
+                    // the pipe still holds data that never reached fd2
+                    int saved = errno;
+                    close(pipefd[0]);
+                    close(pipefd[1]);
+                    errno = m == 0 ? EIO : saved;
+                    return -1;
+                }
+                n -= m;
+            }
+        }
+        close(pipefd[0]);
+        close(pipefd[1]);
+        if (offIn >= st.st_size)
+            return 0;
+    }
+#endif
+
+    char *buf = malloc(CLONE_CHUNK);
+    if (buf == NULL)
+        return -1;
+    while (offIn < st.st_size)
+    {
+        ssize_t n = pread(fd, buf, CLONE_CHUNK, offIn);
+        if (n < 0)
+        {
+            int saved = errno;
+            free(buf);
+            errno = saved;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        ssize_t done = 0;
+        while (done < n)
+        {
+            ssize_t m = pwrite(fd2, buf + done, n - done, offOut);
+            if (m <= 0)
+            {
+                int saved = errno;
+                free(buf);
+                errno = m == 0 ? EIO : saved;
+                return -1;
+            }
+            done += m;
+            offOut += m;
+        }
+        offIn += n;
+    }
+    free(buf);
+    // the file shrank under us; what was there has been copied
+    return 0;
+}
+
+int cloneRange(int fd, off_t offIn, int fd2, off_t offOut, size_t len)
+{
+    off_t end = offIn + len;
+#ifdef HAVE_COPY_FILE_RANGE
+    // a reflink of the range where both files share a filesystem that
+    // can, an in-kernel copy otherwise
+    while (offIn < end)
+    {
+        ssize_t n = copy_file_range(fd, &offIn, fd2, &offOut, end - offIn, 0);
+        if (n <= 0)
+            break;
+    }
+    if (offIn >= end)
+        return 0;
+#endif
+    char buf[64 * 1024];
+    while (offIn < end)
+    {
+        size_t want = end - offIn < (off_t) sizeof(buf) ? end - offIn : sizeof(buf);
+        ssize_t n = pread(fd, buf, want, offIn);
+        if (n <= 0)
+        {
+            if (n == 0)
+                errno = EIO;
+            return -1;
+        }
+        ssize_t done = 0;
+        while (done < n)
+        {
+            ssize_t m = pwrite(fd2, buf + done, n - done, offOut);
+            if (m <= 0)
+            {
+                if (m == 0)
+                    errno = EIO;
+                return -1;
+            }
+            done += m;
+            offOut += m;
+        }
+        offIn += n;
+    }
+    return 0;
+}
+
+int dedupeFile(int fd, int fd2)
+{
+#ifdef FIDEDUPERANGE
+    struct stat st;
+    off_t offset = 0;
+    struct
+    {
+        struct file_dedupe_range range;
+        struct file_dedupe_range_info info;
+    } req;
+
+    if (fstat(fd, &st) < 0)
+        return -1;
+    // filesystems cap the length of one request, so go a chunk at a time
+    while (offset < st.st_size)
+    {
+        memset(&req, 0, sizeof(req));
+        req.range.src_offset = offset;
+        req.range.src_length = st.st_size - offset < 16 * CLONE_CHUNK ? st.st_size - offset : 16 * CLONE_CHUNK;
+        req.range.dest_count = 1;
+        req.info.dest_fd = fd2;
+        req.info.dest_offset = offset;
+        if (ioctl(fd, FIDEDUPERANGE, &req) < 0)
+            return -1;
+        if (req.info.status != FILE_DEDUPE_RANGE_SAME || req.info.bytes_deduped == 0)
+        {
+            errno = req.info.status < 0 ? -req.info.status : EILSEQ;
+            return -1;
+        }
+        offset += req.info.bytes_deduped;
+    }
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
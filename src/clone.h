@@ -0,0 +1,23 @@
+#ifndef _CLONE_H_
+#define _CLONE_H_
+
+#include <sys/types.h>
+
+// copy the whole of fd into fd2 without bouncing the data through user
+// space where the kernel allows it: a reflink first, then
+// copy_file_range, then splice, and plain read/write as a last resort.
+// fd must be open for reading and fd2 for writing, empty.  Returns 0 or
+// -1 with errno set.
+int cloneFile(int fd, int fd2);
+
+// the same for len bytes at offIn in fd, written at offOut in fd2.
+// Returns 0 or -1 with errno set.
+int cloneRange(int fd, off_t offIn, int fd2, off_t offOut, size_t len);
+
+// ask the kernel to make fd2 share fd's extents where the two are
+// byte-for-byte the same, freeing fd2's copy.  The kernel compares the
+// data itself, so a stale idea of what the files hold can't corrupt
+// either.  Returns 0 if all of fd2 now shares, -1 otherwise.
+int dedupeFile(int fd, int fd2);
+
+#endif
@@ -1,180 +1,915 @@
+// need this for clock_gettime() and getdelim() under -std=c99
+#define _XOPEN_SOURCE 700
+
 #include <mysql/mysql.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <mysql/my_config.h>
 #include <mysql/my_global.h>
+#include <mysql/errmsg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
 
 int deleteImage(char path[]);
 int updatePath( char newPath[], char oldPath[]);
 int insertImage(char *path);
 
-int deleteImage(char path[]){
+#define DB_CONNECTIONS 4
+#define DB_PING_AFTER 30	// seconds idle before a connection is checked
+#define DB_DELAY_MS 1000
+#define DB_BATCH 256
+#define DB_CHUNK (64 * 1024)	// image bytes sent per round of long data
+#define DB_DELETE_ROWS 16	// paths per multi-row delete
 
-	int success=1;
-	if(success==1){
-	MYSQL *con = mysql_init(NULL);
-	  
-	if (con == NULL){
-	    success=0;
-	}  
+//  Where the catalog lives, read from the file given to databaseInit()
+struct db_config {
+	char host[256];
+	char user[256];
+	char password[256];
+	char database[256];
+	char socket[256];
+	unsigned int port;
+	unsigned int timeout;
+	int connections;
+	long delayMs;		// longest an op waits before it is sent; 0 sends at once
+	int batch;		// ops per transaction
+	int pending;		// ops queued before callers have to wait, or spill to the journal while the server is away
+	char journal[256];	// where queued ops are logged until committed
+};
 
-	if (mysql_real_connect(con, "pujaridb.csciwcfdboyu.us-east-1.rds.amazonaws.com", "cs3210", "12345678", 
-	    "rpfs", 0, NULL, 0) == NULL) 
-	{
-	   success=0;
-	}
+//  Every statement the catalog runs.  Each is prepared the first time a
+//  connection needs it and then reused with new parameters for as long
+//  as the connection lasts.  A new kind of query only needs an entry
+//  here.
+enum { DB_STMT_INSERT, DB_STMT_DELETE, DB_STMT_DELETE_MANY, DB_STMT_RENAME, DB_STMTS };
+
+static char* dbSql[DB_STMTS];
 
-	char src[50], query[100], end[50];
+//  A pooled connection.  con is NULL until first used, or after the
+//  server went away; it is (re)connected when next handed out.
+struct db_conn {
+	MYSQL* con;
+	time_t lastUsed;
+	MYSQL_STMT* stmts[DB_STMTS];	// NULL until prepared
+};
 
-	strcpy(query, "DELETE from Images WHERE Path='");
-	strcpy(src,  path);
-	strcpy(end,"';");
-  
-  	strcat(query, src);
-  	strcat(query,end);
+static struct db_config config;
+static int configured = 0;
+
+static struct db_conn* pool = NULL;
+static int* idle = NULL;
+static int numIdle = 0;
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolCond = PTHREAD_COND_INITIALIZER;
+static __thread int threadReady = 0;
+
+//  key = value lines; blank lines and lines starting with # are skipped
+static int dbReadConfig(const char* path){
+	FILE* fp = fopen(path, "r");
+	char line[512];
+	int lineNum = 0;
+	if(fp == NULL){
+		perror(path);
+		return -1;
+	}
+	while(fgets(line, sizeof(line), fp) != NULL){
+		char key[64], value[256];
+		lineNum++;
+		line[strcspn(line, "\r\n")] = '\0';
+		char* p = line;
+		while(isspace((unsigned char) *p)) p++;
+		if(*p == '\0' || *p == '#'){
+			continue;
+		}
+		value[0] = '\0';
+		if(sscanf(p, " %63[^= \t] = %255[^\n]", key, value) < 1){
+			fprintf(stderr, "%s:%d: expected key = value\n", path, lineNum);
+			fclose(fp);
+			return -1;
+		}
+		for(int i = strlen(value); i > 0 && isspace((unsigned char) value[i-1]); i--){
+			value[i-1] = '\0';
+		}
+		if(!strcmp(key, "host")) snprintf(config.host, sizeof(config.host), "%s", value);
+		else if(!strcmp(key, "user")) snprintf(config.user, sizeof(config.user), "%s", value);
+		else if(!strcmp(key, "password")) snprintf(config.password, sizeof(config.password), "%s", value);
+		else if(!strcmp(key, "database")) snprintf(config.database, sizeof(config.database), "%s", value);
+		else if(!strcmp(key, "socket")) snprintf(config.socket, sizeof(config.socket), "%s", value);
+		else if(!strcmp(key, "port")) config.port = atoi(value);
+		else if(!strcmp(key, "timeout")) config.timeout = atoi(value);
+		else if(!strcmp(key, "connections")) config.connections = atoi(value);
+		else if(!strcmp(key, "delay")) config.delayMs = atol(value);
+		else if(!strcmp(key, "batch")) config.batch = atoi(value);
+		else if(!strcmp(key, "pending")) config.pending = atoi(value);
+		else if(!strcmp(key, "journal")) snprintf(config.journal, sizeof(config.journal), "%s", value);
+		else{
+			fprintf(stderr, "%s:%d: unknown setting %s\n", path, lineNum, key);
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
 
-  	
-	if (mysql_query(con, query)) {
-	  success=0;
+//  Set up the connection pool from the settings in path.  With no path
+//  the catalog is switched off and the calls below do nothing.  Call
+//  before any other thread uses the database.
+int databaseInit(const char* path){
+	if(path == NULL){
+		return 0;
+	}
+	memset(&config, 0, sizeof(config));
+	snprintf(config.host, sizeof(config.host), "localhost");
+	config.timeout = 5;
+	config.connections = DB_CONNECTIONS;
+	config.delayMs = DB_DELAY_MS;
+	config.batch = DB_BATCH;
+	if(dbReadConfig(path) < 0){
+		return -1;
+	}
+	if(config.connections < 1 || config.database[0] == '\0'){
+		fprintf(stderr, "%s: need a database and at least one connection\n", path);
+		return -1;
+	}
+	if(config.batch < 1){
+		config.batch = 1;
+	}
+	if(config.pending < config.batch){
+		config.pending = 16 * config.batch;
 	}
+	if(mysql_library_init(0, NULL, NULL)){
+		fprintf(stderr, "could not initialize the MySQL client library\n");
+		return -1;
+	}
+	dbSql[DB_STMT_INSERT] = strdup("INSERT INTO Images(Path, Image) VALUES (?, ?)");
+	dbSql[DB_STMT_DELETE] = strdup("DELETE FROM Images WHERE Path = ?");
+	dbSql[DB_STMT_RENAME] = strdup("UPDATE Images SET Path = ? WHERE Path = ?");
+	dbSql[DB_STMT_DELETE_MANY] = malloc(64 + 3 * DB_DELETE_ROWS);
+	strcpy(dbSql[DB_STMT_DELETE_MANY], "DELETE FROM Images WHERE Path IN (?");
+	for(int i = 1; i < DB_DELETE_ROWS; i++){
+		strcat(dbSql[DB_STMT_DELETE_MANY], ",?");
+	}
+	strcat(dbSql[DB_STMT_DELETE_MANY], ")");
 	
-  mysql_close(con);
+	pool = calloc(config.connections, sizeof(struct db_conn));
+	idle = calloc(config.connections, sizeof(int));
+	for(int i = 0; i < config.connections; i++){
+		idle[numIdle++] = i;
+	}
+	configured = 1;
+	return 0;
 }
-  return success;
+
+static MYSQL* dbConnect(){
+	MYSQL* con = mysql_init(NULL);
+	if(con == NULL){
+		log_msg("ERROR database: mysql_init failed\n");
+		return NULL;
+	}
+	mysql_options(con, MYSQL_OPT_CONNECT_TIMEOUT, &config.timeout);
+	if(mysql_real_connect(con, config.host, config.user, config.password, config.database,
+			config.port, config.socket[0] ? config.socket : NULL, 0) == NULL){
+		log_msg("ERROR database: connect to %s: %s\n", config.host, mysql_error(con));
+		mysql_close(con);
+		return NULL;
+	}
+	return con;
 }
 
-int updatePath(char newPath[], char oldPath[]){
-  int success=1;
-  if(success==1){
-  MYSQL *con = mysql_init(NULL);
-  
-  if (con == NULL) 
-  {
-    success=0;
-  }  
+//  Drop the connection in slot along with the statements prepared on it
+static void dbDisconnect(int slot){
+	struct db_conn* c = &pool[slot];
+	for(int i = 0; i < DB_STMTS; i++){
+		if(c->stmts[i] != NULL){
+			mysql_stmt_close(c->stmts[i]);
+			c->stmts[i] = NULL;
+		}
+	}
+	if(c->con != NULL){
+		mysql_close(c->con);
+		c->con = NULL;
+	}
+}
 
-  if (mysql_real_connect(con, "pujaridb.csciwcfdboyu.us-east-1.rds.amazonaws.com", "cs3210", "12345678", 
-          "rpfs", 0, NULL, 0) == NULL) 
-  {
-	success=0;      
-  }    
+//  Take a connection out of the pool, waiting for one if they are all
+//  busy.  One that sat idle for a while is pinged first and replaced if
+//  the server dropped it.  Returns the slot, or -1 if no connection
+//  could be made.
+static int dbAcquire(){
+	if(!threadReady){
+		mysql_thread_init();
+		threadReady = 1;
+	}
+	pthread_mutex_lock(&poolMutex);
+	while(numIdle == 0){
+		pthread_cond_wait(&poolCond, &poolMutex);
+	}
+	int slot = idle[--numIdle];
+	pthread_mutex_unlock(&poolMutex);
 
-  char query[100], end[50], mid[50];
+	struct db_conn* c = &pool[slot];
+	if(c->con != NULL && time(NULL) - c->lastUsed >= DB_PING_AFTER && mysql_ping(c->con) != 0){
+		log_msg("database: connection %d went stale, reconnecting\n", slot);
+		dbDisconnect(slot);
+	}
+	if(c->con == NULL){
+		c->con = dbConnect();
+	}
+	if(c->con == NULL){
+		pthread_mutex_lock(&poolMutex);
+		idle[numIdle++] = slot;
+		pthread_cond_signal(&poolCond);
+		pthread_mutex_unlock(&poolMutex);
+		return -1;
+	}
+	return slot;
+}
 
-  strcpy(query, "UPDATE Images SET Path='");
-  strcpy(mid,"'WHERE Path='");
-  strcpy(end,"';");
-  
-  strcat(query, newPath);
-  strcat(query,mid);
-  strcat(query,oldPath);
-  strcat(query,end);
+static void dbRelease(int slot){
+	pool[slot].lastUsed = time(NULL);
+	pthread_mutex_lock(&poolMutex);
+	idle[numIdle++] = slot;
+	pthread_cond_signal(&poolCond);
+	pthread_mutex_unlock(&poolMutex);
+}
 
-  if(mysql_query(con,query)) {
-     success=0;
-  }
+//  Run query on the connection in slot.  Returns 1 on success.  A broken
+//  connection is dropped so the pool reconnects it next time; *gone then
+//  says whether the server was already gone before the query was sent,
+//  i.e. none of it ran.
+static int dbExec(int slot, const char* query, unsigned long len, int* gone){
+	struct db_conn* c = &pool[slot];
+	if(gone != NULL){
+		*gone = 0;
+	}
+	if(mysql_real_query(c->con, query, len) == 0){
+		return 1;
+	}
+	unsigned int err = mysql_errno(c->con);
+	log_msg("ERROR database: %s\n", mysql_error(c->con));
+	if(err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST){
+		dbDisconnect(slot);
+		if(gone != NULL){
+			*gone = err == CR_SERVER_GONE_ERROR;
+		}
+	}
+	return 0;
+}
 
-  mysql_close(con);
+//  Same for a failed prepared statement, which is otherwise reset so it
+//  can be used again.  Always returns 0.
+static int dbStmtFailed(int slot, MYSQL_STMT* stmt, int* gone){
+	unsigned int err = mysql_stmt_errno(stmt);
+	log_msg("ERROR database: %s\n", mysql_stmt_error(stmt));
+	if(err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST){
+		dbDisconnect(slot);
+		*gone = err == CR_SERVER_GONE_ERROR;
+	}
+	else{
+		mysql_stmt_reset(stmt);
+	}
+	return 0;
 }
-  return success;
+
+//  Statement id on the connection in slot, prepared if this is its
+//  first use there.  NULL on failure.
+static MYSQL_STMT* dbStatement(int slot, int id, int* gone){
+	struct db_conn* c = &pool[slot];
+	if(c->stmts[id] != NULL){
+		return c->stmts[id];
+	}
+	MYSQL_STMT* stmt = mysql_stmt_init(c->con);
+	if(stmt == NULL){
+		log_msg("ERROR database: out of memory\n");
+		return NULL;
+	}
+	if(mysql_stmt_prepare(stmt, dbSql[id], strlen(dbSql[id]))){
+		unsigned int err = mysql_stmt_errno(stmt);
+		log_msg("ERROR database: preparing %s: %s\n", dbSql[id], mysql_stmt_error(stmt));
+		mysql_stmt_close(stmt);
+		if(err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST){
+			dbDisconnect(slot);
+			*gone = err == CR_SERVER_GONE_ERROR;
+		}
+		return NULL;
+	}
+	c->stmts[id] = stmt;
+	return stmt;
 }
 
-int insertImage(char *path){
+//  Execute statement id with n strings as its parameters.  Returns 1 on
+//  success.
+static int dbRunStatement(int slot, int id, const char** params, int n, int* gone){
+	MYSQL_STMT* stmt = dbStatement(slot, id, gone);
+	if(stmt == NULL){
+		return 0;
+	}
+	MYSQL_BIND bind[n];
+	unsigned long lengths[n];
+	memset(bind, 0, sizeof(bind));
+	for(int i = 0; i < n; i++){
+		lengths[i] = strlen(params[i]);
+		bind[i].buffer_type = MYSQL_TYPE_STRING;
+		bind[i].buffer = (char*) params[i];
+		bind[i].buffer_length = lengths[i];
+		bind[i].length = &lengths[i];
+	}
+	if(mysql_stmt_bind_param(stmt, bind) || mysql_stmt_execute(stmt)){
+		return dbStmtFailed(slot, stmt, gone);
+	}
+	return 1;
+}
+
+//  A catalog change.  path is the row it applies to; a rename moves the
+//  row at path to newPath.
+#define DB_INSERT 0
+#define DB_DELETE 1
+#define DB_RENAME 2
+
+struct db_op {
+	int kind;
+	char* path;
+	char* newPath;
+	struct timespec queued;
+	struct db_op* next;
+};
+
+static struct db_op* dbOpNew(int kind, const char* path, const char* newPath){
+	struct db_op* op = calloc(1, sizeof(struct db_op));
+	op->kind = kind;
+	op->path = strdup(path);
+	op->newPath = newPath != NULL ? strdup(newPath) : NULL;
+	clock_gettime(CLOCK_MONOTONIC, &op->queued);
+	return op;
+}
+
+static void dbOpFree(struct db_op* op){
+	free(op->path);
+	free(op->newPath);
+	free(op);
+}
+
+//  Insert each of the run of inserts starting at op.  The image is
+//  streamed from the file DB_CHUNK bytes at a time as long data, so
+//  memory use doesn't grow with its size and it is never escaped.
+//  Returns the op after the run; *ok is cleared on failure.
+static struct db_op* dbRunInserts(int slot, struct db_op* op, int* ok, int* gone){
+	MYSQL_STMT* stmt = dbStatement(slot, DB_STMT_INSERT, gone);
+	char* chunk = malloc(DB_CHUNK);
+	if(stmt == NULL || chunk == NULL){
+		free(chunk);
+		*ok = 0;
+		return op;
+	}
+	for(; *ok && op != NULL && op->kind == DB_INSERT; op = op->next){
+		MYSQL_BIND bind[2];
+		unsigned long pathLen = strlen(op->path);
+		unsigned long noData = 0;
+		size_t n;
+		FILE* fp = fopen(op->path, "rb");
+		if(fp == NULL){
+			log_msg("database: %s is gone, not adding it\n", op->path);
+			continue;
+		}
+		memset(bind, 0, sizeof(bind));
+		bind[0].buffer_type = MYSQL_TYPE_STRING;
+		bind[0].buffer = op->path;
+		bind[0].buffer_length = pathLen;
+		bind[0].length = &pathLen;
+		//only used if no long data is sent, i.e. the file is empty
+		bind[1].buffer_type = MYSQL_TYPE_LONG_BLOB;
+		bind[1].buffer = chunk;
+		bind[1].length = &noData;
+		
+		int failed = mysql_stmt_bind_param(stmt, bind) != 0;
+		while(!failed && (n = fread(chunk, 1, DB_CHUNK, fp)) > 0){
+			failed = mysql_stmt_send_long_data(stmt, 1, chunk, n) != 0;
+		}
+		if(!failed && ferror(fp)){
+			log_msg("ERROR database: reading %s\n", op->path);
+			mysql_stmt_reset(stmt);
+			*ok = 0;
+		}
+		else if(failed || mysql_stmt_execute(stmt)){
+			*ok = dbStmtFailed(slot, stmt, gone);
+		}
+		fclose(fp);
+	}
+	free(chunk);
+	return op;
+}
+
+//  Send the run of ops of one kind starting at op.  Deletes go
+//  DB_DELETE_ROWS to a statement.  Returns the op after the run; *ok is
+//  cleared on failure.
+static struct db_op* dbRunGroup(int slot, struct db_op* op, int* ok, int* gone){
+	const char* params[DB_DELETE_ROWS];
+	int rows = 0;
+	switch(op->kind){
+		case DB_INSERT:
+			return dbRunInserts(slot, op, ok, gone);
+		case DB_DELETE:
+			for(; *ok && op != NULL && op->kind == DB_DELETE; op = op->next){
+				params[rows++] = op->path;
+				if(rows == DB_DELETE_ROWS){
+					*ok = dbRunStatement(slot, DB_STMT_DELETE_MANY, params, rows, gone);
+					rows = 0;
+				}
+			}
+			for(int i = 0; *ok && i < rows; i++){
+				*ok = dbRunStatement(slot, DB_STMT_DELETE, &params[i], 1, gone);
+			}
+			return op;
+		default:
+			for(; *ok && op != NULL && op->kind == DB_RENAME; op = op->next){
+				params[0] = op->newPath;
+				params[1] = op->path;
+				*ok = dbRunStatement(slot, DB_STMT_RENAME, params, 2, gone);
+			}
+			return op;
+	}
+}
+
+//  Apply ops on the connection in slot, in one transaction unless it is
+//  a single op.  *retry is set if it failed without anything having
+//  been committed because the connection broke.
+static int dbTransaction(int slot, struct db_op* ops, int* retry){
+	int ok = 1;
+	int gone = 0;
+	int single = ops->next == NULL;
+	*retry = 0;
+	if(!single && !dbExec(slot, "START TRANSACTION", 17, &gone)){
+		*retry = pool[slot].con == NULL;
+		return 0;
+	}
+	struct db_op* op = ops;
+	while(ok && op != NULL){
+		op = dbRunGroup(slot, op, &ok, &gone);
+	}
+	if(!ok){
+		if(pool[slot].con == NULL){
+			//the server rolls back a transaction whose connection dropped
+			*retry = !single || gone;
+		}
+		else if(!single){
+			dbExec(slot, "ROLLBACK", 8, NULL);
+		}
+		return 0;
+	}
+	if(!single && !dbExec(slot, "COMMIT", 6, &gone)){
+		*retry = gone;
+		return 0;
+	}
+	return 1;
+}
+
+//  Apply ops to the catalog, trying once more on a fresh connection if
+//  it broke before anything was committed.  Returns 1 on success.  On
+//  failure *down says whether it was the connection that failed, rather
+//  than one of the ops.
+static int dbFlush(struct db_op* ops, int* down){
+	*down = 1;
+	for(int attempt = 0; attempt < 2; attempt++){
+		int retry;
+		int slot = dbAcquire();
+		if(slot < 0){
+			return 0;
+		}
+		int ok = dbTransaction(slot, ops, &retry);
+		*down = !ok && pool[slot].con == NULL;
+		dbRelease(slot);
+		if(ok || !retry){
+			return ok;
+		}
+		log_msg("database: connection lost, retrying\n");
+	}
+	return 0;
+}
+
+//  A batch failed on one of its ops: send them one at a time and drop
+//  the ones the server still refuses.  Returns what is left to send if
+//  the connection fails meanwhile, otherwise NULL.
+static struct db_op* dbFlushEach(struct db_op* ops, int* down){
+	*down = 0;
+	while(ops != NULL){
+		struct db_op* next = ops->next;
+		ops->next = NULL;
+		if(!dbFlush(ops, down)){
+			if(*down){
+				ops->next = next;
+				return ops;
+			}
+			log_msg("ERROR database: dropping the %s of %s\n",
+				ops->kind == DB_INSERT ? "insert" : ops->kind == DB_DELETE ? "delete" : "rename", ops->path);
+		}
+		dbOpFree(ops);
+		ops = next;
+	}
+	return NULL;
+}
+
+//  Ops wait here for the sink thread, which sends them in batches once
+//  config.batch have built up or the oldest is config.delayMs old.  An
+//  op that undoes or extends a queued one on the same path is merged
+//  into it, so e.g. create + rename + unlink never reaches the server.
+static struct db_op* sinkHead = NULL;
+static struct db_op* sinkTail = NULL;
+static int sinkOps = 0;
+static pthread_mutex_t sinkLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sinkWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sinkSpace = PTHREAD_COND_INITIALIZER;
+static pthread_t sinkThread;
+static int sinkRunning = 0;
+static int sinkStopping = 0;
+static int sinkDown = 0;		// the last send failed on the connection
+static FILE* journal = NULL;
+//  While the server is away and the queue is full, ops only go to the
+//  journal.  The spilled ones are its last records, from spillOffset on,
+//  and are read back in as the queue drains.
+static int spilled = 0;
+static long spillOffset = 0;
+
+static long elapsedMs(const struct timespec* since){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+//  wait on sinkWork for at most ms
+static void sinkWait(long ms){
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += ms / 1000;
+	deadline.tv_nsec += (ms % 1000) * 1000000;
+	if(deadline.tv_nsec >= 1000000000){
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(&sinkWork, &sinkLock, &deadline);
+}
+
+//  sinkLock held for all of the sink* calls below
+
+static void sinkAppend(struct db_op* op){
+	op->next = NULL;
+	if(sinkTail == NULL){
+		sinkHead = op;
+	}
+	else{
+		sinkTail->next = op;
+	}
+	sinkTail = op;
+	sinkOps++;
+}
+
+static void sinkRemove(struct db_op* op, struct db_op* prev){
+	if(prev == NULL){
+		sinkHead = op->next;
+	}
+	else{
+		prev->next = op->next;
+	}
+	if(sinkTail == op){
+		sinkTail = prev;
+	}
+	sinkOps--;
+	dbOpFree(op);
+}
+
+//  The latest queued op on the row at path, and the op before it
+static struct db_op* sinkFind(const char* path, struct db_op** prev){
+	struct db_op* found = NULL;
+	struct db_op* p = NULL;
+	*prev = NULL;
+	for(struct db_op* op = sinkHead; op != NULL; p = op, op = op->next){
+		if(!strcmp(op->kind == DB_RENAME ? op->newPath : op->path, path)){
+			found = op;
+			*prev = p;
+		}
+	}
+	return found;
+}
+
+static void sinkAdd(int kind, const char* path, const char* newPath){
+	struct db_op* prev;
+	struct db_op* m = sinkFind(path, &prev);
+	if(m != NULL){
+		switch(kind){
+			case DB_INSERT:
+				//the file is only read when the insert is sent
+				if(m->kind == DB_INSERT){
+					return;
+				}
+				break;
+			case DB_DELETE:
+				//never reached the server
+				if(m->kind == DB_INSERT){
+					sinkRemove(m, prev);
+					return;
+				}
+				//the row is still under its old name there
+				if(m->kind == DB_RENAME){
+					m->kind = DB_DELETE;
+					free(m->newPath);
+					m->newPath = NULL;
+					return;
+				}
+				break;
+			case DB_RENAME:
+				//insert it under the new name instead, after anything
+				//queued since on that name
+				if(m->kind == DB_INSERT){
+					sinkRemove(m, prev);
+					sinkAppend(dbOpNew(DB_INSERT, newPath, NULL));
+					return;
+				}
+				if(m->kind == DB_RENAME && m == sinkTail){
+					free(m->newPath);
+					m->newPath = strdup(newPath);
+					return;
+				}
+				break;
+		}
+	}
+	sinkAppend(dbOpNew(kind, path, newPath));
+}
+
+//  The journal holds every op not yet committed, one record each: the
+//  kind, then the path and the new path, each ending in a NUL.
+static void journalWrite(int kind, const char* path, const char* newPath){
+	fseek(journal, 0, SEEK_END);
+	fprintf(journal, "%d%s%c%s%c", kind, path, '\0', newPath != NULL ? newPath : "", '\0');
+}
+
+static void journalRewrite(){
+	fseek(journal, 0, SEEK_END);
+	if(ftruncate(fileno(journal), 0) < 0){
+		log_msg("ERROR database: truncating the journal: %s\n", strerror(errno));
+		return;
+	}
+	for(struct db_op* op = sinkHead; op != NULL; op = op->next){
+		journalWrite(op->kind, op->path, op->newPath);
+	}
+	fflush(journal);
+}
+
+//  Read spilled ops back into the queue while there is room
+static void journalLoad(){
+	char* path = NULL;
+	char* newPath = NULL;
+	size_t pathCap = 0, newPathCap = 0;
+	fseek(journal, spillOffset, SEEK_SET);
+	while(spilled > 0 && sinkOps < config.pending &&
+	      getdelim(&path, &pathCap, '\0', journal) > 1 &&
+	      getdelim(&newPath, &newPathCap, '\0', journal) > 0){
+		int kind = path[0] - '0';
+		spilled--;
+		if(kind >= DB_INSERT && kind <= DB_RENAME && (kind != DB_RENAME || newPath[0] != '\0')){
+			sinkAdd(kind, path + 1, kind == DB_RENAME ? newPath : NULL);
+		}
+	}
+	spillOffset = ftell(journal);
+	free(path);
+	free(newPath);
+	//whatever is left can't be read; the journal holds it for next time
+	if(spilled > 0 && feof(journal)){
+		log_msg("ERROR database: %d spilled ops missing from %s\n", spilled, config.journal);
+		spilled = 0;
+	}
+	if(spilled == 0){
+		journalRewrite();
+	}
+}
 
-  int success=1;
-  if(success){
-  	fprintf(stderr,"mysql_init\n");
-  MYSQL *con = mysql_init(NULL);
-  fprintf(stderr,"mysql_init done\n");
-  
-  if (con == NULL) 
-  {
-    success=0;
-  }  
-fprintf(stderr,"mysql_connect begin\n");
-  if (mysql_real_connect(con, "pujaridb.csciwcfdboyu.us-east-1.rds.amazonaws.com", "cs3210", "12345678", 
-          "rpfs", 0, NULL, 0) == NULL) 
-	{
-	  success=0;
-	}
-fprintf(stderr,"mysql_connect done\n");
-	int lenStr = strlen(path)*2;
-	char buffer[lenStr];
-	int j= 0;
-
-	for( size_t i = 0; i < strlen(path); i++ )
-	{ 
-	    buffer[j] = path[i];
-	    if(path[i]=='/'){
-	      j++;
-	      buffer[j]='/';
-	    }
-	    j++;
-	}
-	buffer[j]='\0';
-
-	  FILE *fp = fopen(buffer, "rb");
-	  
-	  if (fp == NULL) 
-	  {
-	      success=0;
-	  }
-	      
-	  fseek(fp, 0, SEEK_END);
-	  
-	  if (ferror(fp)) {
-	  	success=0;
-	  }  
-	  
-	  int flen = ftell(fp);
-	  
-	  if (flen == -1) {
-	  	success=0;
-	  }
-	  
-	  fseek(fp, 0, SEEK_SET);
-	  
-	  if (ferror(fp)) {
-		success=0;
-	  }
-
-	  char data[flen+1];
-
-	  int size = fread(data, 1, flen, fp);
-	  
-	  if (ferror(fp)) {
-	      success=0;   
-	  }
-	  
-	  int r = fclose(fp);
-	  if (r == EOF) {
-	      fprintf(stderr, "cannot close file handler\n");
-	  }          
-	    
-	  char chunk[2*size+1];
-	  mysql_real_escape_string(con, chunk, data, size);
-
-	 char st1[] = "INSERT INTO Images(Path, Image) VALUES('";
-	  //printf("Doing string concatenation\n");
-	  char* st = calloc(1000,sizeof(char));
-	  strcpy(st,st1);
-	  strcat(st,path);
-	  strcat(st, "','%s');");
-	  
-	  size_t st_len = strlen(st);
-
-	  char query[st_len + 2*size+1]; 
-	  int len = snprintf(query, st_len + 2*size+1, st, chunk);
-	  fprintf(stderr,"query begin\n");
-	  if (mysql_real_query(con, query, len))
-	  {
-	    success=0;
-	  }
-fprintf(stderr,"query done\n");
-	  mysql_close(con);
-	  fprintf(stderr,"Closed connection\n");
-	}
-	//fclose(logfile);
- return success;
+//  Queue up whatever a previous run left in the journal
+static void journalReplay(){
+	char* path = NULL;
+	char* newPath = NULL;
+	size_t pathCap = 0, newPathCap = 0;
+	rewind(journal);
+	while(getdelim(&path, &pathCap, '\0', journal) > 1 &&
+	      getdelim(&newPath, &newPathCap, '\0', journal) > 0){
+		int kind = path[0] - '0';
+		if(kind < DB_INSERT || kind > DB_RENAME || (kind == DB_RENAME && newPath[0] == '\0')){
+			log_msg("ERROR database: bad journal record\n");
+			break;
+		}
+		sinkAdd(kind, path + 1, kind == DB_RENAME ? newPath : NULL);
+	}
+	free(path);
+	free(newPath);
+	if(sinkOps > 0){
+		log_msg("database: %d ops left over in %s\n", sinkOps, config.journal);
+	}
+	journalRewrite();
+}
+
+static void* sinkWorker(void* arg){
+	pthread_mutex_lock(&sinkLock);
+	while(1){
+		if(spilled > 0 && sinkOps < config.pending){
+			journalLoad();
+		}
+		while(!sinkStopping && (sinkHead == NULL ||
+		      (sinkOps < config.batch && elapsedMs(&sinkHead->queued) < config.delayMs))){
+			if(sinkHead == NULL){
+				pthread_cond_wait(&sinkWork, &sinkLock);
+			}
+			else{
+				sinkWait(config.delayMs - elapsedMs(&sinkHead->queued));
+			}
+		}
+		if(sinkHead == NULL){
+			break;
+		}
+		
+		//take a batch off the front
+		struct db_op* batch = sinkHead;
+		struct db_op* last = batch;
+		int n = 1;
+		while(n < config.batch && last->next != NULL){
+			last = last->next;
+			n++;
+		}
+		sinkHead = last->next;
+		if(sinkHead == NULL){
+			sinkTail = NULL;
+		}
+		last->next = NULL;
+		sinkOps -= n;
+		pthread_cond_broadcast(&sinkSpace);
+		pthread_mutex_unlock(&sinkLock);
+		
+		int down;
+		int ok = dbFlush(batch, &down);
+		if(!ok && !down){
+			//an op the server won't take; it mustn't hold up the rest
+			batch = dbFlushEach(batch, &down);
+			ok = batch == NULL;
+		}
+		
+		pthread_mutex_lock(&sinkLock);
+		sinkDown = !ok;
+		if(ok){
+			while(batch != NULL){
+				struct db_op* next = batch->next;
+				dbOpFree(batch);
+				batch = next;
+			}
+			if(journal != NULL && spilled == 0){
+				journalRewrite();
+			}
+			continue;
+		}
+		//the server is away: put what is left back in front and try
+		//again after a while
+		for(n = 1, last = batch; last->next != NULL; last = last->next){
+			n++;
+		}
+		last->next = sinkHead;
+		sinkHead = batch;
+		if(sinkTail == NULL){
+			sinkTail = last;
+		}
+		sinkOps += n;
+		log_msg("ERROR database: %d ops not sent, retrying in %ld ms\n", sinkOps + spilled, config.delayMs);
+		if(sinkStopping){
+			break;
+		}
+		sinkWait(config.delayMs);
+	}
+	pthread_mutex_unlock(&sinkLock);
+	return NULL;
+}
+
+//  Start sending catalog changes in the background.  Has to run in the
+//  process that serves the filesystem, after FUSE has forked.
+int databaseStart(){
+	if(!configured || config.delayMs <= 0){
+		return 0;
+	}
+	if(config.journal[0] != '\0'){
+		journal = fopen(config.journal, "a+");
+		if(journal == NULL){
+			log_msg("ERROR database: journal %s: %s\n", config.journal, strerror(errno));
+			return -1;
+		}
+		journalReplay();
+	}
+	if(pthread_create(&sinkThread, NULL, sinkWorker, NULL) != 0){
+		return -1;
+	}
+	sinkRunning = 1;
+	return 0;
+}
+
+//  Sends whatever is still queued first
+void databaseDestroy(){
+	if(!configured){
+		return;
+	}
+	if(sinkRunning){
+		pthread_mutex_lock(&sinkLock);
+		sinkStopping = 1;
+		pthread_cond_broadcast(&sinkWork);
+		pthread_cond_broadcast(&sinkSpace);
+		pthread_mutex_unlock(&sinkLock);
+		pthread_join(sinkThread, NULL);
+		sinkRunning = 0;
+		if(sinkOps + spilled > 0){
+			log_msg("ERROR database: %d ops never sent%s\n", sinkOps + spilled,
+				journal != NULL ? ", kept in the journal" : "");
+		}
+		while(sinkHead != NULL){
+			struct db_op* next = sinkHead->next;
+			dbOpFree(sinkHead);
+			sinkHead = next;
+		}
+		sinkTail = NULL;
+		sinkOps = 0;
+	}
+	if(journal != NULL){
+		fclose(journal);
+		journal = NULL;
+	}
+	for(int i = 0; i < config.connections; i++){
+		dbDisconnect(i);
+	}
+	for(int i = 0; i < DB_STMTS; i++){
+		free(dbSql[i]);
+		dbSql[i] = NULL;
+	}
+	free(pool);
+	free(idle);
+	configured = 0;
+	mysql_library_end();
+}
+
+//  Queue the change for the sink, or apply it now if there is none.
+//  Returns 1 unless it was applied now and failed.
+static int dbSubmit(int kind, const char* path, const char* newPath){
+	if(!configured){
+		return 1;
+	}
+	if(!sinkRunning){
+		struct db_op* op = dbOpNew(kind, path, newPath);
+		int down;
+		int ok = dbFlush(op, &down);
+		dbOpFree(op);
+		return ok;
+	}
+	pthread_mutex_lock(&sinkLock);
+	//only a server that is keeping up holds callers back
+	while(sinkOps >= config.pending && !sinkStopping && !sinkDown && spilled == 0){
+		pthread_cond_wait(&sinkSpace, &sinkLock);
+	}
+	if(spilled > 0 || (sinkOps >= config.pending && sinkDown)){
+		if(journal == NULL){
+			pthread_mutex_unlock(&sinkLock);
+			log_msg("ERROR database: the server is away and the queue is full, dropping %s\n", path);
+			return 0;
+		}
+		//behind the queue in the journal, and in order after it
+		if(spilled == 0){
+			fflush(journal);
+			fseek(journal, 0, SEEK_END);
+			spillOffset = ftell(journal);
+		}
+		journalWrite(kind, path, newPath);
+		fflush(journal);
+		spilled++;
+		pthread_mutex_unlock(&sinkLock);
+		return 1;
+	}
+	if(journal != NULL){
+		journalWrite(kind, path, newPath);
+		fflush(journal);
+	}
+	sinkAdd(kind, path, newPath);
+	//the worker waits for a full batch, or for anything at all
+	if(sinkOps >= config.batch || sinkOps == 1){
+		pthread_cond_signal(&sinkWork);
+	}
+	pthread_mutex_unlock(&sinkLock);
+	return 1;
+}
+
+int deleteImage(char path[]){
+	return dbSubmit(DB_DELETE, path, NULL);
+}
+
+int updatePath(char newPath[], char oldPath[]){
+	return dbSubmit(DB_RENAME, oldPath, newPath);
+}
+
+//  The image itself is read from path when the insert is sent
+int insertImage(char *path){
+	return dbSubmit(DB_INSERT, path, NULL);
 }
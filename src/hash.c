@@ -1,172 +1,319 @@
+// need this for pthread rwlocks and sched_yield() under -std=c99
+#define _XOPEN_SOURCE 500
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <string.h>
 #include <stdint.h>
-//#include "pfs.h"
+#include <pthread.h>
+#include <sched.h>
+#include "hash.h"
 
 #define get16bits(d) ((((uint32_t)(((const uint8_t *)(d))[1])) << 8) +(uint32_t)(((const uint8_t *)(d))[0]))
 
-//hash function stuff
-unsigned long hashFunction(char *str);
-void addNode(char *mount);
-void removeNode(char *mount);
-struct node *search(char *key);
-void printList();
-int getSize();
-
+// The ring is published as an immutable snapshot.  Readers never lock:
+// they announce the epoch they started in, load the current snapshot and
+// clear their announcement when done.  Writers serialize on ringMutex,
+// build a modified copy, swap it in and free the old snapshot once no
+// reader that could still see it is left (epoch based reclamation).
+#define MAX_READERS 256
 
-struct node
+struct readerSlot
 {
-    unsigned long hash;
-    char *mount;
-    struct node *next;
+    unsigned long epoch;    // 0 when not inside a read section
+    int inUse;
+    int depth;
+    char pad[64 - sizeof(unsigned long) - 2 * sizeof(int)];
 };
 
-struct node *head;
-int size = 0;
+static struct ring emptyRing = { NULL, NULL, 0 };
+static struct ring *current = &emptyRing;
+static unsigned long globalEpoch = 1;
+static struct readerSlot readers[MAX_READERS];
+static pthread_mutex_t ringMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t slotKey;
+static pthread_once_t slotKeyOnce = PTHREAD_ONCE_INIT;
+static __thread struct readerSlot *mySlot = NULL;
 
-int getSize(){
-	return size;
+// FUSE worker threads come and go, so hand the slot back when one exits
+static void releaseSlot(void *slot)
+{
+    __atomic_store_n(&((struct readerSlot *) slot)->inUse, 0, __ATOMIC_RELEASE);
 }
 
-void addNode(char *mount)
-{	
-	printf("Entered addNode\n");
-    unsigned long hash = hashFunction(mount);
-    if (size == 0)
-    {
-        head = (struct node *) malloc(sizeof(struct node));
-        head->hash = hash;
-        head->mount = mount;
-        head->next = head;
-    }
-    else if (strcmp(head->mount, mount) == 0)
+static void makeSlotKey()
+{
+    pthread_key_create(&slotKey, releaseSlot);
+}
+
+static struct readerSlot *getSlot()
+{
+    int i;
+    if (mySlot != NULL)
+        return mySlot;
+
+    pthread_once(&slotKeyOnce, makeSlotKey);
+    for (;;)
     {
-        return;
+        for (i = 0; i < MAX_READERS; i++)
+        {
+            int unused = 0;
+            if (__atomic_compare_exchange_n(&readers[i].inUse, &unused, 1, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            {
+                mySlot = &readers[i];
+                pthread_setspecific(slotKey, mySlot);
+                return mySlot;
+            }
+        }
+        sched_yield();      // every slot taken; wait for a thread to exit
     }
-    else
+}
+
+// enter a read section and return the current snapshot.  The snapshot
+// stays valid until the matching ringReadUnlock().  Sections may nest.
+const struct ring *ringReadLock()
+{
+    struct readerSlot *slot = getSlot();
+    if (slot->depth++ == 0)
+        __atomic_store_n(&slot->epoch, __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&current, __ATOMIC_SEQ_CST);
+}
+
+void ringReadUnlock()
+{
+    struct readerSlot *slot = mySlot;
+    if (--slot->depth == 0)
+        __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// swap in next and free the old snapshot once every reader that entered
+// before the swap has left.  Called with ringMutex held.
+static void publish(struct ring *next)
+{
+    struct ring *old = __atomic_exchange_n(&current, next, __ATOMIC_SEQ_CST);
+    unsigned long retired = __atomic_add_fetch(&globalEpoch, 1, __ATOMIC_SEQ_CST);
+    int i;
+
+    for (i = 0; i < MAX_READERS; i++)
     {
-        if (hash < head->hash)  // less than head
+        for (;;)
         {
-            printf("Here\n");
-            struct node *newNode = (struct node *) malloc(sizeof(struct node));
-            newNode->next = head->next;
-            head->next = newNode;
-            newNode->hash = head->hash;
-            newNode->mount = head->mount;
-            head->hash = hash;
-            head->mount = mount;
+            unsigned long epoch = __atomic_load_n(&readers[i].epoch, __ATOMIC_SEQ_CST);
+            if (epoch == 0 || epoch >= retired)
+                break;
+            sched_yield();
         }
-        else    // greater than head
-        {
-            struct node *curr = head;
+    }
 
-            while (curr->next != head) // tail
-            {
-                if (strcmp(curr->next->mount, mount) == 0)   // mount exists
-                    return;
-                if (hash < curr->next->hash)
-                    break;
-                curr = curr->next;
-            }
+    if (old != &emptyRing)
+    {
+        free(old->nodes);
+        free(old->tokens);
+        free(old);
+    }
+}
 
-            struct node *newNode = (struct node *) malloc(sizeof(struct node));
-            newNode->hash = hash;
-            newNode->mount = mount;
-            newNode->next = curr->next;
-            curr->next = newNode;
-        }
+static struct ring *allocRing(int size)
+{
+    struct ring *r = malloc(sizeof(struct ring));
+    if (r == NULL)
+        return NULL;
+    r->nodes = malloc((size > 0 ? size : 1) * sizeof(struct node));
+    r->tokens = malloc((size > 0 ? size : 1) * sizeof(unsigned long));
+    r->size = size;
+    if (r->nodes == NULL || r->tokens == NULL)
+    {
+        free(r->nodes);
+        free(r->tokens);
+        free(r);
+        return NULL;
     }
-    size++;
+    return r;
 }
 
+int getSize(){
+	const struct ring *r = ringReadLock();
+	int size = r->size;
+	ringReadUnlock();
+	return size;
+}
 
-void removeNode(char *mount)
+// index of the first token whose hash is greater than hash, or size if
+// there is none
+static int upperBound(const struct ring *r, unsigned long hash)
 {
-    if (size == 1)
+    int lo = 0;
+    int hi = r->size;
+    while (lo < hi)
     {
-        head = NULL;
+        int mid = lo + (hi - lo) / 2;
+        if (r->tokens[mid] <= hash)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    else if (strcmp(head->mount, mount) == 0)
+    return lo;
+}
+
+static int compareNodes(const void *a, const void *b)
+{
+    unsigned long ha = ((const struct node *) a)->hash;
+    unsigned long hb = ((const struct node *) b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+// give mount numTokens virtual nodes, hashed from "mount#0", "mount#1", ...
+void addNode(char *mount, int drive, int numTokens)
+{
+    char *name;
+    size_t nameLen = strlen(mount) + 16;
+    int i;
+
+    if (numTokens < 1)
+        numTokens = 1;
+
+    pthread_mutex_lock(&ringMutex);
+    const struct ring *old = current;
+    for (i = 0; i < old->size; i++)
     {
-        struct node *headNext = head->next;
-        head->hash = headNext->hash;
-        head->mount = headNext->mount;
-        head->next = headNext->next;
+        if (strcmp(old->nodes[i].mount, mount) == 0)  // mount exists
+        {
+            pthread_mutex_unlock(&ringMutex);
+            return;
+        }
     }
-    else
+
+    struct ring *next = allocRing(old->size + numTokens);
+    name = malloc(nameLen);
+    if (next == NULL || name == NULL)
     {
-        struct node *curr = head;
-        while (curr->next != head)
+        free(name);
+        if (next != NULL)
         {
-            if (strcmp(curr->next->mount, mount) == 0)
-                break;
-            curr = curr->next;
+            free(next->nodes);
+            free(next->tokens);
+            free(next);
         }
-        if (curr->next == head)     // not found
-            return;
-        curr->next = curr->next->next;
+        pthread_mutex_unlock(&ringMutex);
+        return;
+    }
+
+    memcpy(next->nodes, old->nodes, old->size * sizeof(struct node));
+    for (i = 0; i < numTokens; i++)
+    {
+        struct node *n = &next->nodes[old->size + i];
+        snprintf(name, nameLen, "%s#%d", mount, i);
+        n->hash = hashFunction(name);
+        n->mount = mount;
+        n->drive = drive;
     }
-    size--;
+    free(name);
+
+    qsort(next->nodes, next->size, sizeof(struct node), compareNodes);
+    for (i = 0; i < next->size; i++)
+        next->tokens[i] = next->nodes[i].hash;
+
+    publish(next);
+    pthread_mutex_unlock(&ringMutex);
 }
 
 
-struct node *search(char *key)
+// drop every virtual node belonging to mount
+void removeNode(char *mount)
 {
-    unsigned long hash = hashFunction(key);
-    struct node *curr = head;
-    if (hash < curr->hash)
+    int i;
+    int kept = 0;
+
+    pthread_mutex_lock(&ringMutex);
+    const struct ring *old = current;
+    struct ring *next = allocRing(old->size);
+    if (next == NULL)
     {
-        return curr;
+        pthread_mutex_unlock(&ringMutex);
+        return;
     }
-    else
+    for (i = 0; i < old->size; i++)
     {
-        while (curr->next != head)
-        {
-            if (hash < curr->next->hash)
-                return curr;
-            curr = curr->next;
-        }
-        return head;
+        if (strcmp(old->nodes[i].mount, mount) == 0)
+            continue;
+        next->nodes[kept] = old->nodes[i];
+        next->tokens[kept] = old->tokens[i];
+        kept++;
     }
+    next->size = kept;
+
+    publish(next);
+    pthread_mutex_unlock(&ringMutex);
 }
 
 
-unsigned long hashFunction(char *str)
+// the node owning key is the first token clockwise from its hash
+const struct node *ringSearch(const struct ring *r, const char *key)
+{
+    if (r->size == 0)
+        return NULL;
+
+    int pos = upperBound(r, hashFunction(key));
+    if (pos == r->size)
+        pos = 0;
+    return &r->nodes[pos];
+}
+
+// lookup outside a read section; the node is returned by value because
+// the snapshot it came from may be freed as soon as we leave.  drive is
+// -1 if the ring is empty.
+struct node search(const char *key)
 {
-    unsigned long hash = 0;
-    int c = 0;
+    struct node found = { 0, NULL, -1 };
+    const struct ring *r = ringReadLock();
+    const struct node *n = ringSearch(r, key);
+    if (n != NULL)
+        found = *n;
+    ringReadUnlock();
+    return found;
+}
 
-    while (c == *str++)
-        hash = c + (hash << 6) + (hash << 16) - hash;
 
-    unsigned long tmp, len;
-    int rem = 0;
-    len = 4;
+// hash functions.  Each one maps a byte string onto the full 64 bit
+// ring; the ring itself only calls hashFunction(), which dispatches to
+// whichever algorithm setHashFunction() picked.
+
+// Paul Hsieh's SuperFastHash over the whole string.  It only produces
+// 32 bits, so the result is repeated in the high word to cover the ring.
+static unsigned long hashSuperFast(const char *data, size_t len)
+{
+    uint32_t hash = len, tmp;
+    int rem;
+
+    if (len == 0)
+        return 0;
 
+    rem = len & 3;
+    len >>= 2;
 
     /* Main loop */
     for (;len > 0; len--) {
-        hash  += get16bits (str);
-        tmp    = (get16bits (str+2) << 11) ^ hash;
+        hash  += get16bits (data);
+        tmp    = (get16bits (data+2) << 11) ^ hash;
         hash   = (hash << 16) ^ tmp;
-        str  += 2*sizeof (uint16_t);
+        data  += 2*sizeof (uint16_t);
         hash  += hash >> 11;
     }
 
     /* Handle end cases */
     switch (rem) {
-        case 3: hash += get16bits (str);
+        case 3: hash += get16bits (data);
                 hash ^= hash << 16;
-                hash ^= ((signed char)str[sizeof (uint16_t)]) << 18;
+                hash ^= ((signed char)data[sizeof (uint16_t)]) << 18;
                 hash += hash >> 11;
                 break;
-        case 2: hash += get16bits (str);
+        case 2: hash += get16bits (data);
                 hash ^= hash << 11;
                 hash += hash >> 17;
                 break;
-        case 1: hash += (signed char)*str;
+        case 1: hash += (signed char)*data;
                 hash ^= hash << 10;
                 hash += hash >> 1;
     }
@@ -179,23 +326,278 @@ unsigned long hashFunction(char *str)
     hash ^= hash << 25;
     hash += hash >> 6;
 
+    return ((unsigned long) hash << 32) | hash;
+}
+
+static unsigned long hashFnv1a(const char *data, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t i;
+    for (i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t) data[i];
+        hash *= 0x100000001b3ULL;
+    }
     return hash;
 }
 
+static inline uint64_t read64(const char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
 
-void printList()
+static inline uint64_t read32(const char *p)
 {
-    struct node *curr = head;
-    int i;
-    printf("Head\n");
-    for (i = 0; i < size; i++)
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxhRound(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxhMergeRound(uint64_t acc, uint64_t val)
+{
+    acc ^= xxhRound(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// XXH64, seed 0.  The bulk loop runs four independent lanes of 8 bytes
+// so the multiplies pipeline.
+static unsigned long hashXXH64(const char *data, size_t len)
+{
+    const char *end = data + len;
+    uint64_t hash;
+
+    if (len >= 32)
+    {
+        const char *limit = end - 32;
+        uint64_t v1 = XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = XXH_PRIME64_2;
+        uint64_t v3 = 0;
+        uint64_t v4 = -XXH_PRIME64_1;
+        do
+        {
+            v1 = xxhRound(v1, read64(data));
+            v2 = xxhRound(v2, read64(data + 8));
+            v3 = xxhRound(v3, read64(data + 16));
+            v4 = xxhRound(v4, read64(data + 24));
+            data += 32;
+        } while (data <= limit);
+
+        hash = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        hash = xxhMergeRound(hash, v1);
+        hash = xxhMergeRound(hash, v2);
+        hash = xxhMergeRound(hash, v3);
+        hash = xxhMergeRound(hash, v4);
+    }
+    else
     {
-        printf("%lu  ==  %s\n", curr->hash, curr->mount);
-        curr = curr->next;
+        hash = XXH_PRIME64_5;
     }
 
+    hash += len;
+
+    while (data + 8 <= end)
+    {
+        hash ^= xxhRound(0, read64(data));
+        hash = rotl64(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        data += 8;
+    }
+    if (data + 4 <= end)
+    {
+        hash ^= read32(data) * XXH_PRIME64_1;
+        hash = rotl64(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        data += 4;
+    }
+    while (data < end)
+    {
+        hash ^= (uint8_t) *data * XXH_PRIME64_5;
+        hash = rotl64(hash, 11) * XXH_PRIME64_1;
+        data++;
+    }
+
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
 }
 
+static const uint64_t wyp[4] = {
+    0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL,
+    0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL
+};
+
+static inline void wymum(uint64_t *a, uint64_t *b)
+{
+    __uint128_t r = *a;
+    r *= *b;
+    *a = (uint64_t) r;
+    *b = (uint64_t) (r >> 64);
+}
 
+static inline uint64_t wymix(uint64_t a, uint64_t b)
+{
+    wymum(&a, &b);
+    return a ^ b;
+}
 
+static inline uint64_t wyr3(const char *p, size_t k)
+{
+    return ((uint64_t) (uint8_t) p[0] << 16) |
+           ((uint64_t) (uint8_t) p[k >> 1] << 8) |
+           (uint8_t) p[k - 1];
+}
 
+// wyhash, seed 0.  Strings longer than 48 bytes go through three
+// independent 128 bit multiply lanes.
+static unsigned long hashWy(const char *data, size_t len)
+{
+    const char *p = data;
+    uint64_t seed = wymix(wyp[0], wyp[1]);
+    uint64_t a, b;
+
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            a = (read32(p) << 32) | read32(p + ((len >> 3) << 2));
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if (len > 0)
+        {
+            a = wyr3(p, len);
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        size_t i = len;
+        if (i > 48)
+        {
+            uint64_t see1 = seed, see2 = seed;
+            do
+            {
+                seed = wymix(read64(p) ^ wyp[1], read64(p + 8) ^ seed);
+                see1 = wymix(read64(p + 16) ^ wyp[2], read64(p + 24) ^ see1);
+                see2 = wymix(read64(p + 32) ^ wyp[3], read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16)
+        {
+            seed = wymix(read64(p) ^ wyp[1], read64(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+
+    a ^= wyp[1];
+    b ^= seed;
+    wymum(&a, &b);
+    return wymix(a ^ wyp[0] ^ len, b ^ wyp[1]);
+}
+
+const struct hashAlgorithm hashAlgorithms[] = {
+    { "wyhash", hashWy },
+    { "xxh64", hashXXH64 },
+    { "fnv1a", hashFnv1a },
+    { "superfast", hashSuperFast },
+    { NULL, NULL }
+};
+
+static const struct hashAlgorithm *currentHash = &hashAlgorithms[0];
+
+unsigned long hashFunction(const char *str)
+{
+    return currentHash->fn(str, strlen(str));
+}
+
+// pick the ring's hash by name.  Has to happen before any addNode(),
+// since tokens already on the ring were placed with the old function.
+int setHashFunction(const char *name)
+{
+    const struct hashAlgorithm *algo;
+    for (algo = hashAlgorithms; algo->name != NULL; algo++)
+    {
+        if (strcmp(algo->name, name) == 0)
+        {
+            currentHash = algo;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *getHashFunction()
+{
+    return currentHash->name;
+}
+
+
+// fraction of the hash space owned by each drive.  A token owns the arc
+// from the previous token (exclusive) up to itself.
+void ringOwnership(double *share, int numDrives)
+{
+    int i;
+    const struct ring *r = ringReadLock();
+    for (i = 0; i < numDrives; i++)
+        share[i] = 0.0;
+
+    if (r->size == 1)
+    {
+        if (r->nodes[0].drive < numDrives)
+            share[r->nodes[0].drive] = 1.0;
+    }
+    else
+    {
+        for (i = 0; i < r->size; i++)
+        {
+            unsigned long prev = r->tokens[(i + r->size - 1) % r->size];
+            unsigned long arc = r->tokens[i] - prev;   // wraps around for i == 0
+            if (r->nodes[i].drive < numDrives)
+                share[r->nodes[i].drive] += (double) arc / 18446744073709551616.0;
+        }
+    }
+    ringReadUnlock();
+}
+
+
+void printList()
+{
+    int i;
+    const struct ring *r = ringReadLock();
+    printf("Head\n");
+    for (i = 0; i < r->size; i++)
+    {
+        printf("%lu  ==  %s\n", r->nodes[i].hash, r->nodes[i].mount);
+    }
+    ringReadUnlock();
+}
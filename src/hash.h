@@ -0,0 +1,51 @@
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stddef.h>
+
+// consistent hash ring.  Tokens live in one contiguous array kept
+// sorted by hash, so a lookup is a binary search instead of a walk
+// around a linked list.  Each physical drive is spread over several
+// virtual nodes (tokens) so the key space is split evenly.
+#define DEFAULT_VNODES 64
+
+struct node
+{
+    unsigned long hash;
+    char *mount;
+    int drive;
+};
+
+// an immutable snapshot of the ring.  Only valid between ringReadLock()
+// and ringReadUnlock(); addNode()/removeNode() publish a new one.
+struct ring
+{
+    struct node *nodes;
+    unsigned long *tokens;
+    int size;
+};
+
+// a selectable string hash.  Every entry maps a byte string onto the
+// full 64 bit ring; hashAlgorithms[] is terminated by a NULL name.
+struct hashAlgorithm
+{
+    const char *name;
+    unsigned long (*fn)(const char *data, size_t len);
+};
+
+extern const struct hashAlgorithm hashAlgorithms[];
+
+unsigned long hashFunction(const char *str);
+int setHashFunction(const char *name);
+const char *getHashFunction();
+void addNode(char *mount, int drive, int numTokens);
+void removeNode(char *mount);
+struct node search(const char *key);
+const struct ring *ringReadLock();
+void ringReadUnlock();
+const struct node *ringSearch(const struct ring *r, const char *key);
+void printList();
+int getSize();
+void ringOwnership(double *share, int numDrives);
+
+#endif
@@ -0,0 +1,258 @@
+/*
+  Hash function benchmark for the pfs ring.
+
+  usage: hashbench [-d numDrives] [-v vnodes] [-i iterations] corpus
+
+  corpus is either a text file with one path per line (e.g. the output
+  of `find ~/MyPFS -type f`), "-" for stdin, or a directory which is
+  walked for file paths.  For every algorithm in hashAlgorithms[] it
+  reports the time per key, how evenly the keys land on the drives of a
+  ring built with that hash, and how many keys collide.
+
+  make bench
+*/
+
+#define _XOPEN_SOURCE 500
+
+#include <ftw.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+static char **keys = NULL;
+static size_t *keyLens = NULL;
+static int numKeys = 0;
+static int keyCapacity = 0;
+static size_t walkPrefix = 0;
+
+static void addKey(const char *key)
+{
+    if (numKeys == keyCapacity)
+    {
+        keyCapacity = keyCapacity == 0 ? 1024 : keyCapacity * 2;
+        keys = realloc(keys, keyCapacity * sizeof(char *));
+        keyLens = realloc(keyLens, keyCapacity * sizeof(size_t));
+        if (keys == NULL || keyLens == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    keys[numKeys] = strdup(key);
+    keyLens[numKeys] = strlen(key);
+    numKeys++;
+}
+
+// keys are stored the way pfs sees them: relative to the mount, with a
+// leading '/'
+static int walkEntry(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+    if (typeflag == FTW_F)
+        addKey(fpath + walkPrefix);
+    return 0;
+}
+
+static void loadCorpus(const char *source)
+{
+    struct stat sb;
+    if (strcmp(source, "-") != 0 && stat(source, &sb) == 0 && S_ISDIR(sb.st_mode))
+    {
+        walkPrefix = strlen(source);
+        while (walkPrefix > 1 && source[walkPrefix - 1] == '/')
+            walkPrefix--;
+        if (nftw(source, walkEntry, 64, FTW_PHYS) != 0)
+            perror("nftw");
+        return;
+    }
+
+    FILE *fp = strcmp(source, "-") == 0 ? stdin : fopen(source, "r");
+    if (fp == NULL)
+    {
+        perror(source);
+        exit(EXIT_FAILURE);
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] != '\0')
+            addKey(line);
+    }
+    if (fp != stdin)
+        fclose(fp);
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compareHashes(const void *a, const void *b)
+{
+    uint64_t ha = *(const uint64_t *) a;
+    uint64_t hb = *(const uint64_t *) b;
+    return (ha > hb) - (ha < hb);
+}
+
+// number of keys whose hash (masked to the given bits) equals that of
+// the key sorted before it
+static int countCollisions(uint64_t *hashes, int n, uint64_t mask)
+{
+    int i, collisions = 0;
+    uint64_t *sorted = malloc(n * sizeof(uint64_t));
+    for (i = 0; i < n; i++)
+        sorted[i] = hashes[i] & mask;
+    qsort(sorted, n, sizeof(uint64_t), compareHashes);
+    for (i = 1; i < n; i++)
+    {
+        if (sorted[i] == sorted[i - 1])
+            collisions++;
+    }
+    free(sorted);
+    return collisions;
+}
+
+static int compareKeys(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// collisions are only meaningful between distinct paths
+static void dedupKeys()
+{
+    int i, kept = 0;
+    qsort(keys, numKeys, sizeof(char *), compareKeys);
+    for (i = 0; i < numKeys; i++)
+    {
+        if (kept > 0 && strcmp(keys[i], keys[kept - 1]) == 0)
+        {
+            free(keys[i]);
+            continue;
+        }
+        keys[kept] = keys[i];
+        keyLens[kept] = strlen(keys[i]);
+        kept++;
+    }
+    numKeys = kept;
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: hashbench [-d numDrives] [-v vnodes] [-i iterations] corpus\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int numDrives = 10;
+    int vnodes = DEFAULT_VNODES;
+    int iterations = 20;
+    int opt, i, d;
+
+    while ((opt = getopt(argc, argv, "d:v:i:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd': numDrives = atoi(optarg); break;
+            case 'v': vnodes = atoi(optarg); break;
+            case 'i': iterations = atoi(optarg); break;
+            default: usage(); return 1;
+        }
+    }
+    if (argc - optind != 1 || numDrives < 1 || vnodes < 1 || iterations < 1)
+    {
+        usage();
+        return 1;
+    }
+
+    loadCorpus(argv[optind]);
+    dedupKeys();
+    if (numKeys == 0)
+    {
+        fprintf(stderr, "hashbench: no keys in %s\n", argv[optind]);
+        return 1;
+    }
+
+    char **mounts = malloc(numDrives * sizeof(char *));
+    for (d = 0; d < numDrives; d++)
+    {
+        mounts[d] = malloc(32);
+        snprintf(mounts[d], 32, "../backup/%d", d);
+    }
+    uint64_t *hashes = malloc(numKeys * sizeof(uint64_t));
+    int *perDrive = malloc(numDrives * sizeof(int));
+    double *share = malloc(numDrives * sizeof(double));
+
+    printf("%d distinct keys, %d drives, %d virtual nodes per drive\n\n",
+           numKeys, numDrives, vnodes);
+    printf("%-10s %8s %10s %10s %10s %8s %8s\n",
+           "hash", "ns/key", "keys cv", "max/mean", "ring cv", "coll64", "coll32");
+
+    const struct hashAlgorithm *algo;
+    for (algo = hashAlgorithms; algo->name != NULL; algo++)
+    {
+        // throughput: raw hashing of the whole corpus
+        volatile unsigned long sink = 0;
+        double start = now();
+        int it;
+        for (it = 0; it < iterations; it++)
+        {
+            for (i = 0; i < numKeys; i++)
+                sink ^= algo->fn(keys[i], keyLens[i]);
+        }
+        double nsPerKey = (now() - start) * 1e9 / ((double) iterations * numKeys);
+        (void) sink;
+
+        for (i = 0; i < numKeys; i++)
+            hashes[i] = algo->fn(keys[i], keyLens[i]);
+
+        // distribution: place every key on a ring built with this hash
+        setHashFunction(algo->name);
+        for (d = 0; d < numDrives; d++)
+            addNode(mounts[d], d, vnodes);
+
+        memset(perDrive, 0, numDrives * sizeof(int));
+        for (i = 0; i < numKeys; i++)
+            perDrive[search(keys[i]).drive]++;
+
+        double mean = (double) numKeys / numDrives;
+        double variance = 0, max = 0;
+        for (d = 0; d < numDrives; d++)
+        {
+            variance += (perDrive[d] - mean) * (perDrive[d] - mean);
+            if (perDrive[d] > max)
+                max = perDrive[d];
+        }
+        variance /= numDrives;
+
+        ringOwnership(share, numDrives);
+        double shareVariance = 0;
+        for (d = 0; d < numDrives; d++)
+            shareVariance += (share[d] - 1.0 / numDrives) * (share[d] - 1.0 / numDrives);
+        shareVariance /= numDrives;
+
+        for (d = 0; d < numDrives; d++)
+            removeNode(mounts[d]);
+
+        printf("%-10s %8.2f %10.4f %10.3f %10.4f %8d %8d\n",
+               algo->name, nsPerKey,
+               sqrt(variance) / mean, max / mean,
+               sqrt(shareVariance) * numDrives,
+               countCollisions(hashes, numKeys, ~0ULL),
+               countCollisions(hashes, numKeys, 0xffffffffULL));
+    }
+
+    printf("\nkeys cv:  coefficient of variation of keys per drive (0 is perfectly even)\n");
+    printf("max/mean: keys on the fullest drive over the average\n");
+    printf("ring cv:  coefficient of variation of the key space owned per drive\n");
+    printf("coll64/coll32: keys sharing a full / low 32 bit hash with another key\n");
+    return 0;
+}
@@ -0,0 +1,242 @@
+// need this for pthread_cond_timedwait() and clock_gettime() under -std=c99
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/statvfs.h>
+
+#include "health.h"
+#include "log.h"
+
+#define HEALTH_ALPHA 0.2        // weight of the newest sample
+#define HEALTH_FAILURES 3       // failures in a row that take a drive down
+#define HEALTH_ERROR_RATE 0.5   // or this share of recent calls failing
+#define HEALTH_SLOW_MS 250.0    // average latency that makes a drive suspect
+#define HEALTH_FAST_MS 125.0    // and that it has to get back under
+
+struct health_drive
+{
+    double errors;      // EWMA of calls that failed, 0..1
+    double latencyMs;   // EWMA of call latency
+    int failures;       // in a row
+    int state;
+};
+
+static int numDrives = 0;
+static char *backup = NULL;
+static struct health_drive *drives = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t thread;
+static int running = 0;
+
+static const char *stateNames[] = { "up", "suspect", "down" };
+
+// a time to pass to healthReport()
+long long healthStart()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int reachable(int drive)
+{
+    char root[PATH_MAX];
+    snprintf(root, PATH_MAX, "%s/%d", backup, drive);
+    return access(root, W_OK) == 0;
+}
+
+// Whether a down or suspect drive has recovered.  It has to see every
+// error driveError() counts, or a drive that is full or read-only comes
+// back up only to go down again on the next write: statvfs shows those,
+// and a small write runs into quotas as well.
+static int probe(int drive)
+{
+    char fpath[PATH_MAX];
+    struct statvfs sv;
+    int fd, ok;
+    snprintf(fpath, PATH_MAX, "%s/%d", backup, drive);
+    if (access(fpath, W_OK) < 0 || statvfs(fpath, &sv) < 0 || (sv.f_flag & ST_RDONLY) || sv.f_bavail == 0)
+        return 0;
+    snprintf(fpath, PATH_MAX, "%s/%d/.pfs-probe", backup, drive);
+    fd = open(fpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        return 0;
+    ok = write(fd, "", 1) == 1;
+    close(fd);
+    unlink(fpath);
+    return ok;
+}
+
+// errors that say something about the drive rather than the file
+static int driveError(int err)
+{
+    return err == EIO || err == ENXIO || err == ENODEV || err == ENOTCONN || err == ESTALE ||
+           err == ETIMEDOUT || err == EROFS || err == ENOSPC || err == EDQUOT;
+}
+
+// Caller holds lock
+static void setState(int drive, int state)
+{
+    struct health_drive *d = &drives[drive];
+    if (d->state == state)
+        return;
+    log_msg("health: drive %d is %s (%.0f%% errors, %.1f ms)\n", drive, stateNames[state],
+            d->errors * 100, d->latencyMs);
+    __atomic_store_n(&d->state, state, __ATOMIC_RELEASE);
+    if (state != HEALTH_UP)
+        pthread_cond_signal(&wake);
+}
+
+// up or suspect from the latency, with some slack so a drive hovering
+// around the threshold doesn't flap.  Caller holds lock.
+static void setSpeed(int drive)
+{
+    struct health_drive *d = &drives[drive];
+    if (d->latencyMs > HEALTH_SLOW_MS)
+        setState(drive, HEALTH_SUSPECT);
+    else if (d->latencyMs < HEALTH_FAST_MS)
+        setState(drive, HEALTH_UP);
+}
+
+// Caller holds lock
+static void sample(int drive, double ms, int failed)
+{
+    struct health_drive *d = &drives[drive];
+    d->errors += HEALTH_ALPHA * ((failed ? 1.0 : 0.0) - d->errors);
+    d->latencyMs += HEALTH_ALPHA * (ms - d->latencyMs);
+    d->failures = failed ? d->failures + 1 : 0;
+}
+
+// A call on drive that began at start has finished, with err the errno
+// it failed with or 0
+void healthReport(int drive, long long start, int err)
+{
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE) || drive < 0 || drive >= numDrives)
+        return;
+    double ms = (healthStart() - start) / 1e6;
+    // ENOENT and the like are the file's doing, unless the drive itself
+    // has gone missing
+    int failed = err != 0 && (driveError(err) || !reachable(drive));
+
+    pthread_mutex_lock(&lock);
+    struct health_drive *d = &drives[drive];
+    // only a probe brings a drive back
+    if (d->state != HEALTH_DOWN)
+    {
+        sample(drive, ms, failed);
+        if (d->failures >= HEALTH_FAILURES || d->errors > HEALTH_ERROR_RATE)
+            setState(drive, HEALTH_DOWN);
+        else
+            setSpeed(drive);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+int healthState(int drive)
+{
+    if (drive < 0 || drive >= numDrives || drives == NULL)
+        return HEALTH_UP;
+    return __atomic_load_n(&drives[drive].state, __ATOMIC_ACQUIRE);
+}
+
+static void *healthThread(void *arg)
+{
+    int i;
+    pthread_mutex_lock(&lock);
+    while (running)
+    {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += 1;
+        pthread_cond_timedwait(&wake, &lock, &until);
+        // suspect drives are probed too, so one that has sped up again
+        // recovers even if nothing is sent its way
+        for (i = 0; i < numDrives && running; i++)
+        {
+            if (drives[i].state == HEALTH_UP)
+                continue;
+            pthread_mutex_unlock(&lock);
+            long long start = healthStart();
+            int up = probe(i);
+            double ms = (healthStart() - start) / 1e6;
+            pthread_mutex_lock(&lock);
+            struct health_drive *d = &drives[i];
+            if (d->state == HEALTH_DOWN && up)
+            {
+                // start afresh from the probe
+                d->errors = 0;
+                d->failures = 0;
+                d->latencyMs = ms;
+                setState(i, ms > HEALTH_FAST_MS ? HEALTH_SUSPECT : HEALTH_UP);
+            }
+            else if (d->state == HEALTH_SUSPECT)
+            {
+                sample(i, ms, !up);
+                if (!up)
+                    setState(i, HEALTH_DOWN);
+                else
+                    setSpeed(i);
+            }
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int healthInit(int drivesCount, const char *backupDir)
+{
+    int i;
+    drives = calloc(drivesCount, sizeof(struct health_drive));
+    backup = strdup(backupDir);
+    if (drives == NULL || backup == NULL)
+    {
+        free(drives);
+        free(backup);
+        drives = NULL;
+        return -1;
+    }
+    numDrives = drivesCount;
+    // don't wait for the first failure to find the drives already gone
+    for (i = 0; i < numDrives; i++)
+    {
+        if (!probe(i))
+        {
+            log_msg("health: drive %d is down\n", i);
+            drives[i].state = HEALTH_DOWN;
+        }
+    }
+    running = 1;
+    if (pthread_create(&thread, NULL, healthThread, NULL) != 0)
+    {
+        running = 0;
+        free(drives);
+        free(backup);
+        drives = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void healthDestroy()
+{
+    if (!running)
+        return;
+    pthread_mutex_lock(&lock);
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    free(drives);
+    free(backup);
+    drives = NULL;
+    numDrives = 0;
+}
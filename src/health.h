@@ -0,0 +1,19 @@
+#ifndef _HEALTH_H_
+#define _HEALTH_H_
+
+// node health.  Every call made on a backup drive reports how long it
+// took and whether the drive (rather than the file) was at fault, and
+// each drive keeps an EWMA of both.  A drive that keeps failing is down:
+// placement skips it without trying and a background thread probes it
+// once a second until it answers again.  A drive that answers slowly is
+// suspect: it still takes the copies that belong on it, but is the last
+// choice to stand in for another drive.
+enum { HEALTH_UP, HEALTH_SUSPECT, HEALTH_DOWN };
+
+int healthInit(int numDrives, const char *backup);
+long long healthStart();
+void healthReport(int drive, long long start, int err);
+int healthState(int drive);
+void healthDestroy();
+
+#endif
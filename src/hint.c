@@ -0,0 +1,459 @@
+// need this for pthread_cond_timedwait() and fdatasync() under -std=c99
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hint.h"
+#include "log.h"
+
+#define HINT_DIR ".pfs-hints"
+#define HINT_SYNC 'S'       // bring path up to date with the master
+#define HINT_RENAME 'R'     // rename path to newpath
+
+struct hint
+{
+    unsigned long id;
+    char kind;
+    char *path;
+    char *newpath;
+};
+
+// the hints waiting for one drive, in replay order
+struct hint_target
+{
+    struct hint *hints;
+    int count;
+    int cap;
+    int down;
+    int holder;     // drive the log is on, -1 if none is open
+    FILE *log;
+    int logged;     // records in the log, some since compacted away
+    unsigned long replaying;    // id of the hint being replayed, 0 for none
+};
+
+static int numDrives = 0;
+static char *backup = NULL;
+static hint_replay replayFn = NULL;
+static struct hint_target *targets = NULL;
+static unsigned long nextId = 1;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t thread;
+static int running = 0;
+
+static int reachable(int drive)
+{
+    char root[PATH_MAX];
+    snprintf(root, PATH_MAX, "%s/%d", backup, drive);
+    return access(root, W_OK) == 0;
+}
+
+static void logPath(char path[PATH_MAX], int holder, int target)
+{
+    snprintf(path, PATH_MAX, "%s/%d/" HINT_DIR "/%d", backup, holder, target);
+}
+
+static void hintFree(struct hint *h)
+{
+    free(h->path);
+    free(h->newpath);
+}
+
+static void removeAt(struct hint_target *t, int i)
+{
+    hintFree(&t->hints[i]);
+    memmove(&t->hints[i], &t->hints[i + 1], (t->count - i - 1) * sizeof(struct hint));
+    t->count--;
+}
+
+static int append(struct hint_target *t, char kind, char *path, char *newpath)
+{
+    if (t->count == t->cap)
+    {
+        int cap = t->cap > 0 ? 2 * t->cap : 64;
+        struct hint *more = realloc(t->hints, cap * sizeof(struct hint));
+        if (more == NULL)
+            return -1;
+        t->hints = more;
+        t->cap = cap;
+    }
+    struct hint *h = &t->hints[t->count++];
+    h->id = nextId++;
+    h->kind = kind;
+    h->path = path;
+    h->newpath = newpath;
+    return 0;
+}
+
+// is path p, or something under it?
+static int under(const char *path, const char *p)
+{
+    size_t len = strlen(p);
+    return strncmp(path, p, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+// Add a hint to t's list, compacting as it goes: only the last sync of
+// a path is kept, and a rename takes the pending syncs of everything it
+// moves with it, under their new names.  Caller holds lock.
+static void addHint(struct hint_target *t, const char *path, const char *newpath)
+{
+    int i;
+    if (newpath == NULL)
+    {
+        for (i = 0; i < t->count; i++)
+        {
+            if (t->hints[i].kind == HINT_SYNC && !strcmp(t->hints[i].path, path))
+            {
+                removeAt(t, i);
+                break;
+            }
+        }
+        char *p = strdup(path);
+        if (p == NULL || append(t, HINT_SYNC, p, NULL) < 0)
+            free(p);
+        return;
+    }
+
+    char *p = strdup(path);
+    char *np = strdup(newpath);
+    int first = t->count;
+    if (p == NULL || np == NULL || append(t, HINT_RENAME, p, np) < 0)
+    {
+        free(p);
+        free(np);
+        return;
+    }
+    for (i = 0; i < first; i++)
+    {
+        if (t->hints[i].kind != HINT_SYNC || !under(t->hints[i].path, path))
+            continue;
+        size_t len = strlen(newpath) + strlen(t->hints[i].path) - strlen(path) + 1;
+        char *moved = malloc(len);
+        if (moved == NULL)
+            continue;
+        snprintf(moved, len, "%s%s", newpath, t->hints[i].path + strlen(path));
+        removeAt(t, i);
+        i--;
+        first--;
+        if (append(t, HINT_SYNC, moved, NULL) < 0)
+            free(moved);
+    }
+}
+
+// Is a sync of path already pending that a new one would add nothing to?
+// Not if a rename since then moved something onto or off it, nor if it is
+// being replayed and may already have copied the master.  Caller holds
+// lock.
+static int syncPending(const struct hint_target *t, const char *path)
+{
+    int i;
+    for (i = t->count - 1; i >= 0; i--)
+    {
+        const struct hint *h = &t->hints[i];
+        if (h->kind == HINT_RENAME && (under(path, h->path) || under(path, h->newpath)))
+            return 0;
+        if (h->kind == HINT_SYNC && !strcmp(h->path, path))
+            return h->id != t->replaying;
+    }
+    return 0;
+}
+
+static int writeHint(FILE *f, const struct hint *h)
+{
+    fputc(h->kind, f);
+    fputs(h->path, f);
+    fputc('\0', f);
+    if (h->newpath != NULL)
+        fputs(h->newpath, f);
+    return fputc('\0', f) == EOF ? -1 : 0;
+}
+
+static void closeLog(struct hint_target *t)
+{
+    if (t->log != NULL)
+        fclose(t->log);
+    t->log = NULL;
+    t->holder = -1;
+    t->logged = 0;
+}
+
+// drop target's logs everywhere but keep, -1 for everywhere
+static void removeLogs(int target, int keep)
+{
+    char path[PATH_MAX];
+    int i;
+    for (i = 0; i < numDrives; i++)
+    {
+        if (i == keep)
+            continue;
+        logPath(path, i, target);
+        unlink(path);
+    }
+}
+
+// Write t's list out afresh on the first reachable drive after target
+// and leave it open for appending.  Caller holds lock.
+static int rewriteLog(int target)
+{
+    struct hint_target *t = &targets[target];
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 8];
+    int i;
+
+    closeLog(t);
+    for (i = 1; i < numDrives; i++)
+    {
+        int holder = (target + i) % numDrives;
+        if (!reachable(holder))
+            continue;
+        snprintf(path, PATH_MAX, "%s/%d/" HINT_DIR, backup, holder);
+        mkdir(path, 0755);
+        logPath(path, holder, target);
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        FILE *f = fopen(tmp, "w");
+        if (f == NULL)
+            continue;
+        int res = 0;
+        int j;
+        for (j = 0; j < t->count && res == 0; j++)
+            res = writeHint(f, &t->hints[j]);
+        if (res == 0 && fflush(f) == 0 && fdatasync(fileno(f)) == 0 && rename(tmp, path) == 0)
+        {
+            t->log = f;
+            t->holder = holder;
+            t->logged = t->count;
+            removeLogs(target, holder);
+            return 0;
+        }
+        fclose(f);
+        unlink(tmp);
+    }
+    log_msg("ERROR hint: no drive to keep the hints for drive %d on, holding them in memory\n", target);
+    return -1;
+}
+
+// A replica update of path (renamed to newpath, if given) on drive
+// failed or was skipped
+void hintAdd(int drive, const char *path, const char *newpath)
+{
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE) || drive < 0 || drive >= numDrives)
+        return;
+    // probed outside the lock, so a slow drive doesn't hold up the others
+    int gone = !hintDown(drive) && !reachable(drive);
+    pthread_mutex_lock(&lock);
+    struct hint_target *t = &targets[drive];
+    if (gone && !t->down)
+    {
+        log_msg("hint: drive %d is down\n", drive);
+        __atomic_store_n(&t->down, 1, __ATOMIC_RELEASE);
+    }
+    // a replay copies the master's state then, so this one is covered
+    if (newpath == NULL && syncPending(t, path))
+    {
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    unsigned long firstNew = nextId;
+    addHint(t, path, newpath);
+
+    // the log only ever grows; start it again once it is mostly
+    // superseded records
+    if (t->log == NULL || t->logged > 2 * t->count + 64)
+        rewriteLog(drive);
+    else
+    {
+        int res = 0;
+        int i;
+        for (i = 0; i < t->count && res == 0; i++)
+        {
+            if (t->hints[i].id >= firstNew)
+            {
+                res = writeHint(t->log, &t->hints[i]);
+                t->logged++;
+            }
+        }
+        if (res < 0 || fflush(t->log) != 0 || fdatasync(fileno(t->log)) != 0)
+            rewriteLog(drive);
+    }
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+}
+
+// updates to drive should be hinted without being tried
+int hintDown(int drive)
+{
+    if (drive < 0 || drive >= numDrives)
+        return 0;
+    return __atomic_load_n(&targets[drive].down, __ATOMIC_ACQUIRE);
+}
+
+// replay what drive is owed, oldest first.  Caller holds lock.
+static void replayTarget(int drive)
+{
+    struct hint_target *t = &targets[drive];
+    int replayed = 0;
+
+    while (t->count > 0 && running)
+    {
+        struct hint h = t->hints[0];
+        char *path = strdup(h.path);
+        char *newpath = h.newpath != NULL ? strdup(h.newpath) : NULL;
+        t->replaying = h.id;
+        pthread_mutex_unlock(&lock);
+        int res = path == NULL ? -1 : replayFn(drive, path, newpath);
+        pthread_mutex_lock(&lock);
+        t->replaying = 0;
+        free(path);
+        free(newpath);
+        if (res < 0)
+        {
+            log_msg("ERROR hint: replay to drive %d failed, %d hints left\n", drive, t->count);
+            break;
+        }
+        replayed++;
+        // it may have been compacted away meanwhile
+        int i;
+        for (i = 0; i < t->count; i++)
+        {
+            if (t->hints[i].id == h.id)
+            {
+                removeAt(t, i);
+                break;
+            }
+        }
+    }
+
+    if (t->count == 0)
+    {
+        closeLog(t);
+        removeLogs(drive, -1);
+        __atomic_store_n(&t->down, 0, __ATOMIC_RELEASE);
+        log_msg("hint: drive %d caught up, %d hints replayed\n", drive, replayed);
+    }
+    else if (replayed > 0)
+        rewriteLog(drive);
+}
+
+static void *hintThread(void *arg)
+{
+    int i;
+    pthread_mutex_lock(&lock);
+    while (running)
+    {
+        // wait for a drive to come back
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += 1;
+        pthread_cond_timedwait(&wake, &lock, &until);
+        for (i = 0; i < numDrives && running; i++)
+        {
+            if (targets[i].count == 0)
+                continue;
+            pthread_mutex_unlock(&lock);
+            int up = reachable(i);
+            pthread_mutex_lock(&lock);
+            if (up)
+                replayTarget(i);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+// hints left by an earlier run, wherever they were kept
+static void loadLogs()
+{
+    char path[PATH_MAX];
+    int holder;
+    int target;
+    for (target = 0; target < numDrives; target++)
+    {
+        for (holder = 0; holder < numDrives; holder++)
+        {
+            logPath(path, holder, target);
+            FILE *f = fopen(path, "r");
+            if (f == NULL)
+                continue;
+            char *rec = NULL;
+            size_t cap = 0;
+            ssize_t len;
+            // kind+path NUL newpath NUL
+            while ((len = getdelim(&rec, &cap, '\0', f)) > 1)
+            {
+                char kind = rec[0];
+                char *p = strdup(rec + 1);
+                if (p == NULL || (len = getdelim(&rec, &cap, '\0', f)) <= 0)
+                {
+                    free(p);
+                    break;
+                }
+                addHint(&targets[target], p, kind == HINT_RENAME ? rec : NULL);
+                free(p);
+            }
+            free(rec);
+            fclose(f);
+        }
+        if (targets[target].count > 0)
+        {
+            log_msg("hint: %d hints for drive %d from the last run\n", targets[target].count, target);
+            targets[target].down = !reachable(target);
+            rewriteLog(target);
+        }
+    }
+}
+
+int hintInit(int drivesCount, const char *backupDir, hint_replay replay)
+{
+    int i;
+    targets = calloc(drivesCount, sizeof(struct hint_target));
+    backup = strdup(backupDir);
+    if (targets == NULL || backup == NULL)
+    {
+        free(targets);
+        free(backup);
+        return -1;
+    }
+    numDrives = drivesCount;
+    replayFn = replay;
+    for (i = 0; i < numDrives; i++)
+        targets[i].holder = -1;
+    loadLogs();
+    running = 1;
+    if (pthread_create(&thread, NULL, hintThread, NULL) != 0)
+    {
+        running = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// what hasn't been replayed stays in the logs for the next run
+void hintDestroy()
+{
+    int i;
+    if (!running)
+        return;
+    pthread_mutex_lock(&lock);
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    for (i = 0; i < numDrives; i++)
+    {
+        int j;
+        closeLog(&targets[i]);
+        for (j = 0; j < targets[i].count; j++)
+            hintFree(&targets[i].hints[j]);
+        free(targets[i].hints);
+    }
+    free(targets);
+    free(backup);
+}
@@ -0,0 +1,21 @@
+#ifndef _HINT_H_
+#define _HINT_H_
+
+// hinted handoff.  A replica update that can't be applied to its drive
+// is recorded as a hint in a log kept on a healthy neighbour drive, and
+// a background thread replays the hints, in order, once the drive is
+// reachable again.  Hints say which paths to bring up to date, not how:
+// a replay copies the master's state at that point.  So ten writes to a
+// file while its drive is away replay as one copy, and a rename of a
+// directory carries the pending hints for everything under it along.
+//
+// While a drive's directory is unreachable it is down.  Updates skip it
+// without trying, and are hinted straight away.
+typedef int (*hint_replay)(int drive, const char *path, const char *newpath);
+
+int hintInit(int numDrives, const char *backup, hint_replay replay);
+void hintAdd(int drive, const char *path, const char *newpath);
+int hintDown(int drive);
+void hintDestroy();
+
+#endif
@@ -0,0 +1,619 @@
+// need this for nftw() and the st_mtim fields
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <ftw.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "index.h"
+#include "log.h"
+
+enum
+{
+    STMT_LOOKUP,
+    STMT_LIST,
+    STMT_UPSERT,
+    STMT_DELETE,
+    STMT_MOVE,
+    STMT_MOVE_CHILDREN,
+    STMT_WRITERS,
+    STMT_SET_REPLICAS,
+    STMT_GET_REPLICAS,
+    STMT_SET_HASH,
+    STMT_GET_HASH,
+    STMT_FIND_HASH,
+    STMT_SET_CHUNKS,
+    STMT_GET_CHUNKS,
+    STMTS
+};
+
+static const char *sql[STMTS] = {
+    "SELECT mode, uid, gid, size, blocks, nlink, rdev, atime, mtime, ctime, writers "
+    "FROM files WHERE path = ?1",
+    "SELECT name, mode, uid, gid, size, blocks, nlink, rdev, atime, mtime, ctime "
+    "FROM files WHERE parent = ?1 AND name > ?2 ORDER BY name LIMIT ?4 OFFSET ?3",
+    "INSERT INTO files(path, parent, name, mode, uid, gid, size, blocks, nlink, rdev, "
+    "atime, mtime, ctime, seen) VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, 1) "
+    "ON CONFLICT(path) DO UPDATE SET mode = excluded.mode, uid = excluded.uid, "
+    "gid = excluded.gid, size = excluded.size, blocks = excluded.blocks, "
+    "nlink = excluded.nlink, rdev = excluded.rdev, atime = excluded.atime, "
+    "mtime = excluded.mtime, ctime = excluded.ctime, seen = 1",
+    // everything under ?1 sorts between ?1/ and ?1 followed by '0', the
+    // character after '/', so the key's index finds it
+    "DELETE FROM files WHERE path = ?1 OR (path > ?1 || '/' AND path < ?1 || '0')",
+    "UPDATE files SET path = ?2, parent = ?3, name = ?4 WHERE path = ?1",
+    "UPDATE files SET path = ?2 || substr(path, length(?1) + 1), "
+    "parent = ?2 || substr(parent, length(?1) + 1) "
+    "WHERE path > ?1 || '/' AND path < ?1 || '0'",
+    "UPDATE files SET writers = max(writers + ?2, 0) WHERE path = ?1",
+    "UPDATE files SET replicas = ?2 WHERE path = ?1",
+    "SELECT replicas FROM files WHERE path = ?1",
+    "UPDATE files SET hash = ?2 WHERE path = ?1",
+    "SELECT hash FROM files WHERE path = ?1",
+    "SELECT path FROM files WHERE hash = ?1 AND path <> ?2 AND writers = 0 LIMIT 1",
+    "UPDATE files SET chunks = ?2, chunkStamp = ?3 WHERE path = ?1",
+    "SELECT chunks, chunkStamp FROM files WHERE path = ?1",
+};
+
+static const char schema[] =
+    "PRAGMA journal_mode = WAL;"
+    "CREATE TABLE IF NOT EXISTS files("
+    " path TEXT PRIMARY KEY, parent TEXT NOT NULL, name TEXT NOT NULL,"
+    " mode INTEGER, uid INTEGER, gid INTEGER, size INTEGER, blocks INTEGER,"
+    " nlink INTEGER, rdev INTEGER, atime INTEGER, mtime INTEGER, ctime INTEGER,"
+    " hash TEXT, replicas TEXT, chunks BLOB, chunkStamp INTEGER,"
+    " writers INTEGER NOT NULL DEFAULT 0, seen INTEGER NOT NULL DEFAULT 1);"
+    "CREATE INDEX IF NOT EXISTS files_parent ON files(parent, name);"
+    "CREATE INDEX IF NOT EXISTS files_hash ON files(hash);";
+
+struct index_conn
+{
+    sqlite3 *db;
+    sqlite3_stmt *stmts[STMTS];
+};
+
+static char *indexFile = NULL;
+static pthread_key_t connKey;
+static __thread struct index_conn *myConn = NULL;
+
+// the walk in indexOpen()
+static struct index_conn *walkConn = NULL;
+static size_t walkPrefix = 0;
+static int walkCount = 0;
+
+static void connFree(struct index_conn *c)
+{
+    int i;
+    for (i = 0; i < STMTS; i++)
+        sqlite3_finalize(c->stmts[i]);
+    sqlite3_close(c->db);
+    free(c);
+}
+
+static void connDestructor(void *c)
+{
+    connFree(c);
+}
+
+static struct index_conn *connNew()
+{
+    struct index_conn *c = calloc(1, sizeof(struct index_conn));
+    if (c == NULL)
+        return NULL;
+    if (sqlite3_open_v2(indexFile, &c->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                        SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK)
+    {
+        log_msg("ERROR index: opening %s: %s\n", indexFile, sqlite3_errmsg(c->db));
+        connFree(c);
+        return NULL;
+    }
+    // writers from other threads take the lock for a moment at most
+    sqlite3_busy_timeout(c->db, 5000);
+    sqlite3_exec(c->db, "PRAGMA synchronous = NORMAL", NULL, NULL, NULL);
+    return c;
+}
+
+static struct index_conn *getConn()
+{
+    if (indexFile == NULL)
+        return NULL;
+    if (myConn == NULL)
+    {
+        myConn = connNew();
+        if (myConn != NULL)
+            pthread_setspecific(connKey, myConn);
+    }
+    return myConn;
+}
+
+// statement id on this thread's connection, reset and ready for binding
+static sqlite3_stmt *statement(struct index_conn *c, int id)
+{
+    if (c->stmts[id] == NULL)
+    {
+        if (sqlite3_prepare_v2(c->db, sql[id], -1, &c->stmts[id], NULL) != SQLITE_OK)
+        {
+            log_msg("ERROR index: %s\n", sqlite3_errmsg(c->db));
+            c->stmts[id] = NULL;
+            return NULL;
+        }
+    }
+    sqlite3_reset(c->stmts[id]);
+    sqlite3_clear_bindings(c->stmts[id]);
+    return c->stmts[id];
+}
+
+// run a statement that returns no rows
+static int step(struct index_conn *c, sqlite3_stmt *stmt)
+{
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE)
+    {
+        log_msg("ERROR index: %s\n", sqlite3_errmsg(c->db));
+        return -1;
+    }
+    return 0;
+}
+
+static long long timeNs(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static void setTime(struct timespec *ts, long long ns)
+{
+    ts->tv_sec = ns / 1000000000LL;
+    ts->tv_nsec = ns % 1000000000LL;
+}
+
+// columns first.. of stmt back into a struct stat
+static void rowStat(sqlite3_stmt *stmt, int first, struct stat *st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = sqlite3_column_int64(stmt, first);
+    st->st_uid = sqlite3_column_int64(stmt, first + 1);
+    st->st_gid = sqlite3_column_int64(stmt, first + 2);
+    st->st_size = sqlite3_column_int64(stmt, first + 3);
+    st->st_blocks = sqlite3_column_int64(stmt, first + 4);
+    st->st_nlink = sqlite3_column_int64(stmt, first + 5);
+    st->st_rdev = sqlite3_column_int64(stmt, first + 6);
+    st->st_blksize = 4096;
+    setTime(&st->st_atim, sqlite3_column_int64(stmt, first + 7));
+    setTime(&st->st_mtim, sqlite3_column_int64(stmt, first + 8));
+    setTime(&st->st_ctim, sqlite3_column_int64(stmt, first + 9));
+}
+
+// "/a/b" has parent "/a" and name "b"; "/a" has parent "/"; "/" has
+// parent ""
+static void splitPath(const char *path, char *parent, const char **name)
+{
+    const char *slash = strrchr(path, '/');
+    size_t len = slash - path;
+    if (len == 0 && path[1] != '\0')
+        len = 1;
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+    *name = path[1] == '\0' ? path : slash + 1;
+}
+
+static int upsert(struct index_conn *c, const char *path, const struct stat *st)
+{
+    sqlite3_stmt *stmt = statement(c, STMT_UPSERT);
+    char *parent = malloc(strlen(path) + 1);
+    const char *name;
+    if (stmt == NULL || parent == NULL)
+    {
+        free(parent);
+        return -1;
+    }
+    splitPath(path, parent, &name);
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, parent, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, name, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 4, st->st_mode);
+    sqlite3_bind_int64(stmt, 5, st->st_uid);
+    sqlite3_bind_int64(stmt, 6, st->st_gid);
+    sqlite3_bind_int64(stmt, 7, st->st_size);
+    sqlite3_bind_int64(stmt, 8, st->st_blocks);
+    sqlite3_bind_int64(stmt, 9, st->st_nlink);
+    sqlite3_bind_int64(stmt, 10, st->st_rdev);
+    sqlite3_bind_int64(stmt, 11, timeNs(&st->st_atim));
+    sqlite3_bind_int64(stmt, 12, timeNs(&st->st_mtim));
+    sqlite3_bind_int64(stmt, 13, timeNs(&st->st_ctim));
+    int res = step(c, stmt);
+    free(parent);
+    return res;
+}
+
+static int walkEntry(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+    const char *path = fpath[walkPrefix] != '\0' ? fpath + walkPrefix : "/";
+    if (typeflag == FTW_NS)
+        return 0;
+    if (upsert(walkConn, path, sb) < 0)
+        return -1;
+    walkCount++;
+    return 0;
+}
+
+// Open (or create) the index in file and bring it in line with what is
+// actually under rootdir.  Returns -1 if it can't be used.
+int indexOpen(const char *file, const char *rootdir)
+{
+    char *err = NULL;
+    if (pthread_key_create(&connKey, connDestructor) != 0)
+        return -1;
+    indexFile = strdup(file);
+    struct index_conn *c = getConn();
+    if (c == NULL)
+    {
+        free(indexFile);
+        indexFile = NULL;
+        return -1;
+    }
+    if (sqlite3_exec(c->db, schema, NULL, NULL, &err) != SQLITE_OK)
+    {
+        log_msg("ERROR index: %s\n", err);
+        sqlite3_free(err);
+        indexClose();
+        return -1;
+    }
+    // indexes made before chunk manifests; these fail if already there
+    sqlite3_exec(c->db, "ALTER TABLE files ADD COLUMN chunks BLOB", NULL, NULL, NULL);
+    sqlite3_exec(c->db, "ALTER TABLE files ADD COLUMN chunkStamp INTEGER", NULL, NULL, NULL);
+
+    // anything not seen on the walk is gone; nothing is open yet
+    walkConn = c;
+    walkPrefix = strlen(rootdir);
+    while (walkPrefix > 1 && rootdir[walkPrefix - 1] == '/')
+        walkPrefix--;
+    walkCount = 0;
+    sqlite3_exec(c->db, "BEGIN; UPDATE files SET seen = 0, writers = 0", NULL, NULL, NULL);
+    if (nftw(rootdir, walkEntry, 64, FTW_PHYS) != 0 ||
+        sqlite3_exec(c->db, "DELETE FROM files WHERE seen = 0; COMMIT", NULL, NULL, &err) != SQLITE_OK)
+    {
+        log_msg("ERROR index: rebuilding from %s: %s\n", rootdir, err != NULL ? err : strerror(errno));
+        sqlite3_free(err);
+        sqlite3_exec(c->db, "ROLLBACK", NULL, NULL, NULL);
+        indexClose();
+        return -1;
+    }
+    log_msg("index: %d entries under %s\n", walkCount, rootdir);
+    return 0;
+}
+
+// only closes this thread's connection; the others go with their threads
+void indexClose()
+{
+    if (myConn != NULL)
+    {
+        pthread_setspecific(connKey, NULL);
+        connFree(myConn);
+        myConn = NULL;
+    }
+    free(indexFile);
+    indexFile = NULL;
+}
+
+int indexEnabled()
+{
+    return indexFile != NULL;
+}
+
+// 1 with *st filled in if path is indexed, 0 if it doesn't exist, or -1
+// if the index can't say: it failed, or the file is open for writing
+// and its row is behind
+int indexLookup(const char *path, struct stat *st)
+{
+    struct index_conn *c = getConn();
+    sqlite3_stmt *stmt;
+    if (c == NULL || (stmt = statement(c, STMT_LOOKUP)) == NULL)
+        return -1;
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    int res = -1;
+    if (rc == SQLITE_ROW)
+    {
+        if (sqlite3_column_int(stmt, 10) == 0)
+        {
+            rowStat(stmt, 0, st);
+            res = 1;
+        }
+    }
+    else if (rc == SQLITE_DONE)
+        res = 0;
+    else
+        log_msg("ERROR index: %s\n", sqlite3_errmsg(c->db));
+    sqlite3_reset(stmt);
+    return res;
+}
+
+// Call fn for up to limit entries in dir, in name order, starting
+// after the name after and skipping the first skip of those, until fn
+// returns non-zero.  A page picks up where the last left off by passing
+// its last name as after.  Returns the number of entries fn was called
+// for, or -1 if the index failed.
+int indexList(const char *dir, const char *after, long skip, int limit, index_entry fn, void *arg)
+{
+    struct index_conn *c = getConn();
+    sqlite3_stmt *stmt;
+    struct stat st;
+    int rc;
+    int n = 0;
+    if (c == NULL || (stmt = statement(c, STMT_LIST)) == NULL)
+        return -1;
+    sqlite3_bind_text(stmt, 1, dir, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, after, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, skip);
+    sqlite3_bind_int(stmt, 4, limit);
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        rowStat(stmt, 1, &st);
+        n++;
+        if (fn((const char *) sqlite3_column_text(stmt, 0), &st, arg) != 0)
+        {
+            rc = SQLITE_DONE;
+            break;
+        }
+    }
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE)
+    {
+        log_msg("ERROR index: %s\n", sqlite3_errmsg(c->db));
+        return -1;
+    }
+    return n;
+}
+
+int indexUpdate(const char *path, const struct stat *st)
+{
+    struct index_conn *c = getConn();
+    if (c == NULL)
+        return -1;
+    return upsert(c, path, st);
+}
+
+// path and, for a directory, everything under it
+int indexRemove(const char *path)
+{
+    struct index_conn *c = getConn();
+    sqlite3_stmt *stmt;
+    if (c == NULL || (stmt = statement(c, STMT_DELETE)) == NULL)
+        return -1;
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    return step(c, stmt);
+}
+
+// move path, and everything under it, to newpath in one transaction
+int indexRename(const char *path, const char *newpath)
+{
+    struct index_conn *c = getConn();
+    sqlite3_stmt *stmt;
+    char *parent;
+    const char *name;
+    int res = -1;
+    if (c == NULL || (parent = malloc(strlen(newpath) + 1)) == NULL)
+        return -1;
+    splitPath(newpath, parent, &name);
+
+    sqlite3_exec(c->db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+    // whatever the rename replaced
+    if ((stmt = statement(c, STMT_DELETE)) != NULL)
+    {
+        sqlite3_bind_text(stmt, 1, newpath, -1, SQLITE_STATIC);
+        res = step(c, stmt);
+    }
+    if (res == 0 && (stmt = statement(c, STMT_MOVE)) != NULL)
+    {
+        sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, newpath, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, parent, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 4, name, -1, SQLITE_STATIC);
+        res = step(c, stmt);
+    }
+    else
+        res = -1;
+    if (res == 0 && (stmt = statement(c, STMT_MOVE_CHILDREN)) != NULL)
+    {
+        sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, newpath, -1, SQLITE_STATIC);
+        res = step(c, stmt);
+    }
+    else
+        res = -1;
+    sqlite3_exec(c->db, res == 0 ? "COMMIT" : "ROLLBACK", NULL, NULL, NULL);
+    free(parent);
+    return res;
+}
+
+// count handles open for writing on path.  While there are any its row
+// isn't trusted, since writes don't touch the index.
+int indexWriters(const char *path, int delta)
+{
+    struct index_conn *c = getConn();
+    sqlite3_stmt *stmt;
+    if (c == NULL || (stmt = statement(c, STMT_WRITERS)) == NULL)
+        return -1;
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, delta);
+    return step(c, stmt);
+}
+
+// the drives holding replicas of path, as a comma separated list
+int indexSetReplicas(const char *path, const int *drives, int n)
+{
+    struct index_conn *c = getConn();
+    sqlite3_stmt *stmt;
+    char list[n * 12 + 1];
+    size_t len = 0;
+    int i;
+    if (c == NULL || (stmt = statement(c, STMT_SET_REPLICAS)) == NULL)
+        return -1;
+    list[0] = '\0';
+    for (i = 0; i < n; i++)
+        len += sprintf(list + len, i == 0 ? "%d" : ",%d", drives[i]);
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, list, len, SQLITE_STATIC);
+    return step(c, stmt);
+}
+
+// up to max drives holding replicas of path; 0 if none are recorded
+int indexGetReplicas(const char *path, int *drives, int max)
+{
+    struct index_conn *c = getConn();
+    sqlite3_stmt *stmt;
+    int n = 0;
+    if (c == NULL || (stmt = statement(c, STMT_GET_REPLICAS)) == NULL)
+        return 0;
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) == SQLITE_TEXT)
+    {
+        const char *p = (const char *) sqlite3_column_text(stmt, 0);
+        while (*p != '\0' && n < max)
+        {
+            char *end;
+            drives[n++] = strtol(p, &end, 10);
+            p = *end == ',' ? end + 1 : end;
+        }
+    }
+    sqlite3_reset(stmt);
+    return n;
+}
+
+int indexSetHash(const char *path, const char *hash)
+{
+    struct index_conn *c = getConn();
+    sqlite3_stmt *stmt;
+    if (c == NULL || (stmt = statement(c, STMT_SET_HASH)) == NULL)
+        return -1;
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, hash, -1, SQLITE_STATIC);
+    return step(c, stmt);
+}
+
+// the content hash last recorded for path; 0 if there isn't one
+int indexGetHash(const char *path, char hash[INDEX_HASH_LEN])
+{
+    struct index_conn *c = getConn();
+    sqlite3_stmt *stmt;
+    int found = 0;
+    if (c == NULL || (stmt = statement(c, STMT_GET_HASH)) == NULL)
+        return 0;
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) == SQLITE_TEXT)
+    {
+        snprintf(hash, INDEX_HASH_LEN, "%s", (const char *) sqlite3_column_text(stmt, 0));
+        found = 1;
+    }
+    sqlite3_reset(stmt);
+    return found;
+}
+
+// some other path, not open for writing, last seen holding hash; 0 if
+// there isn't one
+int indexFindHash(const char *hash, const char *exclude, char *path, size_t size)
+{
+    struct index_conn *c = getConn();
+    sqlite3_stmt *stmt;
+    int found = 0;
+    if (c == NULL || (stmt = statement(c, STMT_FIND_HASH)) == NULL)
+        return 0;
+    sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, exclude, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        snprintf(path, size, "%s", (const char *) sqlite3_column_text(stmt, 0));
+        found = 1;
+    }
+    sqlite3_reset(stmt);
+    return found;
+}
+
+// hex SHA-256 of everything in fd, read from the start.  Returns -1 if
+// the file couldn't be read.
+int indexHashFile(int fd, char hash[INDEX_HASH_LEN])
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdLen = 0;
+    char buf[64 * 1024];
+    off_t offset = 0;
+    ssize_t n;
+    int i;
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (ctx == NULL || EVP_DigestInit_ex(ctx, EVP_sha256(), NULL) != 1)
+    {
+        EVP_MD_CTX_free(ctx);
+        return -1;
+    }
+    while ((n = pread(fd, buf, sizeof(buf), offset)) > 0)
+    {
+        EVP_DigestUpdate(ctx, buf, n);
+        offset += n;
+    }
+    if (n < 0 || EVP_DigestFinal_ex(ctx, md, &mdLen) != 1)
+    {
+        EVP_MD_CTX_free(ctx);
+        return -1;
+    }
+    EVP_MD_CTX_free(ctx);
+    for (i = 0; i < (int) mdLen && 2 * i + 2 < INDEX_HASH_LEN; i++)
+    {
+        hash[2 * i] = hex[md[i] >> 4];
+        hash[2 * i + 1] = hex[md[i] & 0xf];
+    }
+    hash[2 * i] = '\0';
+    return 0;
+}
+
+// the chunk manifest path's replicas were last written from, and the
+// mtime (in ns) they were stamped with; n = 0 forgets it
+int indexSetChunks(const char *path, const struct chunk *chunks, int n, long long stamp)
+{
+    struct index_conn *c = getConn();
+    sqlite3_stmt *stmt;
+    if (c == NULL || (stmt = statement(c, STMT_SET_CHUNKS)) == NULL)
+        return -1;
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    if (n > 0)
+    {
+        sqlite3_bind_blob(stmt, 2, chunks, n * sizeof(struct chunk), SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 3, stamp);
+    }
+    return step(c, stmt);
+}
+
+// path's manifest into *chunks, which the caller frees.  Returns the
+// number of chunks, 0 if there is no manifest.
+int indexGetChunks(const char *path, struct chunk **chunks, long long *stamp)
+{
+    struct index_conn *c = getConn();
+    sqlite3_stmt *stmt;
+    int n = 0;
+    *chunks = NULL;
+    if (c == NULL || (stmt = statement(c, STMT_GET_CHUNKS)) == NULL)
+        return 0;
+    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) == SQLITE_BLOB)
+    {
+        int bytes = sqlite3_column_bytes(stmt, 0);
+        n = bytes / sizeof(struct chunk);
+        *chunks = malloc(n * sizeof(struct chunk));
+        if (*chunks == NULL)
+            n = 0;
+        else
+            memcpy(*chunks, sqlite3_column_blob(stmt, 0), n * sizeof(struct chunk));
+        *stamp = sqlite3_column_int64(stmt, 1);
+    }
+    sqlite3_reset(stmt);
+    return n;
+}
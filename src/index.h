@@ -0,0 +1,37 @@
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include <sys/stat.h>
+
+#include "chunk.h"
+
+// local metadata index.  A SQLite database in WAL mode holding one row
+// per file and directory under the master: its stat, where its replicas
+// were written, its content hash and how many handles are writing it.
+// It is rebuilt from the master directory when opened, then kept up to
+// date by the pfs callbacks, so getattr and readdir can be answered
+// without touching the disks.  Each thread gets its own connection so
+// lookups never wait on each other.
+#define INDEX_HASH_LEN 65   // hex SHA-256 plus the NUL
+
+typedef int (*index_entry)(const char *name, const struct stat *st, void *arg);
+
+int indexOpen(const char *file, const char *rootdir);
+void indexClose();
+int indexEnabled();
+int indexLookup(const char *path, struct stat *st);
+int indexList(const char *dir, const char *after, long skip, int limit, index_entry fn, void *arg);
+int indexUpdate(const char *path, const struct stat *st);
+int indexRemove(const char *path);
+int indexRename(const char *path, const char *newpath);
+int indexWriters(const char *path, int delta);
+int indexSetReplicas(const char *path, const int *drives, int n);
+int indexGetReplicas(const char *path, int *drives, int max);
+int indexSetHash(const char *path, const char *hash);
+int indexGetHash(const char *path, char hash[INDEX_HASH_LEN]);
+int indexFindHash(const char *hash, const char *exclude, char *path, size_t size);
+int indexHashFile(int fd, char hash[INDEX_HASH_LEN]);
+int indexSetChunks(const char *path, const struct chunk *chunks, int n, long long stamp);
+int indexGetChunks(const char *path, struct chunk **chunks, long long *stamp);
+
+#endif
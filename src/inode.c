@@ -0,0 +1,444 @@
+// need this for openat() and O_DIRECTORY under -std=c99
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "inode.h"
+
+struct inode
+{
+    unsigned long ino;
+    unsigned long parent;
+    char *name;
+    unsigned long hash;         // of parent and name
+    unsigned long nlookup;      // lookups the kernel hasn't forgotten
+    int isDir;
+    int fd;                     // directories once used, -1 otherwise
+    int holds;                  // callers using fd
+    int kids;                   // inodes naming it as their parent
+    int named;                  // parent/name still refers to it
+    struct inode *nextIno;      // in its bucket of each table
+    struct inode *nextName;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct inode **byIno = NULL;
+static struct inode **byName = NULL;
+static unsigned long numBuckets = 0;   // a power of two
+static unsigned long count = 0;
+static unsigned long nextIno = INODE_ROOT;
+
+static unsigned long nameHash(unsigned long parent, const char *name)
+{
+    // FNV-1a over the parent's number, then the name
+    unsigned long h = 2166136261UL;
+    int i;
+    for (i = 0; i < (int) sizeof(parent); i++)
+        h = (h ^ ((parent >> (8 * i)) & 0xff)) * 16777619UL;
+    for (; *name != '\0'; name++)
+        h = (h ^ (unsigned char) *name) * 16777619UL;
+    return h;
+}
+
+// Caller holds lock
+static struct inode *findIno(unsigned long ino)
+{
+    struct inode *n;
+    for (n = byIno[ino & (numBuckets - 1)]; n != NULL; n = n->nextIno)
+    {
+        if (n->ino == ino)
+            return n;
+    }
+    return NULL;
+}
+
+// Caller holds lock
+static struct inode *findName(unsigned long parent, const char *name, unsigned long hash)
+{
+    struct inode *n;
+    for (n = byName[hash & (numBuckets - 1)]; n != NULL; n = n->nextName)
+    {
+        if (n->hash == hash && n->parent == parent && !strcmp(n->name, name))
+            return n;
+    }
+    return NULL;
+}
+
+// Caller holds lock
+static void insertName(struct inode *n)
+{
+    struct inode **bucket = &byName[n->hash & (numBuckets - 1)];
+    n->nextName = *bucket;
+    *bucket = n;
+    n->named = 1;
+}
+
+// Caller holds lock.  The name now means something else, or nothing.
+static void removeName(struct inode *n)
+{
+    if (!n->named)
+        return;
+    struct inode **p = &byName[n->hash & (numBuckets - 1)];
+    while (*p != n)
+        p = &(*p)->nextName;
+    *p = n->nextName;
+    n->named = 0;
+}
+
+// Caller holds lock.  Twice the buckets once there are as many inodes as
+// buckets; if there's no memory for them the chains just get longer.
+static void grow()
+{
+    unsigned long size = numBuckets * 2;
+    unsigned long i;
+    struct inode **inos = calloc(size, sizeof(struct inode *));
+    struct inode **names = calloc(size, sizeof(struct inode *));
+    if (inos == NULL || names == NULL)
+    {
+        free(inos);
+        free(names);
+        return;
+    }
+    for (i = 0; i < numBuckets; i++)
+    {
+        while (byIno[i] != NULL)
+        {
+            struct inode *n = byIno[i];
+            byIno[i] = n->nextIno;
+            n->nextIno = inos[n->ino & (size - 1)];
+            inos[n->ino & (size - 1)] = n;
+        }
+        while (byName[i] != NULL)
+        {
+            struct inode *n = byName[i];
+            byName[i] = n->nextName;
+            n->nextName = names[n->hash & (size - 1)];
+            names[n->hash & (size - 1)] = n;
+        }
+    }
+    free(byIno);
+    free(byName);
+    byIno = inos;
+    byName = names;
+    numBuckets = size;
+}
+
+// Caller holds lock.  Gone once the kernel has forgotten it, nobody is
+// using its fd and nothing under it is left; the root stays.
+static void maybeFree(struct inode *n)
+{
+    while (n != NULL && n->nlookup == 0 && n->holds == 0 && n->kids == 0 && n->ino != INODE_ROOT)
+    {
+        struct inode **p = &byIno[n->ino & (numBuckets - 1)];
+        while (*p != n)
+            p = &(*p)->nextIno;
+        *p = n->nextIno;
+        removeName(n);
+        if (n->fd >= 0)
+            close(n->fd);
+        count--;
+        struct inode *parent = findIno(n->parent);
+        free(n->name);
+        free(n);
+        // its parent may have been waiting on it
+        if (parent != NULL)
+            parent->kids--;
+        n = parent;
+    }
+}
+
+// Caller holds lock.  n's directory fd, opened relative to its parent's
+// the first time it's wanted.
+static int openDir(struct inode *n)
+{
+    if (n == NULL)
+    {
+        errno = ESTALE;
+        return -1;
+    }
+    if (n->fd >= 0)
+        return n->fd;
+    if (!n->isDir)
+    {
+        errno = ENOTDIR;
+        return -1;
+    }
+    if (!n->named)
+    {
+        errno = ESTALE;
+        return -1;
+    }
+    int parentFd = openDir(findIno(n->parent));
+    if (parentFd < 0)
+        return -1;
+    n->fd = openat(parentFd, n->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    return n->fd;
+}
+
+int inodeInit(const char *rootdir)
+{
+    numBuckets = 1024;
+    byIno = calloc(numBuckets, sizeof(struct inode *));
+    byName = calloc(numBuckets, sizeof(struct inode *));
+    struct inode *root = calloc(1, sizeof(struct inode));
+    if (byIno == NULL || byName == NULL || root == NULL || (root->name = strdup("")) == NULL)
+    {
+        free(root);
+        inodeDestroy();
+        return -1;
+    }
+    root->ino = INODE_ROOT;
+    root->isDir = 1;
+    root->nlookup = 1;
+    root->fd = open(rootdir, O_RDONLY | O_DIRECTORY);
+    if (root->fd < 0)
+    {
+        free(root->name);
+        free(root);
+        inodeDestroy();
+        return -1;
+    }
+    byIno[INODE_ROOT & (numBuckets - 1)] = root;
+    count = 1;
+    nextIno = INODE_ROOT + 1;
+    return 0;
+}
+
+// The kernel has been handed name under parent: its number, with one more
+// lookup counted against it.  0 if parent is unknown or there's no memory.
+unsigned long inodeAdd(unsigned long parent, const char *name, int isDir)
+{
+    unsigned long ino = 0;
+    unsigned long hash = nameHash(parent, name);
+
+    pthread_mutex_lock(&lock);
+    struct inode *n = findName(parent, name, hash);
+    // replaced behind our back by something of another type
+    if (n != NULL && n->isDir != isDir)
+    {
+        removeName(n);
+        n = NULL;
+    }
+    struct inode *up = n == NULL ? findIno(parent) : NULL;
+    if (n == NULL && up == NULL)
+        errno = ESTALE;
+    else if (n == NULL)
+    {
+        n = calloc(1, sizeof(struct inode));
+        if (n == NULL || (n->name = strdup(name)) == NULL)
+        {
+            free(n);
+            pthread_mutex_unlock(&lock);
+            errno = ENOMEM;
+            return 0;
+        }
+        if (count >= numBuckets)
+            grow();
+        n->ino = nextIno++;
+        n->parent = parent;
+        n->hash = hash;
+        n->isDir = isDir;
+        n->fd = -1;
+        struct inode **bucket = &byIno[n->ino & (numBuckets - 1)];
+        n->nextIno = *bucket;
+        *bucket = n;
+        insertName(n);
+        up->kids++;
+        count++;
+    }
+    if (n != NULL)
+    {
+        n->nlookup++;
+        ino = n->ino;
+    }
+    pthread_mutex_unlock(&lock);
+    return ino;
+}
+
+void inodeForget(unsigned long ino, unsigned long nlookup)
+{
+    pthread_mutex_lock(&lock);
+    struct inode *n = findIno(ino);
+    if (n != NULL)
+    {
+        n->nlookup -= nlookup < n->nlookup ? nlookup : n->nlookup;
+        maybeFree(n);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// fd of directory dir, held until inodeRelease(dir); -1 with errno set
+int inodeDirFd(unsigned long dir)
+{
+    pthread_mutex_lock(&lock);
+    struct inode *n = findIno(dir);
+    int fd = openDir(n);
+    if (fd >= 0)
+        n->holds++;
+    pthread_mutex_unlock(&lock);
+    return fd;
+}
+
+// fd of the directory ino is in, with its name there, so that the *at()
+// calls reach it.  The root is "." in its own fd.  Held as inodeDirFd().
+int inodeAt(unsigned long ino, unsigned long *dir, char name[NAME_MAX + 1])
+{
+    int fd = -1;
+    pthread_mutex_lock(&lock);
+    struct inode *n = findIno(ino);
+    struct inode *d = NULL;
+    if (n != NULL && n->ino == INODE_ROOT)
+    {
+        d = n;
+        strcpy(name, ".");
+    }
+    else if (n != NULL && n->named)
+    {
+        d = findIno(n->parent);
+        strncpy(name, n->name, NAME_MAX);
+        name[NAME_MAX] = '\0';
+    }
+    if ((fd = openDir(d)) >= 0)
+    {
+        d->holds++;
+        *dir = d->ino;
+    }
+    pthread_mutex_unlock(&lock);
+    return fd;
+}
+
+void inodeRelease(unsigned long dir)
+{
+    pthread_mutex_lock(&lock);
+    struct inode *n = findIno(dir);
+    if (n != NULL)
+    {
+        n->holds--;
+        maybeFree(n);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Caller holds lock.  Put s in front of what's been built at path + *pos.
+static int prepend(char path[PATH_MAX], size_t *pos, const char *s)
+{
+    size_t len = strlen(s);
+    if (len > *pos)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    *pos -= len;
+    memcpy(path + *pos, s, len);
+    return 0;
+}
+
+// The path of ino, or of name under it, from the mount's root; -1 with
+// errno set if it no longer has one
+int inodePath(unsigned long ino, const char *name, char path[PATH_MAX])
+{
+    char buf[PATH_MAX];
+    size_t pos = PATH_MAX - 1;
+    int res = 0;
+    buf[pos] = '\0';
+
+    pthread_mutex_lock(&lock);
+    if (name != NULL)
+        res = prepend(buf, &pos, name) < 0 || prepend(buf, &pos, "/") < 0 ? -1 : 0;
+    struct inode *n = findIno(ino);
+    while (res == 0 && n != NULL && n->ino != INODE_ROOT)
+    {
+        if (!n->named)
+            break;
+        if (prepend(buf, &pos, n->name) < 0 || prepend(buf, &pos, "/") < 0)
+            res = -1;
+        n = findIno(n->parent);
+    }
+    if (res == 0 && (n == NULL || n->ino != INODE_ROOT))
+    {
+        errno = ESTALE;
+        res = -1;
+    }
+    pthread_mutex_unlock(&lock);
+    if (res == 0)
+    {
+        if (pos == PATH_MAX - 1)
+            buf[--pos] = '/';
+        memcpy(path, buf + pos, PATH_MAX - pos);
+    }
+    return res;
+}
+
+// name under parent was renamed to newName under newParent, replacing
+// whatever that was
+void inodeMove(unsigned long parent, const char *name, unsigned long newParent, const char *newName)
+{
+    unsigned long hash = nameHash(newParent, newName);
+
+    pthread_mutex_lock(&lock);
+    struct inode *n = findName(parent, name, nameHash(parent, name));
+    struct inode *target = findName(newParent, newName, hash);
+    if (target != NULL && target != n)
+        removeName(target);
+    struct inode *up = findIno(newParent);
+    if (n != NULL)
+        removeName(n);
+    // without its new name it can't be reached by path any more
+    char *copy = n != NULL && up != NULL ? strdup(newName) : NULL;
+    if (copy != NULL)
+    {
+        struct inode *old = findIno(n->parent);
+        free(n->name);
+        n->name = copy;
+        n->parent = newParent;
+        n->hash = hash;
+        insertName(n);
+        up->kids++;
+        if (old != NULL)
+        {
+            old->kids--;
+            maybeFree(old);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// name under parent was removed; its inode lives on until it's forgotten
+void inodeDrop(unsigned long parent, const char *name)
+{
+    pthread_mutex_lock(&lock);
+    struct inode *n = findName(parent, name, nameHash(parent, name));
+    if (n != NULL)
+        removeName(n);
+    pthread_mutex_unlock(&lock);
+}
+
+void inodeDestroy()
+{
+    unsigned long i;
+    pthread_mutex_lock(&lock);
+    for (i = 0; byIno != NULL && i < numBuckets; i++)
+    {
+        while (byIno[i] != NULL)
+        {
+            struct inode *n = byIno[i];
+            byIno[i] = n->nextIno;
+            if (n->fd >= 0)
+                close(n->fd);
+            free(n->name);
+            free(n);
+        }
+    }
+    free(byIno);
+    free(byName);
+    byIno = NULL;
+    byName = NULL;
+    numBuckets = 0;
+    count = 0;
+    pthread_mutex_unlock(&lock);
+}
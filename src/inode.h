@@ -0,0 +1,27 @@
+#ifndef _INODE_H_
+#define _INODE_H_
+
+#include <limits.h>
+
+// inode table for the low-level frontend.  Every name the kernel looks up
+// is given a number, which it keeps until the kernel forgets it.  A number
+// remembers its parent and name, so the path can be rebuilt for the calls
+// that still need one, and a directory keeps an fd open once it's used so
+// the names under it are reached with fstatat()/openat() rather than by
+// walking the whole path again.  A directory stays in the table while
+// anything under it does, and an fd handed out stays open until it is
+// released, even if the kernel forgets the directory meanwhile.
+#define INODE_ROOT 1
+
+int inodeInit(const char *rootdir);
+unsigned long inodeAdd(unsigned long parent, const char *name, int isDir);
+void inodeForget(unsigned long ino, unsigned long nlookup);
+int inodeDirFd(unsigned long dir);
+int inodeAt(unsigned long ino, unsigned long *dir, char name[NAME_MAX + 1]);
+void inodeRelease(unsigned long dir);
+int inodePath(unsigned long ino, const char *name, char path[PATH_MAX]);
+void inodeMove(unsigned long parent, const char *name, unsigned long newParent, const char *newName);
+void inodeDrop(unsigned long parent, const char *name);
+void inodeDestroy();
+
+#endif
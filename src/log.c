@@ -23,10 +23,11 @@
 
 #include "log.h"
 
+// set by log_open(), so logging doesn't need pfs.h
+static FILE *logfile = NULL;
+
 FILE *log_open(char* filename)
 {
-    FILE *logfile;
-    
     // very first thing, open up the logfile and mark that we got in
     // here.  If we can't open the logfile, we're dead.
     logfile = fopen(filename, "w");
@@ -46,7 +47,8 @@ void log_msg(const char *format, ...)
     va_list ap;
     va_start(ap, format);
 
-    vfprintf(PRI_DATA->logfile, format, ap);
+    vfprintf(logfile, format, ap);
     //vfprintf(stderr,format,ap);
+    va_end(ap);
 
 }
@@ -9,7 +9,19 @@
 */
 
 #include "pfs.h"
+#include "antientropy.h"
+#include "attrcache.h"
+#include "chunk.h"
+#include "clone.h"
+#include "health.h"
+#include "hint.h"
+#include "index.h"
+#include "inode.h"
 #include "log.h"
+#include "pool.h"
+#include "rebalance.h"
+#include "uring.h"
+#include "writeback.h"
 
 #include "config.h"
 #include <fuse_opt.h>
@@ -20,33 +32,42 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <ftw.h>
 #include <fuse.h>
 #include <fuse_common.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 
+struct state* pfs_data;
+
 int mapNameToDrives(const char* path){
 	log_msg("Entered mapNameToDrives, path is: %s\n",path);
-	char* key = calloc(strlen(path),sizeof(char));
-	strcpy(key,path);
-	struct node* drive = search(key);
-	int driveNum = atoi(&drive->mount[strlen(drive->mount)-1]);
-	log_msg("Drive Num:%d\n",driveNum);
-	return driveNum;
+	struct node drive = search(path);
+	log_msg("Drive Num:%d\n",drive.drive);
+	return drive.drive;
 }
 
-static int pfs_error(char* str){
+static int pfs_error(const char* str){
 	int ret = -errno;
 	log_msg("	ERROR %s: %s\n",str,strerror(errno));
 	return ret;
 }
 
+//  Errors that mean the master's disk let us down, rather than its answer
+//  about the file.  Only these send a read to the replicas: a replica may
+//  still hold what the master has just removed.
+static int pfs_failover_error(int err){
+	return err == EIO || err == ENXIO || err == ESTALE || err == ENODEV;
+}
+
 //  All the paths I see are relative to the root of the mounted
 //  filesystem.  In order to get to the underlying filesystem, I need to
 //  have the mountpoint.  I'll save it away early on in main(), and then
@@ -64,16 +85,1016 @@ static void pfs_fullpath(char fpath[PATH_MAX], const char *path)
 }
 
 
+//  Replica i of a file lives at the same relative path under
+//  backup/<drive>.
+static void pfs_backuppath(char fpath[PATH_MAX], int drive, const char *path)
+{
+	snprintf(fpath, PATH_MAX, "%s/%d%s", PRI_DATA->backup, drive, path);
+}
+
+//  Bring path's row in the local index up to date with the master copy
+static void pfs_index_refresh(const char* path){
+	char fpath[PATH_MAX];
+	struct stat st;
+	if(!indexEnabled()){
+		return;
+	}
+	pfs_fullpath(fpath, path);
+	if(lstat(fpath, &st) == 0){
+		indexUpdate(path, &st);
+	}
+	else if(errno == ENOENT){
+		indexRemove(path);
+	}
+}
+
+//  path has changed: drop it from the stat cache, along with its parent
+//  directory if an entry was added to or taken from it, and have
+//  anti-entropy look at it again
+static void pfs_attr_changed(const char* path, int parent){
+	attrCacheInvalidate(path);
+	aeChanged(path);
+	if(parent){
+		char dir[PATH_MAX];
+		snprintf(dir, PATH_MAX, "%s", path);
+		char* slash = strrchr(dir, '/');
+		if(slash == dir){
+			slash[1] = '\0';
+		}
+		else if(slash != NULL){
+			*slash = '\0';
+		}
+		attrCacheInvalidate(dir);
+	}
+}
+
+static int pfs_ae_note(const char* fpath, const struct stat* sb, int typeflag, struct FTW* ftwbuf){
+	aeChanged(fpath + strlen(PRI_DATA->rootdir));
+	return 0;
+}
+
+//  path was renamed to newpath, or back: everything under either name
+//  has changed
+static void pfs_ae_moved(const char* path, const char* newpath){
+	char fpath[PATH_MAX];
+	aeChangedTree(path);
+	aeChangedTree(newpath);
+	pfs_fullpath(fpath, path);
+	nftw(fpath, pfs_ae_note, 64, FTW_PHYS);
+	pfs_fullpath(fpath, newpath);
+	nftw(fpath, pfs_ae_note, 64, FTW_PHYS);
+}
+
+static int pfs_has_drive(const int* drives, int n, int drive){
+	for(int i = 0; i < n; i++){
+		if(drives[i] == drive) return 1;
+	}
+	return 0;
+}
+
+//  A mutating call to mirror onto the replicas of a path.  apply() runs
+//  on the worker pool with the backup paths already built, and returns
+//  >= 0 on success.
+struct pfs_replica_op {
+	const char* name;
+	int (*apply)(struct pfs_replica_op* op, const char* fpath2, const char* fnewpath2);
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	off_t size;
+	int flags;
+	struct utimbuf* ubuf;
+	const char* xname;
+	const char* value;
+	int fd;
+	const char* placeBy;	// ring key if not the path
+	void* data;		// anything else apply needs
+	// filled in by pfs_replicate(), indexed by position round the ring
+	const char* path;
+	const char* newpath;
+	int wanted;		// the first wanted drives are where the copies belong
+	int numDrives;
+	int* drives;
+	char (*fpaths)[PATH_MAX];
+	char (*fnewpaths)[PATH_MAX];
+	int* results;
+	int* batch;		// positions of the drives being tried now
+};
+
+//  Updates to a drive that is down skip it without trying
+static int pfs_drive_down(int drive){
+	return healthState(drive) == HEALTH_DOWN || hintDown(drive);
+}
+
+static int pfs_replica_task(int i, void* arg){
+	struct pfs_replica_op* op = arg;
+	int k = op->batch[i];
+	long long start = healthStart();
+	int res = op->apply(op, op->fpaths[k], op->fnewpaths ? op->fnewpaths[k] : NULL);
+	int err = res < 0 ? errno : 0;
+	healthReport(op->drives[k], start, err);
+	if(res < 0){
+		errno = err;
+		log_msg("ERROR: %s on backup/%d\n",op->name,op->drives[k]);
+		res = pfs_error(op->name);
+		aeSuspect(op->drives[k], op->path);
+		if(k < op->wanted) hintAdd(op->drives[k], op->path, op->newpath);
+	}
+	else{
+		log_msg("Successful write to:%s\n",op->fpaths[k]);
+	}
+	op->results[k] = res;
+	return res;
+}
+
+//  Apply op to the replicas of path (renamed to newpath, if given).  The
+//  drives the ring picks are all sent the op at once; any that fail are
+//  replaced by the next drives round the ring, again all at once, until
+//  enough copies exist or every drive has been tried.  Drives that are
+//  down are passed over without being tried, and slow ones are the last
+//  to stand in for another.  Returns the
+//  number of replicas that succeeded.  The caller frees op->drives,
+//  fpaths, fnewpaths and results with pfs_replicate_done().
+static int pfs_replicate(struct pfs_replica_op* op, const char* path, const char* newpath){
+	int numMounts = PRI_DATA->numMounts;
+	int wanted = PRI_DATA->copies - 1;
+	int written = 0;
+	
+	op->path = path;
+	op->newpath = newpath;
+	op->wanted = wanted;
+	op->numDrives = 0;
+	op->drives = NULL;
+	op->fpaths = NULL;
+	op->fnewpaths = NULL;
+	op->results = NULL;
+	if(PRI_DATA->master != 1 || wanted <= 0){
+		return 0;
+	}
+	
+	op->numDrives = numMounts;
+	op->drives = calloc(numMounts,sizeof(int));
+	op->results = calloc(numMounts,sizeof(int));
+	op->fpaths = calloc(numMounts,PATH_MAX);
+	if(newpath != NULL){
+		op->fnewpaths = calloc(numMounts,PATH_MAX);
+	}
+	//drives the index says already hold path go first, then the ring
+	int known = op->placeBy == NULL ? indexGetReplicas(path, op->drives, numMounts) : 0;
+	int first = mapNameToDrives(op->placeBy != NULL ? op->placeBy : path);
+	for(int i = 0, k = known; i < numMounts && k < numMounts; i++){
+		int drive = (first + i) % numMounts;
+		int seen = 0;
+		for(int j = 0; j < known; j++){
+			if(op->drives[j] == drive) seen = 1;
+		}
+		if(!seen) op->drives[k++] = drive;
+	}
+	for(int i = 0; i < numMounts; i++){
+		op->results[i] = -1;
+		pfs_backuppath(op->fpaths[i], op->drives[i], path);
+		if(newpath != NULL){
+			pfs_backuppath(op->fnewpaths[i], op->drives[i], newpath);
+		}
+	}
+	
+	//the order drives are tried in: the ones the copies belong on, then
+	//healthy stand-ins, then slow ones
+	int order[numMounts];
+	int state[numMounts];
+	int numOrder = 0;
+	for(int i = 0; i < numMounts; i++){
+		state[i] = pfs_drive_down(op->drives[i]) ? HEALTH_DOWN : healthState(op->drives[i]);
+		if(state[i] == HEALTH_DOWN){
+			if(i < wanted) hintAdd(op->drives[i], path, newpath);
+		}
+		else if(i < wanted || state[i] == HEALTH_UP){
+			order[numOrder++] = i;
+		}
+	}
+	for(int i = wanted; i < numMounts; i++){
+		if(state[i] == HEALTH_SUSPECT) order[numOrder++] = i;
+	}
+	
+	for(int next = 0; written < wanted && next < numOrder; ){
+		int batch = wanted - written;
+		if(next + batch > numOrder){
+			batch = numOrder - next;
+		}
+		op->batch = order + next;
+		poolRun(batch, pfs_replica_task, op, NULL);
+		for(int i = 0; i < batch; i++){
+			if(op->results[op->batch[i]] >= 0) written++;
+		}
+		next += batch;
+	}
+	op->batch = NULL;
+	log_msg("%s: %d of %d replicas written\n",op->name,written,wanted);
+	return written;
+}
+
+//  A change only succeeds once W copies, the master counting as one,
+//  have taken it
+static int pfs_quorum(int retstat, int replicasWritten){
+	if(retstat < 0 || PRI_DATA->master != 1){
+		return retstat;
+	}
+	if(1 + replicasWritten < PRI_DATA->writeQuorum){
+		log_msg("ERROR: only %d of %d required copies written\n",1 + replicasWritten,PRI_DATA->writeQuorum);
+		return -EIO;
+	}
+	return retstat;
+}
+
+//  Take a change that missed its quorum back off the replicas that took
+//  it.  op is as it was applied, with whatever fields undo needs set back
+//  to the old values.
+static void pfs_replicate_undo(struct pfs_replica_op* op,
+		int (*undo)(struct pfs_replica_op* op, const char* fpath2, const char* fnewpath2)){
+	for(int i = 0; i < op->numDrives; i++){
+		if(op->results[i] >= 0 && undo(op, op->fpaths[i], op->fnewpaths ? op->fnewpaths[i] : NULL) < 0){
+			log_msg("ERROR: could not undo %s on backup/%d\n",op->name,op->drives[i]);
+			pfs_error(op->name);
+			//left for anti-entropy to put right
+			aeSuspect(op->drives[i], op->path);
+		}
+	}
+}
+
+//  Every copy of path a read can be served from: the master first, then
+//  the replicas in ring order.  *fpaths is allocated; the caller frees it.
+static int pfs_copies(const char* path, char (**fpaths)[PATH_MAX]){
+	int replicas = PRI_DATA->master == 1 ? PRI_DATA->copies - 1 : 0;
+	*fpaths = calloc(1 + replicas,PATH_MAX);
+	pfs_fullpath((*fpaths)[0], path);
+	if(replicas > 0){
+		//where the replicas were actually put, if the index knows, or
+		//where the last ring put them if they haven't been moved yet
+		int drives[replicas];
+		int known = indexGetReplicas(path, drives, replicas);
+		if(known == 0){
+			known = rbOldDrives(path, drives, replicas);
+		}
+		int first = mapNameToDrives(path);
+		for(int i = 0; i < replicas; i++){
+			int drive = i < known ? drives[i] : (first + i) % PRI_DATA->numMounts;
+			pfs_backuppath((*fpaths)[1+i], drive, path);
+		}
+	}
+	return 1 + replicas;
+}
+
+static void pfs_replicate_done(struct pfs_replica_op* op){
+	free(op->drives);
+	free(op->results);
+	free(op->fpaths);
+	free(op->fnewpaths);
+}
+
+//  Dedup mode keeps each distinct content once per drive, under
+//  <drive>/.pfs-objects/<key>, and every replica of a path with that
+//  content is a hard link to it.  The object's link count is its
+//  reference count: an object only the store itself links to is garbage.
+//  A link shows the object's mode and owner, so those are part of the key
+//  and a chmod or chown relinks the path's replicas instead of changing
+//  what other paths share.  Times aren't: they stay with the master copy
+//  and the index, and the objects are never touched.
+#define PFS_OBJECTS "/.pfs-objects"
+#define PFS_DEDUP_KEY (INDEX_HASH_LEN + 48)
+
+static void pfs_dedup_key(char key[PFS_DEDUP_KEY], const char* hash, const struct stat* st){
+	snprintf(key, PFS_DEDUP_KEY, "%s-%o-%lu-%lu", hash, (unsigned) (st->st_mode & 07777),
+		(unsigned long) st->st_uid, (unsigned long) st->st_gid);
+}
+
+//  st's replicas are links to shared objects
+static int pfs_dedup_file(const struct stat* st){
+	return PRI_DATA->writeMode == PFS_WRITE_DEDUP && S_ISREG(st->st_mode);
+}
+
+//  What the replicas of a path pointed at before it changed or went away
+struct pfs_dedup_ref {
+	char key[PFS_DEDUP_KEY];
+	int numDrives;
+	int* drives;
+};
+
+//  was is the mode and owner the replicas were linked with, if the master
+//  copy doesn't have them any more
+static void pfs_dedup_ref(const char* path, struct pfs_dedup_ref* ref, const struct stat* was){
+	char hash[INDEX_HASH_LEN];
+	char fpath[PATH_MAX];
+	struct stat st;
+	ref->numDrives = 0;
+	ref->drives = NULL;
+	if(PRI_DATA->writeMode != PFS_WRITE_DEDUP || !indexGetHash(path, hash)){
+		return;
+	}
+	pfs_fullpath(fpath, path);
+	if(was == NULL && lstat(fpath, &st) < 0){
+		return;
+	}
+	pfs_dedup_key(ref->key, hash, was != NULL ? was : &st);
+	ref->drives = calloc(PRI_DATA->numMounts,sizeof(int));
+	ref->numDrives = indexGetReplicas(path, ref->drives, PRI_DATA->numMounts);
+}
+
+//  Drop the links path left on drives it is no longer replicated to
+//  (all but keep), then any object nothing refers to any more
+static void pfs_dedup_unref(struct pfs_dedup_ref* ref, const char* path, const int* keep, int numKeep){
+	char fpath2[PATH_MAX];
+	char obj[PATH_MAX];
+	struct stat st;
+	for(int i = 0; i < ref->numDrives; i++){
+		int kept = 0;
+		for(int j = 0; j < numKeep; j++){
+			if(keep[j] == ref->drives[i]) kept = 1;
+		}
+		if(!kept){
+			pfs_backuppath(fpath2, ref->drives[i], path);
+			unlink(fpath2);
+		}
+		snprintf(obj, PATH_MAX, "%s/%d" PFS_OBJECTS "/%s", PRI_DATA->backup, ref->drives[i], ref->key);
+		if(lstat(obj, &st) == 0 && st.st_nlink <= 1){
+			log_msg("pfs_dedup: dropping %s\n",obj);
+			unlink(obj);
+		}
+	}
+	free(ref->drives);
+	ref->drives = NULL;
+	ref->numDrives = 0;
+}
+
+//  make the directories above fpath, wherever they are missing
+static void pfs_dedup_parents(const char* fpath){
+	char dir[PATH_MAX];
+	snprintf(dir, PATH_MAX, "%s", fpath);
+	for(char* p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')){
+		*p = '\0';
+		mkdir(dir, 0755);
+		*p = '/';
+	}
+}
+
+//  fnewpath2 is the object for the content open on op->fd.  Store it
+//  if this drive doesn't have it yet, then swap the replica at fpath2
+//  for a link to it.
+static int pfs_dedup_replica(struct pfs_replica_op* op, const char* fpath2, const char* fobj2){
+	char tmp[PATH_MAX + 16];
+	struct stat st;
+	if(lstat(fobj2, &st) < 0){
+		if(errno != ENOENT){
+			return -1;
+		}
+		//a whole object appears at once, or not at all
+		snprintf(tmp, sizeof(tmp), "%s.XXXXXX", fobj2);
+		pfs_dedup_parents(fobj2);
+		int fd2 = mkstemp(tmp);
+		if(fd2 < 0){
+			return -1;
+		}
+		int res = fchmod(fd2, op->mode);
+		if(res == 0) res = fchown(fd2, op->uid, op->gid);
+		if(res == 0) res = cloneFile(op->fd, fd2);
+		if(res == 0) res = rename(tmp, fobj2);
+		int saved = errno;
+		close(fd2);
+		if(res < 0){
+			unlink(tmp);
+			errno = saved;
+			return -1;
+		}
+	}
+	//already a reference to it; rename() would leave tmp behind
+	struct stat cur;
+	if(lstat(fobj2, &st) < 0){
+		return -1;
+	}
+	if(lstat(fpath2, &cur) == 0 && cur.st_ino == st.st_ino && cur.st_dev == st.st_dev){
+		return 0;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.pfs-link", fpath2);
+	unlink(tmp);
+	if(link(fobj2, tmp) < 0){
+		if(errno != ENOENT){
+			return -1;
+		}
+		pfs_dedup_parents(fpath2);
+		if(link(fobj2, tmp) < 0){
+			return -1;
+		}
+	}
+	if(rename(tmp, fpath2) < 0){
+		int saved = errno;
+		unlink(tmp);
+		errno = saved;
+		return -1;
+	}
+	return 0;
+}
+
+//  Share the master copy's blocks with another file of the same content,
+//  where the filesystem can
+static void pfs_dedup_master(const char* path, const char* hash){
+	char other[PATH_MAX];
+	char fpath[PATH_MAX];
+	char fother[PATH_MAX];
+	if(!indexFindHash(hash, path, other, PATH_MAX)){
+		return;
+	}
+	pfs_fullpath(fpath, path);
+	pfs_fullpath(fother, other);
+	int fd = open(fother, O_RDONLY);
+	int fd2 = open(fpath, O_RDWR);
+	if(fd >= 0 && fd2 >= 0 && dedupeFile(fd, fd2) == 0){
+		log_msg("pfs_dedup: %s shares its blocks with %s\n",path,other);
+	}
+	if(fd >= 0) close(fd);
+	if(fd2 >= 0) close(fd2);
+}
+
+//  Dedup mode: point the replicas of the finished master copy of path at
+//  the objects for its content.  The objects are placed round the ring by
+//  content hash, so a drive that already holds the same photo under any
+//  other name takes no data at all.  was is as for pfs_dedup_ref().
+//  Returns the number of replicas.
+static int pfs_dedup_replicas(const char* path, const struct stat* was){
+	char fpath[PATH_MAX];
+	char obj[sizeof(PFS_OBJECTS) + PFS_DEDUP_KEY + 1];
+	char key[PFS_DEDUP_KEY];
+	char hash[INDEX_HASH_LEN];
+	struct stat st;
+	pfs_fullpath(fpath, path);
+	int fd = open(fpath, O_RDONLY);
+	if(fd < 0){
+		return pfs_error("pfs_dedup open");
+	}
+	if(fstat(fd, &st) < 0 || indexHashFile(fd, hash) < 0){
+		pfs_error("pfs_dedup hash");
+		close(fd);
+		return -1;
+	}
+	struct pfs_dedup_ref old;
+	pfs_dedup_ref(path, &old, was);
+	pfs_dedup_master(path, hash);
+	
+	pfs_dedup_key(key, hash, &st);
+	snprintf(obj, sizeof(obj), PFS_OBJECTS "/%s", key);
+	struct pfs_replica_op op = { .name = "pfs_dedup", .apply = pfs_dedup_replica,
+		.fd = fd, .mode = st.st_mode & 07777, .uid = st.st_uid, .gid = st.st_gid, .placeBy = hash };
+	int written = pfs_replicate(&op, path, obj);
+	int placed[op.numDrives + 1];
+	int n = 0;
+	for(int i = 0; i < op.numDrives; i++){
+		if(op.results[i] >= 0) placed[n++] = op.drives[i];
+	}
+	pfs_replicate_done(&op);
+	close(fd);
+	
+	indexSetHash(path, hash);
+	indexSetReplicas(path, placed, n);
+	pfs_dedup_unref(&old, path, placed, n);
+	return written;
+}
+
+//  A chunked replica update: the master's manifest now, and the one the
+//  replicas were last written from, sorted by hash
+struct pfs_chunk_sync {
+	const struct chunk* chunks;
+	int numChunks;
+	struct chunk* old;
+	int numOld;
+	uint64_t oldSize;
+	long long oldStamp;
+	struct timespec stamp;
+	size_t sent;
+	size_t reused;
+};
+
+static long long pfs_timespec_ns(const struct timespec* ts){
+	return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+//  Rebuild the replica at fpath2 beside itself: chunks its old copy
+//  already has are copied across on the replica's own drive and only
+//  new ones come from the master
+static int pfs_chunk_replica(struct pfs_replica_op* op, const char* fpath2, const char* unused){
+	struct pfs_chunk_sync* sync = op->data;
+	char tmp[PATH_MAX + 16];
+	struct stat st;
+	
+	//the old copy can only be trusted if it is the one the manifest
+	//describes, i.e. the last sync stamped it
+	int old = sync->numOld > 0 ? open(fpath2, O_RDONLY) : -1;
+	if(old >= 0 && (fstat(old, &st) < 0 || (uint64_t) st.st_size != sync->oldSize ||
+	   pfs_timespec_ns(&st.st_mtim) != sync->oldStamp)){
+		close(old);
+		old = -1;
+	}
+	snprintf(tmp, sizeof(tmp), "%s.pfs-chunk", fpath2);
+	int fd2 = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, op->mode);
+	if(fd2 < 0){
+		if(old >= 0) close(old);
+		return -1;
+	}
+	
+	int res = 0;
+	size_t sent = 0;
+	size_t reused = 0;
+	for(int i = 0; i < sync->numChunks && res == 0; i++){
+		const struct chunk* c = &sync->chunks[i];
+		const struct chunk* had = old >= 0 ? chunkFind(sync->old, sync->numOld, c->hash) : NULL;
+		if(had != NULL){
+			res = cloneRange(old, had->offset, fd2, c->offset, c->len);
+			reused += c->len;
+		}
+		else{
+			res = cloneRange(op->fd, c->offset, fd2, c->offset, c->len);
+			sent += c->len;
+		}
+	}
+	if(res == 0){
+		struct timespec times[2] = { sync->stamp, sync->stamp };
+		res = futimens(fd2, times);
+	}
+	int saved = errno;
+	close(fd2);
+	if(old >= 0) close(old);
+	if(res == 0) res = rename(tmp, fpath2);
+	if(res < 0){
+		saved = errno;
+		unlink(tmp);
+		errno = saved;
+		return -1;
+	}
+	__atomic_add_fetch(&sync->sent, sent, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sync->reused, reused, __ATOMIC_RELAXED);
+	return 0;
+}
+
+//  Chunk mode: bring the replicas of path up to date with the finished
+//  master copy, sending only the chunks an edit actually changed.
+//  Returns the number of replicas written.
+static int pfs_chunk_replicas(const char* path){
+	char fpath[PATH_MAX];
+	struct stat st;
+	struct chunk* chunks;
+	pfs_fullpath(fpath, path);
+	int fd = open(fpath, O_RDONLY);
+	if(fd < 0){
+		return pfs_error("pfs_chunk open");
+	}
+	int n = fstat(fd, &st) == 0 ? chunkFile(fd, &chunks) : -1;
+	if(n < 0){
+		pfs_error("pfs_chunk chunkFile");
+		close(fd);
+		return -1;
+	}
+	
+	struct pfs_chunk_sync sync = { .chunks = chunks, .numChunks = n, .stamp = st.st_mtim };
+	sync.numOld = indexGetChunks(path, &sync.old, &sync.oldStamp);
+	for(int i = 0; i < sync.numOld; i++){
+		sync.oldSize += sync.old[i].len;
+	}
+	chunkSort(sync.old, sync.numOld);
+	
+	struct pfs_replica_op op = { .name = "pfs_chunk", .apply = pfs_chunk_replica,
+		.fd = fd, .mode = st.st_mode & 07777, .data = &sync };
+	int written = pfs_replicate(&op, path, NULL);
+	int placed[op.numDrives + 1];
+	int numPlaced = 0;
+	for(int i = 0; i < op.numDrives; i++){
+		if(op.results[i] >= 0) placed[numPlaced++] = op.drives[i];
+	}
+	pfs_replicate_done(&op);
+	close(fd);
+	
+	log_msg("pfs_chunk: %s in %d chunks, %zu bytes sent, %zu reused\n",path,n,sync.sent,sync.reused);
+	indexSetReplicas(path, placed, numPlaced);
+	//an empty file has no chunks, but its replicas are still current
+	indexSetChunks(path, chunks, numPlaced > 0 ? n : 0, pfs_timespec_ns(&st.st_mtim));
+	free(sync.old);
+	free(chunks);
+	return written;
+}
+
+//  Per open file state, hung off fuse_file_info->fh.  On the master the
+//  replica fds are opened once with the file and reused by every write,
+//  ftruncate and fsync until release, instead of reopening each backup
+//  file per call.
+struct pfs_handle {
+	int fd;
+	int numReplicas;
+	int* replicaFds;
+	int* replicaDrives;
+	struct wb_queue* queue;		// write-behind only
+	int dirty;			// clone mode: changed since open
+	int writer;			// counted in the index's writers
+	struct pfs_coalesce* coalesce;	// NULL unless coalescing
+	char* path;			// for reporting failed replica updates
+	int numHinted;
+	int* hintedDrives;		// where the file should be but couldn't be opened
+};
+
+//  Replica writes waiting to go out as one extent.  Adjacent writes are
+//  appended here and only sent to the replicas once the buffer fills, a
+//  write lands elsewhere, or the file is flushed, synced or truncated.
+struct pfs_coalesce {
+	pthread_mutex_t lock;
+	char* buf;
+	size_t cap;
+	size_t len;
+	off_t offset;
+};
+
+#define PFS_HANDLE(fi) ((struct pfs_handle*)(uintptr_t)(fi)->fh)
+
+static struct pfs_handle* pfs_handle_new(int fd){
+	struct pfs_handle* h = calloc(1,sizeof(struct pfs_handle));
+	h->fd = fd;
+	return h;
+}
+
+//  what a write-behind queue entry replays
+enum { PFS_WB_WRITE, PFS_WB_TRUNCATE, PFS_WB_FSYNC, PFS_WB_DATASYNC };
+
+static void pfs_writeback_apply(void* owner, int kind, const char* buf, size_t size, off_t offset);
+struct pfs_handle_op;
+static int pfs_ftruncate_fd(struct pfs_handle_op* op, int fd);
+
+static int pfs_open_replica(struct pfs_replica_op* op, const char* fpath2, const char* unused){
+	return open(fpath2, op->flags, op->mode);
+}
+
+//  Open the backup copies of path that writes through h go to.  Read-only
+//  handles never replicate, so they get none.
+static void pfs_open_replicas(struct pfs_handle* h, const char* path, int flags, mode_t mode){
+	if(PRI_DATA->master != 1 || (flags & O_ACCMODE) == O_RDONLY){
+		return;
+	}
+	//the replicas are only brought up to date on release
+	if(PRI_DATA->writeMode == PFS_WRITE_CLONE || PRI_DATA->writeMode == PFS_WRITE_DEDUP ||
+	   PRI_DATA->writeMode == PFS_WRITE_CHUNK){
+		h->dirty = (flags & O_TRUNC) != 0;
+		return;
+	}
+	struct pfs_replica_op op = { .name = "pfs_open replica open", .apply = pfs_open_replica,
+		.flags = flags, .mode = mode };
+	int opened = pfs_replicate(&op, path, NULL);
+	h->path = strdup(path);
+	
+	h->replicaFds = calloc(opened + 1,sizeof(int));
+	h->replicaDrives = calloc(opened + 1,sizeof(int));
+	h->hintedDrives = calloc(op.wanted + 1,sizeof(int));
+	for(int i = 0; i < op.numDrives; i++){
+		if(op.results[i] >= 0){
+			h->replicaFds[h->numReplicas] = op.results[i];
+			h->replicaDrives[h->numReplicas] = op.drives[i];
+			h->numReplicas++;
+		}
+		else if(i < op.wanted){
+			h->hintedDrives[h->numHinted++] = op.drives[i];
+		}
+	}
+	pfs_replicate_done(&op);
+	indexSetReplicas(path, h->replicaDrives, h->numReplicas);
+	
+	if(PRI_DATA->writeMode != PFS_WRITE_SYNC && h->numReplicas > 0){
+		h->queue = wbQueueNew(pfs_writeback_apply, h);
+	}
+	if(PRI_DATA->coalesceBytes > 0 && h->numReplicas > 0){
+		struct pfs_coalesce* c = calloc(1,sizeof(struct pfs_coalesce));
+		c->buf = malloc(PRI_DATA->coalesceBytes);
+		if(c->buf == NULL){
+			log_msg("ERROR: no memory for a write buffer, writing through\n");
+			free(c);
+			return;
+		}
+		c->cap = PRI_DATA->coalesceBytes;
+		pthread_mutex_init(&c->lock, NULL);
+		h->coalesce = c;
+	}
+}
+
+//  A call made through an open handle.  Task 0 is the master fd and
+//  task i the (i-1)th replica, so the master and every replica are
+//  updated at the same time.  first = 1 skips the master.
+struct pfs_handle_op {
+	const char* name;
+	int (*apply)(struct pfs_handle_op* op, int fd);
+	struct pfs_handle* h;
+	int first;
+	const char* buf;
+	size_t size;
+	off_t offset;
+	int datasync;
+	int uringOp;		// URING_NONE to always go through apply
+};
+
+static int pfs_handle_task(int i, void* arg){
+	struct pfs_handle_op* op = arg;
+	int k = i + op->first;
+	int fd = k == 0 ? op->h->fd : op->h->replicaFds[k-1];
+	if(k > 0 && pfs_drive_down(op->h->replicaDrives[k-1])){
+		hintAdd(op->h->replicaDrives[k-1], op->h->path, NULL);
+		errno = EIO;
+		return -EIO;
+	}
+	long long start = healthStart();
+	int res = op->apply(op, fd);
+	int err = res < 0 ? errno : 0;
+	if(k > 0){
+		healthReport(op->h->replicaDrives[k-1], start, err);
+	}
+	if(res < 0){
+		errno = err;
+		if(k > 0){
+			log_msg("ERROR: %s on backup/%d\n",op->name,op->h->replicaDrives[k-1]);
+			aeSuspect(op->h->replicaDrives[k-1], op->h->path);
+			hintAdd(op->h->replicaDrives[k-1], op->h->path, NULL);
+		}
+		res = pfs_error(op->name);
+	}
+	return res;
+}
+
+//  Same as running pfs_handle_task for every fd, but as one io_uring
+//  batch: one syscall submits them all and reaps every completion.
+//  Returns -1 if the ring can't be used.
+static int pfs_handle_uring(struct pfs_handle_op* op, int n, int* results){
+	struct uring_io ios[n];
+	for(int i = 0; i < n; i++){
+		int k = i + op->first;
+		ios[i].op = op->uringOp;
+		ios[i].fd = k == 0 ? op->h->fd : op->h->replicaFds[k-1];
+		ios[i].buf = (void*) op->buf;
+		ios[i].len = op->size;
+		ios[i].offset = op->offset;
+	}
+	//fall back to the pool, which skips the drives that are down
+	for(int i = 0; i < n; i++){
+		int k = i + op->first;
+		if(k > 0 && pfs_drive_down(op->h->replicaDrives[k-1])){
+			return -1;
+		}
+	}
+	long long start = healthStart();
+	if(uringSubmit(ios, n) < 0){
+		return -1;
+	}
+	for(int i = 0; i < n; i++){
+		int k = i + op->first;
+		results[i] = ios[i].result;
+		if(k > 0){
+			healthReport(op->h->replicaDrives[k-1], start, results[i] < 0 ? -results[i] : 0);
+		}
+		if(results[i] < 0){
+			if(k > 0){
+				log_msg("ERROR: %s on backup/%d\n",op->name,op->h->replicaDrives[k-1]);
+				aeSuspect(op->h->replicaDrives[k-1], op->h->path);
+				hintAdd(op->h->replicaDrives[k-1], op->h->path, NULL);
+			}
+			errno = -results[i];
+			pfs_error(op->name);
+		}
+	}
+	return 0;
+}
+
+//  Returns the result of the first call (the master's, unless skipped)
+//  and counts the calls that succeeded in *acked, if given
+static int pfs_handle_run(struct pfs_handle_op* op, int* acked){
+	int n = 1 + op->h->numReplicas - op->first;
+	if(acked != NULL){
+		*acked = 0;
+	}
+	if(n <= 0){
+		return 0;
+	}
+	int results[n];
+	if(op->uringOp == URING_NONE || pfs_handle_uring(op, n, results) < 0){
+		poolRun(n, pfs_handle_task, op, results);
+	}
+	for(int i = 0; acked != NULL && i < n; i++){
+		if(results[i] >= 0) (*acked)++;
+	}
+	return results[0];
+}
+
+static int pfs_handle_master(struct pfs_handle_op* op){
+	int retstat;
+	if(op->uringOp == URING_NONE || pfs_handle_uring(op, 1, &retstat) < 0){
+		retstat = pfs_handle_task(0, op);
+	}
+	return retstat;
+}
+
+//  Run op on the master and replicas.  With write-behind on, only the
+//  master is done now and the replicas get a queued copy of the update,
+//  provided the master took it.
+static int pfs_handle_update(struct pfs_handle_op* op, int kind){
+	if(op->h->queue == NULL){
+		int acked;
+		int retstat = pfs_handle_run(op, &acked);
+		return pfs_quorum(retstat, acked - 1);
+	}
+	int retstat = pfs_handle_master(op);
+	if(retstat >= 0){
+		wbSubmit(op->h->queue, kind, op->buf, kind == PFS_WB_WRITE ? (size_t) retstat : 0, op->offset);
+	}
+	return retstat;
+}
+
+static int pfs_write_fd(struct pfs_handle_op* op, int fd){
+	return pwrite(fd, op->buf, op->size, op->offset);
+}
+
+//  Send size bytes at offset to the replicas only
+static void pfs_replica_write(struct pfs_handle* h, const char* buf, size_t size, off_t offset){
+	if(h->queue != NULL){
+		wbSubmit(h->queue, PFS_WB_WRITE, buf, size, offset);
+		return;
+	}
+	struct pfs_handle_op op = { .name = "pfs_write pwrite", .apply = pfs_write_fd,
+		.h = h, .first = 1, .buf = buf, .size = size, .offset = offset, .uringOp = URING_WRITE };
+	pfs_handle_run(&op, NULL);
+}
+
+//  Push out whatever h has buffered.  Caller holds c->lock.
+static void pfs_coalesce_flush_locked(struct pfs_handle* h){
+	struct pfs_coalesce* c = h->coalesce;
+	if(c->len > 0){
+		pfs_replica_write(h, c->buf, c->len, c->offset);
+		c->len = 0;
+	}
+}
+
+static void pfs_coalesce_flush(struct pfs_handle* h){
+	if(h->coalesce != NULL){
+		pthread_mutex_lock(&h->coalesce->lock);
+		pfs_coalesce_flush_locked(h);
+		pthread_mutex_unlock(&h->coalesce->lock);
+	}
+}
+
+//  Write to the master now and buffer the replica copy, merged with the
+//  extent already buffered when it carries straight on from it
+static int pfs_coalesce_write(struct pfs_handle_op* op){
+	struct pfs_handle* h = op->h;
+	struct pfs_coalesce* c = h->coalesce;
+	int retstat = pfs_handle_master(op);
+	if(retstat <= 0){
+		return retstat;
+	}
+	size_t size = retstat;
+	
+	pthread_mutex_lock(&c->lock);
+	if(c->len > 0 && (op->offset != c->offset + (off_t) c->len || c->len + size > c->cap)){
+		pfs_coalesce_flush_locked(h);
+	}
+	if(size >= c->cap){
+		//nothing to gain from copying it
+		pfs_replica_write(h, op->buf, size, op->offset);
+	}
+	else{
+		if(c->len == 0){
+			c->offset = op->offset;
+		}
+		memcpy(c->buf + c->len, op->buf, size);
+		c->len += size;
+		if(c->len == c->cap){
+			pfs_coalesce_flush_locked(h);
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+	return retstat;
+}
+
+//  wb_done callback too: the replicas of a write-behind handle are only
+//  closed once its queue has drained
+static void pfs_handle_close_replicas(void* owner){
+	struct pfs_handle* h = owner;
+	for(int i = 0; i < h->numReplicas; i++){
+		uringForget(h->replicaFds[i]);
+		if(close(h->replicaFds[i]) < 0){
+			log_msg("ERROR: pfs_release on backup/%d\n",h->replicaDrives[i]);
+			pfs_error("pfs_release replica close");
+		}
+	}
+	free(h->replicaFds);
+	free(h->replicaDrives);
+	free(h->hintedDrives);
+	free(h->path);
+	if(h->coalesce != NULL){
+		pthread_mutex_destroy(&h->coalesce->lock);
+		free(h->coalesce->buf);
+		free(h->coalesce);
+	}
+	free(h);
+}
+
+static int pfs_handle_close(struct pfs_handle* h){
+	uringForget(h->fd);
+	int retstat = close(h->fd);
+	//the drives this handle never reached are owed the finished file
+	for(int i = 0; i < h->numHinted; i++){
+		hintAdd(h->hintedDrives[i], h->path, NULL);
+	}
+	if(h->queue != NULL){
+		wbClose(h->queue, pfs_handle_close_replicas);
+	}
+	else{
+		pfs_handle_close_replicas(h);
+	}
+	return retstat;
+}
+
+//  h writes path: its row in the index is refreshed now and ignored by
+//  lookups until the handle is released
+static void pfs_index_writer(struct pfs_handle* h, const char* path){
+	if(!indexEnabled()){
+		return;
+	}
+	pfs_index_refresh(path);
+	if(indexWriters(path, 1) == 0){
+		h->writer = 1;
+	}
+}
+
+//  Record the content hash of the master copy of path
+static void pfs_index_hash(const char* path){
+	char fpath[PATH_MAX];
+	char hash[INDEX_HASH_LEN];
+	pfs_fullpath(fpath, path);
+	int fd = open(fpath, O_RDONLY);
+	if(fd < 0 || indexHashFile(fd, hash) < 0){
+		pfs_error("pfs_release hash");
+	}
+	else{
+		indexSetHash(path, hash);
+	}
+	if(fd >= 0){
+		close(fd);
+	}
+}
+
 static int pfs_getattr(const char *path, struct stat *stbuf)
 {
 	log_msg("Entered pfs_getattr\n");
 	int retstat = 0;
+	unsigned long gen;
+	int cached = attrCacheGet(path, stbuf, &gen);
+	if(cached >= 0){
+		return cached ? 0 : -ENOENT;
+	}
 	char fpath[PATH_MAX];
-	pfs_fullpath(fpath,path);
-	retstat = lstat(fpath,stbuf);
-	if(retstat != 0){
-		retstat = pfs_error("pfs_getattr lstat");
+	char (*fpaths)[PATH_MAX] = NULL;
+	int n = PRI_DATA->master == 1 ? PRI_DATA->copies : 1;
+	int consulted = 0;
+	pfs_fullpath(fpath, path);
+	
+	//newest of the first R copies that answer; a master copy on a failing
+	//disk fails over to the replicas
+	for(int i = 0; i < n && consulted < PRI_DATA->readQuorum; i++){
+		struct stat st;
+		//where the replicas are is only worked out once one is needed
+		if(i == 1 && fpaths == NULL){
+			pfs_copies(path, &fpaths);
+		}
+		//the index stands in for the master copy
+		int indexed = i == 0 ? indexLookup(path, &st) : -1;
+		if(indexed == 0){
+			//and knows path isn't there, without asking any disk
+			retstat = -ENOENT;
+			break;
+		}
+		if(indexed < 0 && lstat(i == 0 ? fpath : fpaths[i],&st) != 0){
+			if(i == 0 && errno == ENOENT){
+				//the master's word on whether path exists is final
+				retstat = -ENOENT;
+				break;
+			}
+			if(i == 0){
+				retstat = pfs_error("pfs_getattr lstat");
+				if(!pfs_failover_error(-retstat)){
+					break;
+				}
+			}
+			continue;
+		}
+		if(consulted == 0 || st.st_mtime > stbuf->st_mtime){
+			*stbuf = st;
+		}
+		consulted++;
+	}
+	if(consulted > 0){
+		retstat = 0;
+		attrCachePut(path, stbuf, gen);
+	}
+	else if(retstat == -ENOENT){
+		attrCachePut(path, NULL, gen);
 	}
+	free(fpaths);
 	return retstat;
 }
 
@@ -124,10 +1145,20 @@ int pfs_mknod(const char* path, mode_t mode, dev_t dev){
 			retstat = pfs_error("pfs_mknod mknod");
 		}
 	}
+	if(retstat >= 0){
+		pfs_index_refresh(path);
+	}
+	pfs_attr_changed(path, 1);
 	
 	return retstat;
 }
 
+static int pfs_mkdir_replica(struct pfs_replica_op* op, const char* fpath2, const char* unused){
+	return mkdir(fpath2, op->mode);
+}
+
+static int pfs_rmdir_replica(struct pfs_replica_op* op, const char* fpath2, const char* unused);
+
 int pfs_mkdir(const char* path, mode_t mode){
 	log_msg("Entered pfs_mkdir\n");
 	int retstat = 0;
@@ -135,51 +1166,49 @@ int pfs_mkdir(const char* path, mode_t mode){
 	log_msg("Making dir: %s\n",path);
 	pfs_fullpath(fpath, path);
 	retstat = mkdir(fpath,mode);	
+	if(retstat < 0){
+		retstat = pfs_error("pfs_mkdir mkdir");
+	}
+	else{
+		pfs_index_refresh(path);
+	}
 	
 	//backup
-	if(PRI_DATA->master == 1){
-		int startDrive = mapNameToDrives(path);
-		int drivesWrittenTo = 0;
-		while(drivesWrittenTo < (PRI_DATA->numMounts - 2)){
-			log_msg("Drives Written To:%d\nTrying to write to backup:%d\n",drivesWrittenTo,startDrive);
-			char fpath2[PATH_MAX];
-			char* drive = calloc(1,sizeof(char));
-			sprintf(drive,"%d",startDrive);
-			strcpy(fpath2,PRI_DATA->backup);
-			strncat(fpath2,"/",1);
-			strncat(fpath2,drive,strlen(drive));
-			strncat(fpath2,path,strlen(path));
-			log_msg("Writing to %s\n",fpath2);
-			int res2 = mkdir(fpath2,mode);
-			if(res2 < 0){
-				log_msg("ERROR: pfs_mkdir on backup/%s",drive);
-				pfs_error("pfs_mkdir");
-			}
-			else{
-				log_msg("Successful write to:%s\n",fpath2);
-				drivesWrittenTo++;
-			}
-			
-			startDrive = (startDrive+1) % PRI_DATA->numMounts;
-			log_msg("fpath2:%s\n",fpath2);
+	struct pfs_replica_op op = { .name = "pfs_mkdir", .apply = pfs_mkdir_replica, .mode = mode };
+	int made = retstat == 0;
+	retstat = pfs_quorum(retstat, pfs_replicate(&op, path, NULL));
+	if(made && retstat < 0){
+		//too few copies took it, so there's no directory after all
+		pfs_replicate_undo(&op, pfs_rmdir_replica);
+		if(rmdir(fpath) < 0){
+			pfs_error("pfs_mkdir undo rmdir");
 		}
-		
-	}	
-	if(retstat < 0){
-		retstat = pfs_error("pfs_mkdir mkdir");
+		pfs_index_refresh(path);
 	}
+	pfs_replicate_done(&op);
+	pfs_attr_changed(path, 1);
 	
 	return retstat;
 }
 
+static int pfs_unlink_replica(struct pfs_replica_op* op, const char* fpath2, const char* unused){
+	return unlink(fpath2);
+}
+
 static int pfs_unlink(const char* path){
 	log_msg("Entered pfs_unlink\n");
 	int retstat = 0;
 	char fpath[PATH_MAX];
 	
 	pfs_fullpath(fpath,path);
+	struct pfs_dedup_ref ref;
+	pfs_dedup_ref(path, &ref, NULL);
 	
 	retstat = unlink(fpath);
+	if(retstat < 0){
+		retstat = pfs_error("pfs_unlink unlink");
+	}
+	int removed = retstat == 0;
 	//backup
 	if(PRI_DATA->master == 1){
 		log_msg("Deleting image %s from database\n",fpath);
@@ -188,40 +1217,24 @@ static int pfs_unlink(const char* path){
 			log_msg("ERROR IN PUSHING TO DATABASE - deleteImage\n");
 		}
 		log_msg("Done deleting image %s from database\n",fpath);
-		int startDrive = mapNameToDrives(path);
-		int drivesWrittenTo = 0;
-		while(drivesWrittenTo < (PRI_DATA->numMounts - 2)){
-			log_msg("Drives Written To:%d\nTrying to write to backup:%d\n",drivesWrittenTo,startDrive);
-			char fpath2[PATH_MAX];
-			char* drive = calloc(1,sizeof(char));
-			sprintf(drive,"%d",startDrive);
-			strcpy(fpath2,PRI_DATA->backup);
-			strncat(fpath2,"/",1);
-			strncat(fpath2,drive,strlen(drive));
-			strncat(fpath2,path,strlen(path));
-			log_msg("Writing to %s\n",fpath2);
-			int res2 = unlink(fpath2);
-			if(res2 < 0){
-				log_msg("ERROR: pfs_unlink on backup/%s",drive);
-				pfs_error("pfs_unlink");
-			}
-			else{
-				log_msg("Successful write to:%s\n",fpath2);
-				drivesWrittenTo++;
-			}
-			
-			startDrive = (startDrive+1) % PRI_DATA->numMounts;
-			log_msg("fpath2:%s\n",fpath2);
-		}
-		
 	}
-	if(retstat < 0){
-		retstat = pfs_error("pfs_unlink unlink");
+	struct pfs_replica_op op = { .name = "pfs_unlink", .apply = pfs_unlink_replica };
+	retstat = pfs_quorum(retstat, pfs_replicate(&op, path, NULL));
+	pfs_replicate_done(&op);
+	//only now, as the replicas were found through it
+	if(indexEnabled() && removed){
+		indexRemove(path);
 	}
+	pfs_dedup_unref(&ref, path, NULL, 0);
+	pfs_attr_changed(path, 1);
 	
 	return retstat;
 }
 
+static int pfs_rmdir_replica(struct pfs_replica_op* op, const char* fpath2, const char* unused){
+	return rmdir(fpath2);
+}
+
 static int pfs_rmdir(const char* path){
 	log_msg("Entered pfs_rmdir\n");
 	int retstat = 0;
@@ -230,38 +1243,18 @@ static int pfs_rmdir(const char* path){
 	pfs_fullpath(fpath, path);
 	
 	retstat = rmdir(fpath);
-	//backup
-	if(PRI_DATA->master == 1){
-		int startDrive = mapNameToDrives(path);
-		int drivesWrittenTo = 0;
-		while(drivesWrittenTo < (PRI_DATA->numMounts - 2)){
-			log_msg("Drives Written To:%d\nTrying to write to backup:%d\n",drivesWrittenTo,startDrive);
-			char fpath2[PATH_MAX];
-			char* drive = calloc(1,sizeof(char));
-			sprintf(drive,"%d",startDrive);
-			strcpy(fpath2,PRI_DATA->backup);
-			strncat(fpath2,"/",1);
-			strncat(fpath2,drive,strlen(drive));
-			strncat(fpath2,path,strlen(path));
-			log_msg("Writing to %s\n",fpath2);
-			int res2 = rmdir(fpath2);
-			if(res2 < 0){
-				log_msg("ERROR: pfs_rmdir on backup/%s",drive);
-				pfs_error("pfs_rmdir");
-			}
-			else{
-				log_msg("Successful write to:%s\n",fpath2);
-				drivesWrittenTo++;
-			}
-			
-			startDrive = (startDrive+1) % PRI_DATA->numMounts;
-			log_msg("fpath2:%s\n",fpath2);
-		}
-		
-	}
 	if(retstat < 0){
 		retstat = pfs_error("pfs_rmdir rmdir");
 	}
+	int removed = retstat == 0;
+	//backup
+	struct pfs_replica_op op = { .name = "pfs_rmdir", .apply = pfs_rmdir_replica };
+	retstat = pfs_quorum(retstat, pfs_replicate(&op, path, NULL));
+	pfs_replicate_done(&op);
+	if(indexEnabled() && removed){
+		indexRemove(path);
+	}
+	pfs_attr_changed(path, 1);
 	
 	return retstat;
 }
@@ -278,9 +1271,21 @@ static int pfs_symlink(const char *path, const char *link)
     if (retstat < 0){
 		retstat = pfs_error("pfs_symlink symlink");
 	}
+	else{
+		pfs_index_refresh(link);
+	}
+    pfs_attr_changed(link, 1);
     return retstat;
 }
 
+static int pfs_rename_replica(struct pfs_replica_op* op, const char* fpath2, const char* fnewpath2){
+	return rename(fpath2, fnewpath2);
+}
+
+static int pfs_rename_back(struct pfs_replica_op* op, const char* fpath2, const char* fnewpath2){
+	return rename(fnewpath2, fpath2);
+}
+
 static int pfs_rename(const char* path, const char* newpath){
 	log_msg("Entered pfs_rename\n");
 	int retstat = 0;
@@ -289,8 +1294,23 @@ static int pfs_rename(const char* path, const char* newpath){
 	
 	pfs_fullpath(fpath,path);
 	pfs_fullpath(fnewpath, newpath);
+	//whatever newpath held is replaced
+	struct pfs_dedup_ref ref;
+	pfs_dedup_ref(newpath, &ref, NULL);
 	
 	retstat = rename(fpath, fnewpath);
+	if(retstat < 0){
+		retstat = pfs_error("pfs_rename rename");
+	}
+	int renamed = retstat == 0;
+	struct stat st;
+	int dir = renamed && lstat(fnewpath, &st) == 0 && S_ISDIR(st.st_mode);
+	if(dir){
+		//every path under it has changed
+		attrCacheClear();
+	}
+	pfs_attr_changed(path, 1);
+	pfs_attr_changed(newpath, 1);
 	//backup
 	if(PRI_DATA->master == 1){
 		//update database
@@ -300,43 +1320,41 @@ static int pfs_rename(const char* path, const char* newpath){
 			log_msg("ERROR IN PUSHING TO DATABASE - updatePath\n");
 		}
 		log_msg("Done updating path\n");
-		int startDrive = mapNameToDrives(path);
-		int drivesWrittenTo = 0;
-		while(drivesWrittenTo < (PRI_DATA->numMounts - 2)){
-			log_msg("Drives Written To:%d\nTrying to write to backup:%d\n",drivesWrittenTo,startDrive);
-			char fpath2[PATH_MAX];
-			char fnewpath2[PATH_MAX];
-			char* drive = calloc(1,sizeof(char));
-			sprintf(drive,"%d",startDrive);
-			//old path
-			strcpy(fpath2,PRI_DATA->backup);
-			strncat(fpath2,"/",1);
-			strncat(fpath2,drive,strlen(drive));
-			strncat(fpath2,path,strlen(path));
-			//new path
-			strcpy(fnewpath2,PRI_DATA->backup);
-			strncat(fnewpath2,"/",1);
-			strncat(fnewpath2,drive,strlen(drive));
-			strncat(fnewpath2,newpath,strlen(newpath));
-						
-			log_msg("Writing %s\n to %s\n",fnewpath2,fpath2);
-			int res2 = rename(fpath2,fnewpath2);
-			if(res2 < 0){
-				log_msg("ERROR: pfs_rename on backup/%s\n",drive);
-				pfs_error("pfs_rename");
-			}
-			else{
-				log_msg("Successful write to:%s\n",fpath2);
-				drivesWrittenTo++;
+	}
+	struct pfs_replica_op op = { .name = "pfs_rename", .apply = pfs_rename_replica };
+	retstat = pfs_quorum(retstat, pfs_replicate(&op, path, newpath));
+	if(renamed && retstat < 0){
+		//too few copies took it: everything goes back under path.  What
+		//newpath held is gone either way.
+		pfs_replicate_undo(&op, pfs_rename_back);
+		if(rename(fnewpath, fpath) < 0){
+			pfs_error("pfs_rename undo rename");
+		}
+		else{
+			renamed = 0;
+			if(PRI_DATA->master == 1 && updatePath(fpath, fnewpath) == 0){
+				log_msg("ERROR IN PUSHING TO DATABASE - updatePath\n");
 			}
-			
-			startDrive = (startDrive+1) % PRI_DATA->numMounts;
-			log_msg("fpath2:%s\nfnewpath2:%s\n",fpath2,fnewpath2);
 		}
-		
+		//drives that missed the rename were hinted to make it; they need
+		//path back as well
+		for(int i = 0; i < op.wanted && i < op.numDrives; i++){
+			if(op.results[i] < 0) hintAdd(op.drives[i], path, NULL);
+		}
+		attrCacheClear();
 	}
-	if(retstat < 0){
-		retstat = pfs_error("pfs_rename rename");
+	int moved[op.numDrives + 1];
+	int n = 0;
+	for(int i = 0; i < op.numDrives; i++){
+		if(op.results[i] >= 0) moved[n++] = op.drives[i];
+	}
+	pfs_replicate_done(&op);
+	if(indexEnabled() && renamed){
+		indexRename(path, newpath);
+	}
+	pfs_dedup_unref(&ref, newpath, moved, n);
+	if(dir){
+		pfs_ae_moved(path, newpath);
 	}
 	
 	return retstat;
@@ -354,10 +1372,45 @@ static int pfs_link(const char* path, const char* newpath){
 	if(retstat < 0){
 		retstat = pfs_error("pfs_link link");
 	}
+	else{
+		//both names now have one more link
+		pfs_index_refresh(path);
+		pfs_index_refresh(newpath);
+	}
+	pfs_attr_changed(path, 0);
+	pfs_attr_changed(newpath, 1);
 	
 	return retstat;
 }
 
+//  Dedup mode: a chmod or chown of a regular file changes its object key,
+//  so its replicas are relinked to the objects for the new one.  If too
+//  few take it, old goes back on the master and the replicas follow it.
+static int pfs_dedup_meta(const char* path, int retstat, const struct stat* old){
+	char fpath[PATH_MAX];
+	struct stat cur;
+	if(retstat < 0 || PRI_DATA->master != 1){
+		return retstat;
+	}
+	pfs_fullpath(fpath, path);
+	if(lstat(fpath, &cur) < 0){
+		return pfs_error("pfs_dedup lstat");
+	}
+	retstat = pfs_quorum(retstat, pfs_dedup_replicas(path, old));
+	if(retstat < 0){
+		if(chmod(fpath, old->st_mode & 07777) < 0 || lchown(fpath, old->st_uid, old->st_gid) < 0){
+			pfs_error("pfs_dedup undo");
+		}
+		pfs_dedup_replicas(path, &cur);
+		pfs_index_refresh(path);
+	}
+	return retstat;
+}
+
+static int pfs_chmod_replica(struct pfs_replica_op* op, const char* fpath2, const char* unused){
+	return chmod(fpath2, op->mode);
+}
+
 /** Change the permission bits of a file */
 static int pfs_chmod(const char *path, mode_t mode)
 {
@@ -366,86 +1419,86 @@ static int pfs_chmod(const char *path, mode_t mode)
     char fpath[PATH_MAX];
     
     pfs_fullpath(fpath,path);
-    retstat = chmod(path, mode);
- 	//backup
-	if(PRI_DATA->master == 1){
-		int startDrive = mapNameToDrives(path);
-		int drivesWrittenTo = 0;
-		while(drivesWrittenTo < (PRI_DATA->numMounts - 2)){
-			log_msg("Drives Written To:%d\nTrying to write to backup:%d\n",drivesWrittenTo,startDrive);
-			char fpath2[PATH_MAX];
-			char* drive = calloc(1,sizeof(char));
-			sprintf(drive,"%d",startDrive);
-			strcpy(fpath2,PRI_DATA->backup);
-			strncat(fpath2,"/",1);
-			strncat(fpath2,drive,strlen(drive));
-			strncat(fpath2,path,strlen(path));
-			log_msg("Writing to %s\n",fpath2);
-			int res2 = chmod(fpath2,mode);
-			if(res2 < 0){
-				log_msg("ERROR: pfs_chmod on backup/%s\n",drive);
-				pfs_error("pfs_chmod");
-			}
-			else{
-				log_msg("Successful write to:%s\n",fpath2);
-				drivesWrittenTo++;
-			}
-			
-			startDrive = (startDrive+1) % PRI_DATA->numMounts;
-			log_msg("fpath2:%s\n",fpath2);
-		}
-		
-	}   
+    //what to put back if too few copies take the change
+    struct stat old;
+    int had = lstat(fpath, &old) == 0;
+    retstat = chmod(fpath, mode);
     if (retstat < 0)
 	retstat = pfs_error("pfs_chmod chmod");
+    else
+	pfs_index_refresh(path);
+    int changed = retstat == 0;
+    
+    //backup
+    if (had && pfs_dedup_file(&old)) {
+	retstat = pfs_dedup_meta(path, retstat, &old);
+	pfs_attr_changed(path, 0);
+	return retstat;
+    }
+    struct pfs_replica_op op = { .name = "pfs_chmod", .apply = pfs_chmod_replica, .mode = mode };
+    retstat = pfs_quorum(retstat, pfs_replicate(&op, path, NULL));
+    if (changed && had && retstat < 0) {
+	op.mode = old.st_mode;
+	pfs_replicate_undo(&op, pfs_chmod_replica);
+	if (chmod(fpath, old.st_mode) < 0)
+	    pfs_error("pfs_chmod undo chmod");
+	pfs_index_refresh(path);
+    }
+    pfs_replicate_done(&op);
+    pfs_attr_changed(path, 0);
     
     return retstat;
 }
 
+static int pfs_chown_replica(struct pfs_replica_op* op, const char* fpath2, const char* unused){
+	return chown(fpath2, op->uid, op->gid);
+}
+
 static int pfs_chown(const char* path, uid_t uid, gid_t gid){
 	log_msg("Entered pfs_chown\n");
 	int retstat = 0;
 	char fpath[PATH_MAX];
 	
 	pfs_fullpath(fpath,path);
+	//what to put back if too few copies take the change
+	struct stat old;
+	int had = lstat(fpath, &old) == 0;
 	
-	retstat = chown(fpath, uid, gid);
-	//backup
-	if(PRI_DATA->master == 1){
-		int startDrive = mapNameToDrives(path);
-		int drivesWrittenTo = 0;
-		while(drivesWrittenTo < (PRI_DATA->numMounts - 2)){
-			log_msg("Drives Written To:%d\nTrying to write to backup:%d\n",drivesWrittenTo,startDrive);
-			char fpath2[PATH_MAX];
-			char* drive = calloc(1,sizeof(char));
-			sprintf(drive,"%d",startDrive);
-			strcpy(fpath2,PRI_DATA->backup);
-			strncat(fpath2,"/",1);
-			strncat(fpath2,drive,strlen(drive));
-			strncat(fpath2,path,strlen(path));
-			log_msg("Writing to %s\n",fpath2);
-			int res2 = chown(fpath2, uid, gid);
-			if(res2 < 0){
-				log_msg("ERROR: pfs_chown on backup/%s\n",drive);
-				pfs_error("pfs_chown");
-			}
-			else{
-				log_msg("Successful write to:%s\n",fpath2);
-				drivesWrittenTo++;
-			}
-			
-			startDrive = (startDrive+1) % PRI_DATA->numMounts;
-			log_msg("fpath2:%s\n",fpath2);
-		}
-		
-	}
+	retstat = chown(fpath, uid, gid);
 	if(retstat < 0){
 		retstat = pfs_error("pfs_chown chown");
 	}
+	else{
+		pfs_index_refresh(path);
+	}
+	int changed = retstat == 0;
+	//backup
+	if(had && pfs_dedup_file(&old)){
+		retstat = pfs_dedup_meta(path, retstat, &old);
+		pfs_attr_changed(path, 0);
+		return retstat;
+	}
+	struct pfs_replica_op op = { .name = "pfs_chown", .apply = pfs_chown_replica, .uid = uid, .gid = gid };
+	retstat = pfs_quorum(retstat, pfs_replicate(&op, path, NULL));
+	if(changed && had && retstat < 0){
+		op.uid = old.st_uid;
+		op.gid = old.st_gid;
+		pfs_replicate_undo(&op, pfs_chown_replica);
+		if(chown(fpath, old.st_uid, old.st_gid) < 0){
+			pfs_error("pfs_chown undo chown");
+		}
+		pfs_index_refresh(path);
+	}
+	pfs_replicate_done(&op);
+	pfs_attr_changed(path, 0);
 	
 	return retstat;
 }
 
+static int pfs_truncate_replica(struct pfs_replica_op* op, const char* fpath2, const char* unused){
+	return truncate(fpath2, op->size);
+}
+
 static int pfs_truncate(const char* path, off_t newsize){
 	log_msg("Entered pfs_truncate\n");
 	int retstat = 0;
@@ -454,76 +1507,66 @@ static int pfs_truncate(const char* path, off_t newsize){
 	pfs_fullpath(fpath, path);
 	
 	retstat = truncate(fpath, newsize);
+	if(retstat < 0) retstat = pfs_error("pfs_truncate truncate");
+	else pfs_index_refresh(path);
+	pfs_attr_changed(path, 0);
 	//backup
-	if(PRI_DATA->master == 1){
-		int startDrive = mapNameToDrives(path);
-		int drivesWrittenTo = 0;
-		while(drivesWrittenTo < (PRI_DATA->numMounts - 2)){
-			log_msg("Drives Written To:%d\nTrying to write to backup:%d\n",drivesWrittenTo,startDrive);
-			char fpath2[PATH_MAX];
-			char* drive = calloc(1,sizeof(char));
-			sprintf(drive,"%d",startDrive);
-			strcpy(fpath2,PRI_DATA->backup);
-			strncat(fpath2,"/",1);
-			strncat(fpath2,drive,strlen(drive));
-			strncat(fpath2,path,strlen(path));
-			log_msg("Writing to %s\n",fpath2);
-			int res2 = truncate(fpath2, newsize);
-			if(res2 < 0){
-				log_msg("ERROR: pfs_truncate on backup/%s\n",drive);
-			}
-			else{
-				log_msg("Successful write to:%s\n",fpath2);
-			}
-			drivesWrittenTo++;
-			startDrive = (startDrive+1) % PRI_DATA->numMounts;
-			log_msg("fpath2:%s\n",fpath2);
+	if(PRI_DATA->writeMode == PFS_WRITE_DEDUP){
+		//the replicas are shared objects; relink them rather than cut one short
+		if(retstat >= 0 && PRI_DATA->master == 1){
+			retstat = pfs_quorum(retstat, pfs_dedup_replicas(path, NULL));
 		}
-		
+		return retstat;
 	}
-	if(retstat < 0) retstat = pfs_error("pfs_truncate truncate");
+	if(PRI_DATA->writeMode == PFS_WRITE_CHUNK){
+		if(retstat >= 0 && PRI_DATA->master == 1){
+			retstat = pfs_quorum(retstat, pfs_chunk_replicas(path));
+		}
+		return retstat;
+	}
+	struct pfs_replica_op op = { .name = "pfs_truncate", .apply = pfs_truncate_replica, .size = newsize };
+	retstat = pfs_quorum(retstat, pfs_replicate(&op, path, NULL));
+	pfs_replicate_done(&op);
 	
 	return retstat;
 }
 
+static int pfs_utime_replica(struct pfs_replica_op* op, const char* fpath2, const char* unused){
+	return utime(fpath2, op->ubuf);
+}
+
 static int pfs_utime(const char* path, struct utimbuf *ubuf){
 	log_msg("Entered pfs_utime\n");
 	int retstat;
 	char fpath[PATH_MAX];
 	
 	pfs_fullpath(fpath,path);
+	//what to put back if too few copies take the change
+	struct stat old;
+	int had = lstat(fpath, &old) == 0;
 	
 	retstat = utime(fpath,ubuf);
-	//backup
-	if(PRI_DATA->master == 1){
-		int startDrive = mapNameToDrives(path);
-		int drivesWrittenTo = 0;
-		while(drivesWrittenTo < (PRI_DATA->numMounts - 2)){
-			log_msg("Drives Written To:%d\nTrying to write to backup:%d\n",drivesWrittenTo,startDrive);
-			char fpath2[PATH_MAX];
-			char* drive = calloc(1,sizeof(char));
-			sprintf(drive,"%d",startDrive);
-			strcpy(fpath2,PRI_DATA->backup);
-			strncat(fpath2,"/",1);
-			strncat(fpath2,drive,strlen(drive));
-			strncat(fpath2,path,strlen(path));
-			log_msg("Writing to %s\n",fpath2);
-			int res2 = utime(fpath2,ubuf);
-			if(res2 < 0){
-				log_msg("ERROR: pfs_utime on backup/%s\n",drive);
-				pfs_error("pfs_utime");
-			}
-			else{
-				log_msg("Successful write to:%s\n",fpath2);
-				drivesWrittenTo++;
-			}
-			
-			startDrive = (startDrive+1) % PRI_DATA->numMounts;
-			log_msg("fpath2:%s\n",fpath2);
+	if(retstat < 0) retstat = pfs_error("pfs_utime utime");
+	else pfs_index_refresh(path);
+	int changed = retstat == 0;
+	//backup; shared objects keep their own times, the master copy has the path's
+	if(had && pfs_dedup_file(&old)){
+		pfs_attr_changed(path, 0);
+		return retstat;
+	}
+	struct pfs_replica_op op = { .name = "pfs_utime", .apply = pfs_utime_replica, .ubuf = ubuf };
+	retstat = pfs_quorum(retstat, pfs_replicate(&op, path, NULL));
+	if(changed && had && retstat < 0){
+		struct utimbuf oldbuf = { .actime = old.st_atime, .modtime = old.st_mtime };
+		op.ubuf = &oldbuf;
+		pfs_replicate_undo(&op, pfs_utime_replica);
+		if(utime(fpath, &oldbuf) < 0){
+			pfs_error("pfs_utime undo utime");
 		}
-		
+		pfs_index_refresh(path);
 	}
-	if(retstat < 0) retstat = pfs_error("pfs_utime utime");
+	pfs_replicate_done(&op);
+	pfs_attr_changed(path, 0);
 	
 	return retstat;
 }
@@ -540,64 +1583,103 @@ static int pfs_open(const char *path, struct fuse_file_info *fi)
 	fd = open(fpath, fi->flags);
 	if(fd < 0){
 		retstat = pfs_error("pfs_open open");
+		//reads can still be served from a replica
+		if((fi->flags & O_ACCMODE) == O_RDONLY && pfs_failover_error(-retstat)){
+			char (*fpaths)[PATH_MAX];
+			int n = pfs_copies(path, &fpaths);
+			for(int i = 1; i < n && fd < 0; i++){
+				fd = open(fpaths[i], fi->flags);
+				if(fd >= 0){
+					log_msg("pfs_open failed over to %s\n",fpaths[i]);
+				}
+			}
+			free(fpaths);
+		}
+		if(fd < 0){
+			return retstat;
+		}
+		retstat = 0;
 	}
 	
-	fi->fh = fd;
+	struct pfs_handle* h = pfs_handle_new(fd);
+	pfs_open_replicas(h, path, fi->flags & ~(O_CREAT | O_EXCL), 0);
+	if((fi->flags & O_ACCMODE) != O_RDONLY){
+		pfs_index_writer(h, path);
+	}
+	fi->fh = (uintptr_t) h;
 	
 	return retstat;
 }
 
+//  Read from h's own fd, the master copy unless open failed over
+static int pfs_read_handle(struct pfs_handle* h, char* buf, size_t size, off_t offset){
+	int retstat;
+	struct uring_io io = { .op = URING_READ, .fd = h->fd, .buf = buf,
+		.len = size, .offset = offset };
+	if(uringSubmit(&io, 1) == 0){
+		retstat = io.result;
+		if(retstat < 0) errno = -retstat;
+	}
+	else{
+		retstat = pread(h->fd, buf, size, offset);
+	}
+	if(retstat < 0){
+		retstat = pfs_error("pfs_read read");
+	}
+	return retstat;
+}
+
+//  Read path from the first replica that will serve it
+static int pfs_read_replicas(const char* path, char* buf, size_t size, off_t offset, int retstat){
+	char (*fpaths)[PATH_MAX];
+	int n = pfs_copies(path, &fpaths);
+	for(int i = 1; i < n && retstat < 0; i++){
+		int fd2 = open(fpaths[i], O_RDONLY);
+		if(fd2 < 0){
+			continue;
+		}
+		int res2 = pread(fd2, buf, size, offset);
+		close(fd2);
+		if(res2 >= 0){
+			log_msg("pfs_read failed over to %s\n",fpaths[i]);
+			retstat = res2;
+		}
+	}
+	free(fpaths);
+	return retstat;
+}
+
 static int pfs_read(const char *path, char *buf, size_t size, off_t offset,
 		      struct fuse_file_info *fi)
 {
 	log_msg("Entered pfs_read\n");
-	int retstat = pread(fi->fh, buf, size, offset);
-	if(retstat < 0) retstat = pfs_error("pfs_read read");
+	int retstat = pfs_read_handle(PFS_HANDLE(fi), buf, size, offset);
+	if(retstat < 0 && pfs_failover_error(-retstat)){
+		//try the replicas before giving up
+		retstat = pfs_read_replicas(path, buf, size, offset, retstat);
+	}
 	
 	return retstat;
 }
 
+static int pfs_write_handle(struct pfs_handle* h, const char* buf, size_t size, off_t offset){
+	h->dirty = 1;
+	struct pfs_handle_op op = { .name = "pfs_write pwrite", .apply = pfs_write_fd,
+		.h = h, .buf = buf, .size = size, .offset = offset, .uringOp = URING_WRITE };
+	if(h->coalesce != NULL){
+		return pfs_coalesce_write(&op);
+	}
+	//master and backups at once
+	return pfs_handle_update(&op, PFS_WB_WRITE);
+}
+
 static int pfs_write(const char* path, const char* buf, size_t size, off_t offset, 
 				struct fuse_file_info* fi)
 {
 	log_msg("Entered pfs_write\n");
-	 int retstat = 0;
-	 
-	 retstat = pwrite(fi->fh, buf, size, offset);
-	 //backup
-	if(PRI_DATA->master == 1){
-		int startDrive = mapNameToDrives(path);
-		int drivesWrittenTo = 0;
-		while(drivesWrittenTo < (PRI_DATA->numMounts - 2)){
-			log_msg("Drives Written To:%d\nTrying to write to backup:%d\n",drivesWrittenTo,startDrive);
-			char fpath2[PATH_MAX];
-			char* drive = calloc(1,sizeof(char));
-			sprintf(drive,"%d",startDrive);
-			strcpy(fpath2,PRI_DATA->backup);
-			strncat(fpath2,"/",1);
-			strncat(fpath2,drive,strlen(drive));
-			strncat(fpath2,path,strlen(path));
-			log_msg("Writing to %s\n",fpath2);
-			int fd = open(fpath2, fi->flags);
-			int res2 = pwrite(fd,buf,size,offset);
-			close(fd);
-			if(res2 < 0){
-				log_msg("ERROR: pfs_setxattr on backup/%s\n",drive);
-				pfs_error("pfs_setxattr");
-			}
-			else{
-				log_msg("Successful write to:%s\n",fpath2);
-				drivesWrittenTo++;
-			}
-			
-			startDrive = (startDrive+1) % PRI_DATA->numMounts;
-			log_msg("fpath2:%s\n",fpath2);
-		}
-		
-	}
-	 if(retstat < 0) retstat = pfs_error("pfs_write pwrite");
-	 
-	 return retstat;				
+	int retstat = pfs_write_handle(PFS_HANDLE(fi), buf, size, offset);
+	pfs_attr_changed(path, 0);
+	return retstat;
 }
 
 static int pfs_statfs(const char* path, struct statvfs* statv){
@@ -616,34 +1698,189 @@ static int pfs_statfs(const char* path, struct statvfs* statv){
 static int pfs_flush(const char* path, struct fuse_file_info* fi){
 	log_msg("Entered pfs_flush\n");
 	int retstat = 0;
+	pfs_coalesce_flush(PFS_HANDLE(fi));
 	
 	return retstat;
 }
 
+//  Clone beside the replica and rename over it, so a clone that fails
+//  halfway leaves the old copy whole
+static int pfs_clone_replica(struct pfs_replica_op* op, const char* fpath2, const char* unused){
+	char tmp[PATH_MAX + 16];
+	snprintf(tmp, sizeof(tmp), "%s.pfs-clone", fpath2);
+	int fd2 = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, op->mode);
+	if(fd2 < 0){
+		return -1;
+	}
+	int res = cloneFile(op->fd, fd2);
+	int saved = errno;
+	close(fd2);
+	if(res == 0) res = rename(tmp, fpath2);
+	if(res < 0){
+		saved = errno;
+		unlink(tmp);
+	}
+	errno = saved;
+	return res;
+}
+
+//  Clone mode: recreate every replica of path from the finished master
+//  copy.  Where the backups share the master's filesystem this is a
+//  reflink, so no data is copied at all.
+static void pfs_clone_replicas(const char* path){
+	char fpath[PATH_MAX];
+	struct stat st;
+	pfs_fullpath(fpath, path);
+	int fd = open(fpath, O_RDONLY);
+	if(fd < 0){
+		pfs_error("pfs_release clone open");
+		return;
+	}
+	if(fstat(fd, &st) < 0){
+		pfs_error("pfs_release clone fstat");
+		close(fd);
+		return;
+	}
+	struct pfs_replica_op op = { .name = "pfs_release clone", .apply = pfs_clone_replica,
+		.fd = fd, .mode = st.st_mode & 07777 };
+	pfs_replicate(&op, path, NULL);
+	int cloned[op.numDrives + 1];
+	int n = 0;
+	for(int i = 0; i < op.numDrives; i++){
+		if(op.results[i] >= 0) cloned[n++] = op.drives[i];
+	}
+	indexSetReplicas(path, cloned, n);
+	pfs_replicate_done(&op);
+	close(fd);
+}
+
 static int pfs_release(const char* path, struct fuse_file_info* fi){
 	log_msg("Entered pfs_release\n");
 	int retstat = 0;
-	retstat = close(fi->fh);
+	struct pfs_handle* h = PFS_HANDLE(fi);
+	int dirty = h->dirty;
+	pfs_coalesce_flush(h);
+	if(h->queue != NULL && PRI_DATA->writeMode == PFS_WRITE_DRAIN){
+		wbDrain(h->queue);
+	}
+	int writer = h->writer;
+	retstat = pfs_handle_close(h);
+	//NULL once the file has no name left to bring up to date
+	if(path == NULL){
+		return retstat;
+	}
+	if(dirty && PRI_DATA->master == 1 && PRI_DATA->writeMode == PFS_WRITE_CLONE){
+		pfs_clone_replicas(path);
+	}
+	if(dirty && PRI_DATA->master == 1 && PRI_DATA->writeMode == PFS_WRITE_CHUNK){
+		pfs_chunk_replicas(path);
+	}
+	if(dirty && PRI_DATA->master == 1 && PRI_DATA->writeMode == PFS_WRITE_DEDUP){
+		//hashes it too
+		pfs_dedup_replicas(path, NULL);
+	}
+	else if(writer && dirty){
+		pfs_index_hash(path);
+	}
+	if(dirty){
+		//the replicas may only have caught up now
+		aeChanged(path);
+	}
+	if(writer){
+		pfs_index_refresh(path);
+		indexWriters(path, -1);
+	}
 	return retstat;
 }
 
-static int pfs_fsync(const char* path, int datasync, struct fuse_file_info* fi){
-	log_msg("Entered pfs_fsync\n");
-	int retstat = 0;
+static int pfs_fsync_fd(struct pfs_handle_op* op, int fd){
 #ifdef HAVE_FDATASYNC
-	if(datasync){
-		retstat = fdatasync(fi->fh);
+	if(op->datasync){
+		return fdatasync(fd);
 	}
-	else
 #endif
-	retstat = fsync(fi->fh);
-	
-	if(retstat < 0) retstat = pfs_error("pfs_fsync fsync");
-	
-	return retstat;	
+	return fsync(fd);
+}
+
+static int pfs_fsync(const char* path, int datasync, struct fuse_file_info* fi){
+	log_msg("Entered pfs_fsync\n");
+	struct pfs_handle* h = PFS_HANDLE(fi);
+	struct pfs_handle_op op = { .name = "pfs_fsync fsync", .apply = pfs_fsync_fd,
+		.h = h, .datasync = datasync, .uringOp = datasync ? URING_FDATASYNC : URING_FSYNC };
+	pfs_coalesce_flush(h);
+	if(h->queue != NULL && PRI_DATA->writeMode == PFS_WRITE_DRAIN){
+		//everything written so far has to reach the replicas first
+		wbDrain(h->queue);
+		return pfs_handle_run(&op, NULL);
+	}
+	return pfs_handle_update(&op, datasync ? PFS_WB_DATASYNC : PFS_WB_FSYNC);
+}
+
+static void pfs_writeback_apply(void* owner, int kind, const char* buf, size_t size, off_t offset){
+	struct pfs_handle_op op = { .h = owner, .first = 1, .buf = buf, .size = size, .offset = offset };
+	switch(kind){
+		case PFS_WB_WRITE:
+			op.name = "pfs_write pwrite";
+			op.apply = pfs_write_fd;
+			op.uringOp = URING_WRITE;
+			break;
+		case PFS_WB_TRUNCATE:
+			op.name = "pfs_ftruncate ftruncate";
+			op.apply = pfs_ftruncate_fd;
+			break;
+		default:
+			op.name = "pfs_fsync fsync";
+			op.apply = pfs_fsync_fd;
+			op.datasync = kind == PFS_WB_DATASYNC;
+			op.uringOp = op.datasync ? URING_FDATASYNC : URING_FSYNC;
+			break;
+	}
+	pfs_handle_run(&op, NULL);
 }
 
 #ifdef HAVE_SYS_XATTR_H
+static int pfs_setxattr_replica(struct pfs_replica_op* op, const char* fpath2, const char* unused){
+	return lsetxattr(fpath2, op->xname, op->value, op->size, op->flags);
+}
+
+static int pfs_removexattr_replica(struct pfs_replica_op* op, const char* fpath2, const char* unused);
+
+//  name's value on fpath before a change, to put back if too few copies
+//  take it.  *value is allocated; the size is -1 if there was none.
+static ssize_t pfs_xattr_save(const char* fpath, const char* name, char** value){
+	*value = NULL;
+	ssize_t size = lgetxattr(fpath, name, NULL, 0);
+	if(size < 0 || (*value = malloc(size + 1)) == NULL){
+		return -1;
+	}
+	size = lgetxattr(fpath, name, *value, size);
+	if(size < 0){
+		free(*value);
+		*value = NULL;
+	}
+	return size;
+}
+
+//  Put op's attribute back as pfs_xattr_save found it, on the master and
+//  on the replicas op reached
+static void pfs_xattr_undo(struct pfs_replica_op* op, const char* fpath, char* value, ssize_t size){
+	int res;
+	op->value = value;
+	op->size = size;
+	op->flags = 0;
+	if(size >= 0){
+		pfs_replicate_undo(op, pfs_setxattr_replica);
+		res = lsetxattr(fpath, op->xname, value, size, 0);
+	}
+	else{
+		pfs_replicate_undo(op, pfs_removexattr_replica);
+		res = lremovexattr(fpath, op->xname);
+	}
+	if(res < 0){
+		pfs_error("pfs_xattr undo");
+	}
+}
+
 /** Set extended attributes */
 static int pfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
 {
@@ -652,39 +1889,22 @@ static int pfs_setxattr(const char *path, const char *name, const char *value, s
     char fpath[PATH_MAX];
     
     pfs_fullpath(fpath, path);
+    char *old;
+    ssize_t oldSize = pfs_xattr_save(fpath, name, &old);
     
     retstat = lsetxattr(fpath, name, value, size, flags);
-    //backup
-	if(PRI_DATA->master == 1){
-		int startDrive = mapNameToDrives(path);
-		int drivesWrittenTo = 0;
-		while(drivesWrittenTo < (PRI_DATA->numMounts - 2)){
-			log_msg("Drives Written To:%d\nTrying to write to backup:%d\n",drivesWrittenTo,startDrive);
-			char fpath2[PATH_MAX];
-			char* drive = calloc(1,sizeof(char));
-			sprintf(drive,"%d",startDrive);
-			strcpy(fpath2,PRI_DATA->backup);
-			strncat(fpath2,"/",1);
-			strncat(fpath2,drive,strlen(drive));
-			strncat(fpath2,path,strlen(path));
-			log_msg("Writing to %s\n",fpath2);
-			int res2 = lsetxattr(fpath2, name, value, size, flags);
-			if(res2 < 0){
-				log_msg("ERROR: pfs_setxattr on backup/%s\n",drive);
-				pfs_error("pfs_setxattr");
-			}
-			else{
-				log_msg("Successful write to:%s\n",fpath2);
-				drivesWrittenTo++;
-			}
-			
-			startDrive = (startDrive+1) % PRI_DATA->numMounts;
-			log_msg("fpath2:%s\n",fpath2);
-		}
-		
-	}
     if (retstat < 0)
 	retstat = pfs_error("pfs_setxattr lsetxattr");
+    int changed = retstat == 0;
+    //backup
+    struct pfs_replica_op op = { .name = "pfs_setxattr", .apply = pfs_setxattr_replica,
+        .xname = name, .value = value, .size = size, .flags = flags };
+    retstat = pfs_quorum(retstat, pfs_replicate(&op, path, NULL));
+    if (changed && retstat < 0)
+	pfs_xattr_undo(&op, fpath, old, oldSize);
+    pfs_replicate_done(&op);
+    free(old);
+    pfs_attr_changed(path, 0);
     
     return retstat;
 }
@@ -723,6 +1943,10 @@ static int pfs_listxattr(const char *path, char *list, size_t size)
     return retstat;
 }
 
+static int pfs_removexattr_replica(struct pfs_replica_op* op, const char* fpath2, const char* unused){
+	return lremovexattr(fpath2, op->xname);
+}
+
 /** Remove extended attributes */
 static int pfs_removexattr(const char *path, const char *name)
 {
@@ -731,44 +1955,40 @@ static int pfs_removexattr(const char *path, const char *name)
     char fpath[PATH_MAX];
     
     pfs_fullpath(fpath, path);
+    char *old;
+    ssize_t oldSize = pfs_xattr_save(fpath, name, &old);
     
     retstat = lremovexattr(fpath, name);
-    //backup
-	if(PRI_DATA->master == 1){
-		int startDrive = mapNameToDrives(path);
-		int drivesWrittenTo = 0;
-		while(drivesWrittenTo < (PRI_DATA->numMounts - 2)){
-			log_msg("Drives Written To:%d\nTrying to write to backup:%d\n",drivesWrittenTo,startDrive);
-			char fpath2[PATH_MAX];
-			char* drive = calloc(1,sizeof(char));
-			sprintf(drive,"%d",startDrive);
-			strcpy(fpath2,PRI_DATA->backup);
-			strncat(fpath2,"/",1);
-			strncat(fpath2,drive,strlen(drive));
-			strncat(fpath2,path,strlen(path));
-			log_msg("Writing to %s\n",fpath2);
-			int res2 = lremovexattr(fpath2, name);
-			if(res2 < 0){
-				log_msg("ERROR: pfs_removexattr on backup/%s\n",drive);
-				pfs_error("pfs_removexattr");
-			}
-			else{
-				log_msg("Successful write to:%s\n",fpath2);
-				drivesWrittenTo++;
-			}
-			
-			startDrive = (startDrive+1) % PRI_DATA->numMounts;
-			log_msg("fpath2:%s\n",fpath2);
-		}
-		
-	}
     if (retstat < 0)
 	retstat = pfs_error("pfs_removexattr lremovexattr");
+    int changed = retstat == 0;
+    //backup
+    struct pfs_replica_op op = { .name = "pfs_removexattr", .apply = pfs_removexattr_replica, .xname = name };
+    retstat = pfs_quorum(retstat, pfs_replicate(&op, path, NULL));
+    if (changed && retstat < 0)
+	pfs_xattr_undo(&op, fpath, old, oldSize);
+    pfs_replicate_done(&op);
+    free(old);
+    pfs_attr_changed(path, 0);
     
     return retstat;
 }
 #endif
 
+//  Per open directory state, hung off fuse_file_info->fh.  Offsets count
+//  the entries handed out so far, . and .. included, except straight off
+//  the disk where they are telldir() cookies.  Index listings keep the
+//  last name handed out, so the next page picks up from it rather than
+//  counting its way there again.
+struct pfs_dir {
+	DIR* dp;
+	off_t pos;
+	char last[NAME_MAX + 1];
+};
+
+#define PFS_DIR(fi) ((struct pfs_dir*)(uintptr_t)(fi)->fh)
+#define PFS_READDIR_PAGE 256
+
 static int pfs_opendir(const char* path, struct fuse_file_info* fi){
 	log_msg("Entered pfs_opendir\n");
 	DIR *dp;
@@ -780,33 +2000,124 @@ static int pfs_opendir(const char* path, struct fuse_file_info* fi){
 	dp = opendir(fpath);
 	if(dp == NULL){
 		retstat = pfs_error("pfs_opendir opendir");
+		return retstat;
 	}
+	struct pfs_dir* d = calloc(1,sizeof(struct pfs_dir));
+	d->dp = dp;
 	
-	fi->fh = (intptr_t) dp;
+	fi->fh = (uintptr_t) d;
 	return retstat;
 }
 
+//  filler and its buffer, for listing a directory out of the index
+struct pfs_index_fill {
+	void* buf;
+	fuse_fill_dir_t filler;
+	const char* path;
+	struct pfs_dir* d;
+	int full;
+	int prefill;
+	struct attr_stamp stamp;
+};
+
+static void pfs_dir_child(char child[PATH_MAX], const char* dir, const char* name){
+	snprintf(child, PATH_MAX, "%s%s%s", dir, strcmp(dir, "/") ? "/" : "", name);
+}
+
+static int pfs_index_entry(const char* name, const struct stat* st, void* arg){
+	struct pfs_index_fill* fill = arg;
+	if(fill->filler(fill->buf, name, st, fill->d->pos + 1) != 0){
+		fill->full = 1;
+		return 1;
+	}
+	fill->d->pos++;
+	snprintf(fill->d->last, sizeof(fill->d->last), "%s", name);
+	//the getattr for it that follows is answered from memory
+	if(fill->prefill){
+		char child[PATH_MAX];
+		pfs_dir_child(child, fill->path, name);
+		attrCacheFill(child, st, &fill->stamp);
+	}
+	return 0;
+}
+
+//  Hand out entries from offset on until filler's buffer is full; the
+//  kernel calls again from the offset of the first one left out.  Each
+//  entry carries its attributes where they are to hand, and they go in
+//  the stat cache too.
 static int pfs_readdir(const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, 
 					struct fuse_file_info* fi)
 {
 	log_msg("Entered pfs_readdir\n");
 	int retstat = 0;
-	DIR* dp;
+	struct pfs_dir* d = PFS_DIR(fi);
 	struct dirent* de;
+	//getattr merges R copies; a listing only sees the master's
+	int prefill = PRI_DATA->attrCacheMs > 0 && PRI_DATA->readQuorum == 1;
+	
+	if(indexEnabled()){
+		long skip = 0;
+		if(offset != d->pos){
+			//a seek: count from the start this once
+			d->pos = offset;
+			d->last[0] = '\0';
+			skip = offset > 2 ? offset - 2 : 0;
+		}
+		while(d->pos < 2){
+			if(filler(buf, d->pos == 0 ? "." : "..", NULL, d->pos + 1) != 0){
+				return retstat;
+			}
+			d->pos++;
+		}
+		struct pfs_index_fill fill = { .buf = buf, .filler = filler, .path = path, .d = d,
+			.prefill = prefill };
+		if(prefill){
+			attrCacheStamp(&fill.stamp);
+		}
+		for(;;){
+			int n = indexList(path, d->last, skip, PFS_READDIR_PAGE, pfs_index_entry, &fill);
+			if(n < 0){
+				return -EIO;
+			}
+			if(fill.full || n < PFS_READDIR_PAGE){
+				return retstat;
+			}
+			skip = 0;
+		}
+	}
 	
-	dp = (DIR*) (uintptr_t) fi->fh;
-	
-	de = readdir(dp);
-	if(de == 0){
-		retstat = pfs_error("pfs_readdir readdir");
-		return retstat;
+	if(offset == 0){
+		rewinddir(d->dp);
+	}
+	else{
+		seekdir(d->dp, offset);
 	}
 	
-	do{
-		if(filler(buf,de->d_name, NULL, 0) != 0) {
-			return -ENOMEM;
+	errno = 0;
+	while((de = readdir(d->dp)) != NULL){
+		struct stat st;
+		struct stat* stp = NULL;
+		off_t next = telldir(d->dp);
+		if(strcmp(de->d_name, ".") && strcmp(de->d_name, "..")){
+			char child[PATH_MAX];
+			unsigned long gen;
+			pfs_dir_child(child, path, de->d_name);
+			if(attrCacheGet(child, &st, &gen) == 1){
+				stp = &st;
+			}
+			else if(prefill && fstatat(dirfd(d->dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0){
+				attrCachePut(child, &st, gen);
+				stp = &st;
+			}
+		}
+		if(filler(buf, de->d_name, stp, next) != 0){
+			return retstat;
 		}
-	} while((de = readdir(dp)) != NULL);
+		errno = 0;
+	}
+	if(errno != 0){
+		retstat = pfs_error("pfs_readdir readdir");
+	}
 	
 	return retstat;
 }
@@ -815,7 +2126,8 @@ static int pfs_releasedir(const char* path, struct fuse_file_info* fi){
 	log_msg("Entered pfs_releasedir\n");
 	int retstat = 0;
 	
-	closedir((DIR*)(uintptr_t)fi->fh);
+	closedir(PFS_DIR(fi)->dp);
+	free(PFS_DIR(fi));
 	return retstat;
 }
 
@@ -824,29 +2136,378 @@ static int pfs_fsyncdir(const char* path, int datasync, struct fuse_file_info* f
 	return 0;
 }
 
+static ae_emit pfs_ae_emit;
+static void* pfs_ae_ctx;
+
+static int pfs_ae_entry(const char* fpath, const struct stat* sb, int typeflag, struct FTW* ftwbuf){
+	if(ftwbuf->level > 0 && typeflag != FTW_NS){
+		pfs_ae_emit(pfs_ae_ctx, fpath + strlen(PRI_DATA->rootdir), sb);
+	}
+	return 0;
+}
+
+static void pfs_ae_walk(ae_emit emit, void* ctx){
+	pfs_ae_emit = emit;
+	pfs_ae_ctx = ctx;
+	if(nftw(PRI_DATA->rootdir, pfs_ae_entry, 64, FTW_PHYS) != 0){
+		pfs_error("anti-entropy nftw");
+	}
+}
+
+//  where the replicas of path were put, or else where the ring puts them
+static int pfs_ae_placed(const char* path, int* drives, int max){
+	int copies = PRI_DATA->copies - 1 < max ? PRI_DATA->copies - 1 : max;
+	if(copies <= 0){
+		return 0;
+	}
+	int known = indexGetReplicas(path, drives, copies);
+	if(known > 0){
+		return known;
+	}
+	int first = mapNameToDrives(path);
+	for(int i = 0; i < copies; i++){
+		drives[i] = (first + i) % PRI_DATA->numMounts;
+	}
+	return copies;
+}
+
+//  A path the master no longer puts on drive.  Files still waiting for
+//  the rebalance to move them are read from there, so they stay.
+static int pfs_ae_remove(int drive, const char* path){
+	char fpath2[PATH_MAX];
+	int old[PRI_DATA->numMounts];
+	int numOld = rbOldDrives(path, old, PRI_DATA->numMounts);
+	if(pfs_has_drive(old, numOld, drive)){
+		return 0;
+	}
+	pfs_backuppath(fpath2, drive, path);
+	log_msg("sync: removing %s from drive %d\n",path,drive);
+	if(remove(fpath2) < 0 && errno != ENOENT && errno != ENOTEMPTY && errno != EEXIST){
+		return pfs_error("anti-entropy remove");
+	}
+	return 0;
+}
+
+//  Dedup mode: link the replica of path on drive to the object for the
+//  master copy's content, mode and owner.  Nothing is written to the
+//  object a replica already links to; others may share it.
+static int pfs_dedup_sync(int drive, const char* path, const struct stat* st){
+	char fpath[PATH_MAX];
+	char fpath2[PATH_MAX];
+	char fobj2[PATH_MAX];
+	char key[PFS_DEDUP_KEY];
+	char hash[INDEX_HASH_LEN];
+	struct stat cur;
+	struct stat obj;
+	pfs_fullpath(fpath, path);
+	pfs_backuppath(fpath2, drive, path);
+	if(indexGetHash(path, hash)){
+		pfs_dedup_key(key, hash, st);
+		snprintf(fobj2, PATH_MAX, "%s/%d" PFS_OBJECTS "/%s", PRI_DATA->backup, drive, key);
+		if(lstat(fpath2, &cur) == 0 && lstat(fobj2, &obj) == 0 &&
+		   cur.st_ino == obj.st_ino && cur.st_dev == obj.st_dev){
+			return 0;
+		}
+	}
+	log_msg("sync: %s to drive %d\n",path,drive);
+	int fd = open(fpath, O_RDONLY);
+	if(fd < 0){
+		return pfs_error("anti-entropy open");
+	}
+	int res = indexHashFile(fd, hash);
+	if(res == 0){
+		pfs_dedup_key(key, hash, st);
+		snprintf(fobj2, PATH_MAX, "%s/%d" PFS_OBJECTS "/%s", PRI_DATA->backup, drive, key);
+		struct pfs_replica_op op = { .name = "pfs_dedup", .fd = fd, .mode = st->st_mode & 07777,
+			.uid = st->st_uid, .gid = st->st_gid };
+		res = pfs_dedup_replica(&op, fpath2, fobj2);
+	}
+	if(res < 0){
+		res = pfs_error("anti-entropy link");
+	}
+	close(fd);
+	return res;
+}
+
+//  Copy one file, directory or link from the master onto drive, or with
+//  no st take it off.  Files keep the master's mtime, so a later pass can
+//  tell they are current, and one that already is only has its mode put
+//  right.  Dedup replicas are relinked instead, never changed in place.
+static int pfs_sync_replica(int drive, const char* path, const struct stat* st){
+	char fpath[PATH_MAX];
+	char fpath2[PATH_MAX];
+	char tmp[PATH_MAX + 16];
+	struct stat cur;
+	if(st == NULL){
+		return pfs_ae_remove(drive, path);
+	}
+	snprintf(fpath, PATH_MAX, "%s%s", PRI_DATA->rootdir, path);
+	snprintf(fpath2, PATH_MAX, "%s/%d%s", PRI_DATA->backup, drive, path);
+	snprintf(tmp, sizeof(tmp), "%s.pfs-repair", fpath2);
+	if(pfs_dedup_file(st)){
+		return pfs_dedup_sync(drive, path, st);
+	}
+	if(S_ISREG(st->st_mode) && lstat(fpath2, &cur) == 0 && S_ISREG(cur.st_mode) &&
+	   cur.st_size == st->st_size && pfs_timespec_ns(&cur.st_mtim) >= pfs_timespec_ns(&st->st_mtim)){
+		return chmod(fpath2, st->st_mode & 07777) < 0 ? pfs_error("sync chmod") : 0;
+	}
+	log_msg("sync: %s to drive %d\n",path,drive);
+	pfs_dedup_parents(fpath2);
+	
+	if(S_ISDIR(st->st_mode)){
+		if(mkdir(fpath2, st->st_mode & 07777) < 0 && errno != EEXIST){
+			return pfs_error("anti-entropy mkdir");
+		}
+		return 0;
+	}
+	if(S_ISLNK(st->st_mode)){
+		char target[PATH_MAX];
+		ssize_t len = readlink(fpath, target, PATH_MAX - 1);
+		if(len < 0){
+			return pfs_error("anti-entropy readlink");
+		}
+		target[len] = '\0';
+		unlink(tmp);
+		if(symlink(target, tmp) < 0 || rename(tmp, fpath2) < 0){
+			unlink(tmp);
+			return pfs_error("anti-entropy symlink");
+		}
+		return 0;
+	}
+	if(!S_ISREG(st->st_mode)){
+		return 0;
+	}
+	int fd = open(fpath, O_RDONLY);
+	if(fd < 0){
+		return pfs_error("anti-entropy open");
+	}
+	int fd2 = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, st->st_mode & 07777);
+	int res = fd2 < 0 ? -1 : cloneFile(fd, fd2);
+	if(res == 0){
+		struct timespec times[2] = { st->st_atim, st->st_mtim };
+		res = futimens(fd2, times);
+	}
+	if(res == 0) res = rename(tmp, fpath2);
+	if(res < 0){
+		res = pfs_error("anti-entropy copy");
+		unlink(tmp);
+	}
+	if(fd2 >= 0) close(fd2);
+	close(fd);
+	return res;
+}
+
+static rb_emit pfs_rb_emit;
+static void* pfs_rb_ctx;
+
+static int pfs_rb_entry(const char* fpath, const struct stat* sb, int typeflag, struct FTW* ftwbuf){
+	if(ftwbuf->level > 0 && typeflag != FTW_NS){
+		pfs_rb_emit(pfs_rb_ctx, fpath + strlen(PRI_DATA->rootdir), sb);
+	}
+	return 0;
+}
+
+static void pfs_rb_walk(rb_emit emit, void* ctx){
+	pfs_rb_emit = emit;
+	pfs_rb_ctx = ctx;
+	if(nftw(PRI_DATA->rootdir, pfs_rb_entry, 64, FTW_PHYS) != 0){
+		pfs_error("rebalance nftw");
+	}
+}
+
+//  Move path's replicas onto the drives the new ring puts them on.  The
+//  index is pointed at them first, so updates made while the copy is
+//  under way go there too, and back at the old ones if the copy fails.
+//  Directories stay on the old drives, since other paths may still need
+//  them.
+static int pfs_rb_move(const char* path, const struct stat* st, const int* from, int numFrom,
+		const int* to, int numTo){
+	char fpath2[PATH_MAX];
+	int held[numFrom > 0 ? numFrom : 1];
+	//the index knows better where the copies went, stand-ins included
+	int known = indexGetReplicas(path, held, numFrom);
+	if(known > 0){
+		from = held;
+		numFrom = known;
+	}
+	indexSetReplicas(path, to, numTo);
+	for(int i = 0; i < numTo; i++){
+		if(!pfs_has_drive(from, numFrom, to[i]) && pfs_sync_replica(to[i], path, st) < 0){
+			indexSetReplicas(path, held, known);
+			aeChanged(path);
+			return -1;
+		}
+	}
+	//anti-entropy looks at the drives again now they are done with
+	aeChanged(path);
+	if(S_ISDIR(st->st_mode)){
+		return 0;
+	}
+	for(int i = 0; i < numFrom; i++){
+		if(pfs_has_drive(to, numTo, from[i])){
+			continue;
+		}
+		snprintf(fpath2, PATH_MAX, "%s/%d%s", PRI_DATA->backup, from[i], path);
+		if(unlink(fpath2) < 0 && errno != ENOENT){
+			pfs_error("rebalance unlink");
+		}
+	}
+	return 0;
+}
+
+static int pfs_remove_entry(const char* fpath, const struct stat* sb, int typeflag, struct FTW* ftwbuf){
+	return remove(fpath) < 0 && errno != ENOENT ? -1 : 0;
+}
+
+//  Replay one hint: make path (renamed to newpath, if given) on drive
+//  what the master has now
+static int pfs_hint_replay(int drive, const char* path, const char* newpath){
+	char fpath[PATH_MAX];
+	char fpath2[PATH_MAX];
+	struct stat st;
+	if(newpath != NULL){
+		char fnewpath2[PATH_MAX];
+		snprintf(fpath2, PATH_MAX, "%s/%d%s", PRI_DATA->backup, drive, path);
+		snprintf(fnewpath2, PATH_MAX, "%s/%d%s", PRI_DATA->backup, drive, newpath);
+		pfs_dedup_parents(fnewpath2);
+		if(rename(fpath2, fnewpath2) < 0 && errno != ENOENT){
+			return pfs_error("hint rename");
+		}
+		pfs_ae_moved(path, newpath);
+		path = newpath;
+	}
+	aeChangedTree(path);
+	snprintf(fpath, PATH_MAX, "%s%s", PRI_DATA->rootdir, path);
+	snprintf(fpath2, PATH_MAX, "%s/%d%s", PRI_DATA->backup, drive, path);
+	if(lstat(fpath, &st) == 0){
+		return pfs_sync_replica(drive, path, &st);
+	}
+	if(errno != ENOENT){
+		return pfs_error("hint lstat");
+	}
+	//gone from the master, so everything under it goes too
+	if(nftw(fpath2, pfs_remove_entry, 64, FTW_DEPTH | FTW_PHYS) != 0 && errno != ENOENT){
+		return pfs_error("hint remove");
+	}
+	return 0;
+}
+
 void* pfs_init(struct fuse_conn_info *conn){
 	log_msg("Entered pfs_init\n");
 	if(PRI_DATA->master == 1){
-		for(int i = 0; i < PRI_DATA->numMounts; i++){
-			char* total = calloc(strlen(PRI_DATA->backup) + 2,sizeof(char));
-			char* drive = calloc(1,sizeof(char));
-			sprintf(drive,"%d",i);
-			strcpy(total,PRI_DATA->backup);
-			strncat(total,"/",1);
-			strncat(total,drive,1);
-			log_msg("\tFilepath is:%s\n",total);
-			addNode(total);
-			log_msg("Done with addNode\n");
-			struct node* test = search("Key");
-			int driveNum = atoi(&total[strlen(total)-1]);
-			log_msg("\tMount from node is:%s\nSize is:%d\ndriveNum is:%d\n",test->mount,getSize(),driveNum);
+		int numMounts = PRI_DATA->numMounts;
+		char** mounts = calloc(numMounts,sizeof(char*));
+		double* capacity = calloc(numMounts,sizeof(double));
+		double totalCapacity = 0;
+		int known = 0;
+		
+		//weight each drive by the size of the filesystem it lives on
+		for(int i = 0; i < numMounts; i++){
+			struct statvfs statv;
+			mounts[i] = calloc(strlen(PRI_DATA->backup) + 16,sizeof(char));
+			sprintf(mounts[i],"%s/%d",PRI_DATA->backup,i);
+			if(statvfs(mounts[i],&statv) == 0){
+				capacity[i] = (double) statv.f_blocks * statv.f_frsize;
+				totalCapacity += capacity[i];
+				known++;
+			}
+			else{
+				pfs_error("pfs_init statvfs");
+			}
+		}
+		
+		for(int i = 0; i < numMounts; i++){
+			int numTokens = PRI_DATA->vnodes;
+			if(known > 0 && capacity[i] > 0){
+				numTokens = (int) (PRI_DATA->vnodes * capacity[i] * known / totalCapacity + 0.5);
+			}
+			log_msg("\tFilepath is:%s\n\tTokens:%d\n",mounts[i],numTokens);
+			addNode(mounts[i],i,numTokens);
+			log_msg("Done with addNode\n");
+		}
+		log_msg("\tSize is:%d\n",getSize());
+		
+		//report how much of the key space each drive ended up with
+		double* share = calloc(numMounts,sizeof(double));
+		ringOwnership(share,numMounts);
+		for(int i = 0; i < numMounts; i++){
+			log_msg("\tDrive %d owns %.2f%% of the ring\n",i,share[i] * 100);
+		}
+		free(share);
+		free(capacity);
+		free(mounts);
+		
+		//workers that push each op to all the replicas at once
+		int threads = PRI_DATA->threads > 0 ? PRI_DATA->threads : numMounts;
+		if(poolInit(threads) < 0){
+			log_msg("ERROR: could not start replication workers, replicating serially\n");
+		}
+		log_msg("\tReplication workers:%d\n",threads);
+		
+		if(PRI_DATA->writeMode == PFS_WRITE_ASYNC || PRI_DATA->writeMode == PFS_WRITE_DRAIN){
+			if(wbInit(threads, PRI_DATA->writeBehindBytes, PRI_DATA->writeBehindLagMs) < 0){
+				log_msg("ERROR: could not start write-behind workers, replicating synchronously\n");
+				PRI_DATA->writeMode = PFS_WRITE_SYNC;
+			}
+			log_msg("\tWrite-behind: %zu bytes, %ld ms\n",PRI_DATA->writeBehindBytes,PRI_DATA->writeBehindLagMs);
+		}
+	}
+	if(PRI_DATA->indexFile != NULL){
+		if(indexOpen(PRI_DATA->indexFile, PRI_DATA->rootdir) < 0){
+			log_msg("ERROR: could not open the index %s, going to the disks\n",PRI_DATA->indexFile);
+		}
+	}
+	if(PRI_DATA->master == 1){
+		if(healthInit(PRI_DATA->numMounts, PRI_DATA->backup) < 0){
+			log_msg("ERROR: could not start health tracking, every drive is taken to be up\n");
+		}
+		if(hintInit(PRI_DATA->numMounts, PRI_DATA->backup, pfs_hint_replay) < 0){
+			log_msg("ERROR: could not start hinted handoff, missed replica updates are only logged\n");
+		}
+	}
+	if(PRI_DATA->master == 1){
+		if(rbInit(PRI_DATA->backup, PRI_DATA->numMounts, PRI_DATA->copies - 1, PRI_DATA->rebalanceBytes,
+		          pfs_rb_walk, pfs_rb_move) < 0){
+			log_msg("ERROR: could not start rebalancing, files stay where the last ring put them\n");
+		}
+	}
+	if(PRI_DATA->master == 1 && PRI_DATA->antiEntropyMs >= 0){
+		if(aeInit(PRI_DATA->numMounts, PRI_DATA->rootdir, PRI_DATA->backup, PRI_DATA->antiEntropyMs,
+		           pfs_ae_walk, pfs_ae_placed, pfs_sync_replica) < 0){
+			log_msg("ERROR: could not start anti-entropy, backups won't be repaired\n");
 		}
 	}
+	if(PRI_DATA->master == 1 && databaseStart() < 0){
+		log_msg("ERROR: could not start the catalog sink, updating it synchronously\n");
+	}
+	if(PRI_DATA->coalesceBytes > 0){
+		log_msg("\tReplica write buffer: %zu bytes per handle\n",PRI_DATA->coalesceBytes);
+	}
+	//the low-level frontend stats through its directory fds instead
+	if(PRI_DATA->attrCacheMs > 0 && !PRI_DATA->lowlevel){
+		if(attrCacheInit(PFS_ATTR_CACHE_ENTRIES, PRI_DATA->attrCacheMs) < 0){
+			log_msg("ERROR: no memory for the stat cache, going to the disks\n");
+		}
+		log_msg("\tStat cache: %d entries, %ld ms\n",PFS_ATTR_CACHE_ENTRIES,PRI_DATA->attrCacheMs);
+	}
+	if(PRI_DATA->uring && uringInit() < 0){
+		log_msg("ERROR: io_uring not available, using pread/pwrite\n");
+		PRI_DATA->uring = 0;
+	}
 	return PRI_DATA;
 }
 
 void pfs_destroy(void* userdata){
 	log_msg("Entered pfs_destroy\n");
+	rbDestroy();
+	aeDestroy();
+	wbDestroy();
+	hintDestroy();
+	poolDestroy();
+	healthDestroy();
+	databaseDestroy();
+	indexClose();
+	attrCacheDestroy();
 }
 
 static int pfs_access(const char* path, int mask){
@@ -872,7 +2533,18 @@ static int pfs_create(const char* path, mode_t mode, struct fuse_file_info* fi){
 	
 	pfs_fullpath(fpath,path);
 	
-	fd = creat(fpath, mode);
+	//made here, rather than truncated, is what a failed quorum takes back
+	fd = open(fpath, O_CREAT | O_EXCL | O_WRONLY | O_TRUNC, mode);
+	int made = fd >= 0;
+	if(fd < 0 && errno == EEXIST){
+		fd = creat(fpath, mode);
+	}
+	if(fd < 0){
+		retstat = pfs_error("pfs_create creat");
+		return retstat;
+	}
+	pfs_attr_changed(path, 1);
+	struct pfs_handle* h = pfs_handle_new(fd);
 	//backup
 	if(PRI_DATA->master == 1){
 		fprintf(stderr,"Calling insertImage,fpath:%s\n",fpath);
@@ -884,74 +2556,52 @@ static int pfs_create(const char* path, mode_t mode, struct fuse_file_info* fi){
 		}
 		fprintf(stderr,"Done pushing to database\n");
 		log_msg("Done pushing image %s to database\n",fpath);
-		int startDrive = mapNameToDrives(path);
-		int drivesWrittenTo = 0;
-		while(drivesWrittenTo < (PRI_DATA->numMounts - 2)){
-			log_msg("Drives Written To:%d\nTrying to write to backup:%d\n",drivesWrittenTo,startDrive);
-			char fpath2[PATH_MAX];
-			char* drive = calloc(1,sizeof(char));
-			sprintf(drive,"%d",startDrive);
-			strcpy(fpath2,PRI_DATA->backup);
-			strncat(fpath2,"/",1);
-			strncat(fpath2,drive,strlen(drive));
-			strncat(fpath2,path,strlen(path));
-			log_msg("Writing to %s\n",fpath2);
-			int res2 = creat(fpath2, mode);
-			if(res2 < 0){
-				log_msg("ERROR: pfs_create on backup/%s\n",drive);
-				pfs_error("pfs_create");
+		//same as creat(), but keep the fds for the writes that follow
+		pfs_open_replicas(h, path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+		retstat = pfs_quorum(retstat, h->numReplicas);
+		if(retstat < 0 && made){
+			//too few copies: the file isn't created after all, and the
+			//catalog forgets it again
+			for(int i = 0; i < h->numReplicas; i++){
+				char fpath2[PATH_MAX];
+				pfs_backuppath(fpath2, h->replicaDrives[i], path);
+				if(unlink(fpath2) < 0) pfs_error("pfs_create undo replica unlink");
 			}
-			else{
-				log_msg("Successful write to:%s\n",fpath2);
-				drivesWrittenTo++;
+			h->numHinted = 0;
+			pfs_handle_close(h);
+			if(unlink(fpath) < 0) pfs_error("pfs_create undo unlink");
+			if(deleteImage(fpath) == 0){
+				log_msg("ERROR IN PUSHING TO DATABASE - deleteImage\n");
 			}
-			
-			startDrive = (startDrive+1) % PRI_DATA->numMounts;
-			log_msg("fpath2:%s\n",fpath2);
+			pfs_index_refresh(path);
+			pfs_attr_changed(path, 1);
+			return retstat;
+		}
+		if(retstat < 0){
+			pfs_handle_close(h);
+			pfs_index_refresh(path);
+			return retstat;
 		}
-		
 	}
-	if(fd < 0) retstat = pfs_error("pfs_create creat");
+	pfs_index_writer(h, path);
 	
-	fi->fh = fd;
+	fi->fh = (uintptr_t) h;
 	
 	return retstat;
 }
 
+static int pfs_ftruncate_fd(struct pfs_handle_op* op, int fd){
+	return ftruncate(fd, op->offset);
+}
+
 static int pfs_ftruncate(const char* path, off_t offset, struct fuse_file_info* fi){
 	log_msg("Entered pfs_ftruncate\n");
-	int retstat = 0;
-	retstat = ftruncate(fi->fh, offset);
-	//backup
-	if(PRI_DATA->master == 1){
-		int startDrive = mapNameToDrives(path);
-		int drivesWrittenTo = 0;
-		while(drivesWrittenTo < (PRI_DATA->numMounts - 2)){
-			log_msg("Drives Written To:%d\nTrying to write to backup:%d\n",drivesWrittenTo,startDrive);
-			char fpath2[PATH_MAX];
-			char* drive = calloc(1,sizeof(char));
-			sprintf(drive,"%d",startDrive);
-			strcpy(fpath2,PRI_DATA->backup);
-			strncat(fpath2,"/",1);
-			strncat(fpath2,drive,strlen(drive));
-			strncat(fpath2,path,strlen(path));
-			log_msg("Writing to %s\n",fpath2);
-			int res2 = truncate(fpath2,offset);
-			if(res2 < 0){
-				log_msg("ERROR: pfs_create on backup/%s\n",drive);
-				pfs_error("pfs_create");
-			}
-			else{
-				log_msg("Successful write to:%s\n",fpath2);
-				drivesWrittenTo++;
-			}
-			
-			startDrive = (startDrive+1) % PRI_DATA->numMounts;
-			log_msg("fpath2:%s\n",fpath2);
-		}
-		
-	}
-	if(retstat < 0) retstat = pfs_error("pfs_ftruncate ftruncate");
+	PFS_HANDLE(fi)->dirty = 1;
+	pfs_coalesce_flush(PFS_HANDLE(fi));
+	struct pfs_handle_op op = { .name = "pfs_ftruncate ftruncate", .apply = pfs_ftruncate_fd,
+		.h = PFS_HANDLE(fi), .offset = offset };
+	int retstat = pfs_handle_update(&op, PFS_WB_TRUNCATE);
+	pfs_attr_changed(path, 0);
 	return retstat;
 }
 
@@ -963,7 +2613,7 @@ static int pfs_fgetattr(const char* path, struct stat* statbuf, struct fuse_file
 		return pfs_getattr(path,statbuf);
 	}
 	
-	retstat = fstat(fi->fh, statbuf);
+	retstat = fstat(PFS_HANDLE(fi)->fd, statbuf);
 	if(retstat < 0) retstat = pfs_error("pfs_fgetattr fstat");
 	
 	return retstat;
@@ -1015,44 +2665,773 @@ struct fuse_operations pfs_oper = {
   .fgetattr = pfs_fgetattr
 };
 
+//  Low-level frontend.  The kernel names files by the numbers in the
+//  inode table rather than by path, so lookup, getattr, open, read, write
+//  and readdir go straight to fds: the directory fds the table keeps, or
+//  the file's own handle.  Calls that change the tree rebuild the path and
+//  go through the path callbacks above, which is where replication, the
+//  index and the catalog are kept up to date.  Every request runs on a
+//  session worker and is answered when it's done, not in arrival order.
+
+static void pfs_ll_init(void* userdata, struct fuse_conn_info* conn){
+	pfs_init(conn);
+}
+
+static void pfs_ll_destroy(void* userdata){
+	pfs_destroy(userdata);
+}
+
+//  name's attributes in directory dir, whose fd is fd: off the master
+//  through the fd when that's the whole answer, otherwise by path the way
+//  getattr finds them
+static int pfs_ll_statat(int fd, fuse_ino_t dir, const char* name, struct stat* st){
+	int retstat = -ESTALE;
+	if(PRI_DATA->readQuorum == 1){
+		retstat = fstatat(fd, name, st, AT_SYMLINK_NOFOLLOW) == 0 ? 0 : -errno;
+	}
+	//R copies to merge, or a master copy on a failing disk
+	if(PRI_DATA->readQuorum > 1 || (pfs_failover_error(-retstat) && PRI_DATA->copies > 1)){
+		char path[PATH_MAX];
+		if(inodePath(dir, strcmp(name, ".") ? name : NULL, path) == 0){
+			retstat = pfs_getattr(path, st);
+		}
+	}
+	return retstat;
+}
+
+static int pfs_ll_stat(fuse_ino_t ino, struct stat* st){
+	unsigned long dir;
+	char name[NAME_MAX + 1];
+	int fd = inodeAt(ino, &dir, name);
+	if(fd < 0){
+		return -errno;
+	}
+	int retstat = pfs_ll_statat(fd, dir, name, st);
+	inodeRelease(dir);
+	st->st_ino = ino;
+	return retstat;
+}
+
+//  Answer req with name in parent, counting the lookup against its inode;
+//  with fi, as the reply to a create.  -errno, without replying, if it
+//  can't be found.
+static int pfs_ll_entry(fuse_req_t req, fuse_ino_t parent, const char* name, struct fuse_file_info* fi){
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	int fd = inodeDirFd(parent);
+	if(fd < 0){
+		return -errno;
+	}
+	int retstat = pfs_ll_statat(fd, parent, name, &e.attr);
+	inodeRelease(parent);
+	if(retstat < 0){
+		return retstat;
+	}
+	e.ino = inodeAdd(parent, name, S_ISDIR(e.attr.st_mode));
+	if(e.ino == 0){
+		return -errno;
+	}
+	e.attr.st_ino = e.ino;
+	e.attr_timeout = PRI_DATA->attrTimeout;
+	e.entry_timeout = PRI_DATA->entryTimeout;
+	if(fi != NULL){
+		fuse_reply_create(req, &e, fi);
+	}
+	else{
+		fuse_reply_entry(req, &e);
+	}
+	return 0;
+}
+
+//  The reply to a call that made name in parent
+static void pfs_ll_made(fuse_req_t req, fuse_ino_t parent, const char* name, int retstat){
+	if(retstat == 0){
+		retstat = pfs_ll_entry(req, parent, name, NULL);
+	}
+	if(retstat < 0){
+		fuse_reply_err(req, -retstat);
+	}
+}
+
+static void pfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char* name){
+	log_msg("Entered pfs_ll_lookup\n");
+	int retstat = pfs_ll_entry(req, parent, name, NULL);
+	if(retstat == -ENOENT && PRI_DATA->negativeTimeout > 0){
+		//inode 0 has the kernel remember that name isn't there
+		struct fuse_entry_param e;
+		memset(&e, 0, sizeof(e));
+		e.entry_timeout = PRI_DATA->negativeTimeout;
+		fuse_reply_entry(req, &e);
+	}
+	else if(retstat < 0){
+		fuse_reply_err(req, -retstat);
+	}
+}
+
+static void pfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup){
+	inodeForget(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void pfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi){
+	log_msg("Entered pfs_ll_getattr\n");
+	struct stat st;
+	int retstat = pfs_ll_stat(ino, &st);
+	if(retstat < 0){
+		fuse_reply_err(req, -retstat);
+	}
+	else{
+		fuse_reply_attr(req, &st, PRI_DATA->attrTimeout);
+	}
+}
+
+static void pfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set,
+				struct fuse_file_info* fi){
+	log_msg("Entered pfs_ll_setattr\n");
+	char path[PATH_MAX];
+	struct stat st;
+	int retstat = inodePath(ino, NULL, path) == 0 ? 0 : -errno;
+	
+	if(retstat == 0 && (to_set & FUSE_SET_ATTR_MODE)){
+		retstat = pfs_chmod(path, attr->st_mode);
+	}
+	if(retstat == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))){
+		retstat = pfs_chown(path, to_set & FUSE_SET_ATTR_UID ? attr->st_uid : (uid_t) -1,
+			to_set & FUSE_SET_ATTR_GID ? attr->st_gid : (gid_t) -1);
+	}
+	if(retstat == 0 && (to_set & FUSE_SET_ATTR_SIZE)){
+		retstat = fi != NULL ? pfs_ftruncate(path, attr->st_size, fi) : pfs_truncate(path, attr->st_size);
+	}
+	if(retstat == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))){
+		//utime sets both, so the one not asked for keeps its value
+		retstat = pfs_ll_stat(ino, &st);
+		if(retstat == 0){
+			struct utimbuf ubuf;
+			ubuf.actime = to_set & FUSE_SET_ATTR_ATIME ? attr->st_atime : st.st_atime;
+			ubuf.modtime = to_set & FUSE_SET_ATTR_MTIME ? attr->st_mtime : st.st_mtime;
+			retstat = pfs_utime(path, &ubuf);
+		}
+	}
+	if(retstat == 0){
+		retstat = pfs_ll_stat(ino, &st);
+	}
+	if(retstat < 0){
+		fuse_reply_err(req, -retstat);
+	}
+	else{
+		fuse_reply_attr(req, &st, PRI_DATA->attrTimeout);
+	}
+}
+
+static void pfs_ll_readlink(fuse_req_t req, fuse_ino_t ino){
+	log_msg("Entered pfs_ll_readlink\n");
+	unsigned long dir;
+	char name[NAME_MAX + 1];
+	char link[PATH_MAX];
+	int retstat = -1;
+	int fd = inodeAt(ino, &dir, name);
+	if(fd >= 0){
+		retstat = readlinkat(fd, name, link, sizeof(link) - 1);
+		retstat = retstat < 0 ? -errno : retstat;
+		inodeRelease(dir);
+	}
+	else{
+		retstat = -errno;
+	}
+	if(retstat < 0){
+		fuse_reply_err(req, -retstat);
+		return;
+	}
+	link[retstat] = '\0';
+	fuse_reply_readlink(req, link);
+}
+
+static void pfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, dev_t rdev){
+	char path[PATH_MAX];
+	pfs_ll_made(req, parent, name, inodePath(parent, name, path) == 0 ? pfs_mknod(path, mode, rdev) : -errno);
+}
+
+static void pfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode){
+	char path[PATH_MAX];
+	pfs_ll_made(req, parent, name, inodePath(parent, name, path) == 0 ? pfs_mkdir(path, mode) : -errno);
+}
+
+static void pfs_ll_symlink(fuse_req_t req, const char* link, fuse_ino_t parent, const char* name){
+	char path[PATH_MAX];
+	pfs_ll_made(req, parent, name, inodePath(parent, name, path) == 0 ? pfs_symlink(link, path) : -errno);
+}
+
+static void pfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char* newname){
+	char path[PATH_MAX], newpath[PATH_MAX];
+	int retstat = 0;
+	if(inodePath(ino, NULL, path) < 0 || inodePath(newparent, newname, newpath) < 0){
+		retstat = -errno;
+	}
+	pfs_ll_made(req, newparent, newname, retstat == 0 ? pfs_link(path, newpath) : retstat);
+}
+
+static void pfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char* name){
+	char path[PATH_MAX];
+	int retstat = inodePath(parent, name, path) == 0 ? pfs_unlink(path) : -errno;
+	if(retstat == 0){
+		inodeDrop(parent, name);
+	}
+	fuse_reply_err(req, -retstat);
+}
+
+static void pfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char* name){
+	char path[PATH_MAX];
+	int retstat = inodePath(parent, name, path) == 0 ? pfs_rmdir(path) : -errno;
+	if(retstat == 0){
+		inodeDrop(parent, name);
+	}
+	fuse_reply_err(req, -retstat);
+}
+
+static void pfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char* name,
+				fuse_ino_t newparent, const char* newname){
+	char path[PATH_MAX], newpath[PATH_MAX];
+	int retstat = 0;
+	if(inodePath(parent, name, path) < 0 || inodePath(newparent, newname, newpath) < 0){
+		retstat = -errno;
+	}
+	else{
+		retstat = pfs_rename(path, newpath);
+	}
+	if(retstat == 0){
+		inodeMove(parent, name, newparent, newname);
+	}
+	fuse_reply_err(req, -retstat);
+}
+
+static void pfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi){
+	log_msg("Entered pfs_ll_open\n");
+	//reads open beside the directory fd
+	if((fi->flags & O_ACCMODE) == O_RDONLY && !(fi->flags & O_TRUNC)){
+		unsigned long dir;
+		char name[NAME_MAX + 1];
+		int fd = inodeAt(ino, &dir, name);
+		if(fd >= 0){
+			int ffd = openat(fd, name, fi->flags);
+			inodeRelease(dir);
+			if(ffd >= 0){
+				fi->fh = (uintptr_t) pfs_handle_new(ffd);
+				fuse_reply_open(req, fi);
+				return;
+			}
+		}
+	}
+	//writers need the replicas and the index, and a read the master can't
+	//serve may fail over
+	char path[PATH_MAX];
+	int retstat = inodePath(ino, NULL, path) == 0 ? pfs_open(path, fi) : -errno;
+	if(retstat < 0){
+		fuse_reply_err(req, -retstat);
+	}
+	else{
+		fuse_reply_open(req, fi);
+	}
+}
+
+static void pfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi){
+	log_msg("Entered pfs_ll_read\n");
+	char* buf = malloc(size);
+	if(buf == NULL){
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	int retstat = pfs_read_handle(PFS_HANDLE(fi), buf, size, off);
+	if(retstat < 0 && pfs_failover_error(-retstat)){
+		char path[PATH_MAX];
+		if(inodePath(ino, NULL, path) == 0){
+			retstat = pfs_read_replicas(path, buf, size, off, retstat);
+		}
+	}
+	if(retstat < 0){
+		fuse_reply_err(req, -retstat);
+	}
+	else{
+		fuse_reply_buf(req, buf, retstat);
+	}
+	free(buf);
+}
+
+static void pfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char* buf, size_t size, off_t off,
+				struct fuse_file_info* fi){
+	log_msg("Entered pfs_ll_write\n");
+	int retstat = pfs_write_handle(PFS_HANDLE(fi), buf, size, off);
+	if(retstat < 0){
+		fuse_reply_err(req, -retstat);
+	}
+	else{
+		fuse_reply_write(req, retstat);
+	}
+}
+
+static void pfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi){
+	pfs_coalesce_flush(PFS_HANDLE(fi));
+	fuse_reply_err(req, 0);
+}
+
+static void pfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi){
+	char path[PATH_MAX];
+	pfs_release(inodePath(ino, NULL, path) == 0 ? path : NULL, fi);
+	fuse_reply_err(req, 0);
+}
+
+static void pfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi){
+	//goes by the handle alone
+	int retstat = pfs_fsync(NULL, datasync, fi);
+	fuse_reply_err(req, retstat < 0 ? -retstat : 0);
+}
+
+static void pfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi){
+	log_msg("Entered pfs_ll_opendir\n");
+	unsigned long dir;
+	char name[NAME_MAX + 1];
+	DIR* dp = NULL;
+	int retstat = 0;
+	int fd = inodeAt(ino, &dir, name);
+	if(fd < 0){
+		retstat = -errno;
+	}
+	else{
+		int dfd = openat(fd, name, O_RDONLY | O_DIRECTORY);
+		if(dfd < 0 || (dp = fdopendir(dfd)) == NULL){
+			retstat = -errno;
+			if(dfd >= 0) close(dfd);
+		}
+		inodeRelease(dir);
+	}
+	if(retstat < 0){
+		fuse_reply_err(req, -retstat);
+		return;
+	}
+	struct pfs_dir* d = calloc(1,sizeof(struct pfs_dir));
+	d->dp = dp;
+	fi->fh = (uintptr_t) d;
+	fuse_reply_open(req, fi);
+}
+
+//  As much of the master's listing from off on as fits in size.  Entries
+//  carry their type only; the kernel looks a name up before it's used.
+static void pfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi){
+	log_msg("Entered pfs_ll_readdir\n");
+	struct pfs_dir* d = PFS_DIR(fi);
+	struct dirent* de;
+	size_t used = 0;
+	char* buf = malloc(size);
+	if(buf == NULL){
+		fuse_reply_err(req, ENOMEM);
+		return;
+	}
+	if(off == 0){
+		rewinddir(d->dp);
+	}
+	else{
+		seekdir(d->dp, off);
+	}
+	
+	errno = 0;
+	while((de = readdir(d->dp)) != NULL){
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		st.st_ino = de->d_ino;
+#ifdef _DIRENT_HAVE_D_TYPE
+		st.st_mode = de->d_type << 12;
+#endif
+		size_t len = fuse_add_direntry(req, buf + used, size - used, de->d_name, &st, telldir(d->dp));
+		if(len > size - used){
+			break;
+		}
+		used += len;
+		errno = 0;
+	}
+	if(de == NULL && errno != 0 && used == 0){
+		fuse_reply_err(req, errno);
+	}
+	else{
+		fuse_reply_buf(req, buf, used);
+	}
+	free(buf);
+}
+
+static void pfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi){
+	closedir(PFS_DIR(fi)->dp);
+	free(PFS_DIR(fi));
+	fuse_reply_err(req, 0);
+}
+
+static void pfs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info* fi){
+	fuse_reply_err(req, 0);
+}
+
+static void pfs_ll_statfs(fuse_req_t req, fuse_ino_t ino){
+	struct statvfs statv;
+	int retstat = pfs_statfs("/", &statv);
+	if(retstat < 0){
+		fuse_reply_err(req, -retstat);
+	}
+	else{
+		fuse_reply_statfs(req, &statv);
+	}
+}
+
+static void pfs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask){
+	unsigned long dir;
+	char name[NAME_MAX + 1];
+	int retstat;
+	int fd = inodeAt(ino, &dir, name);
+	if(fd < 0){
+		retstat = -errno;
+	}
+	else{
+		retstat = faccessat(fd, name, mask, 0) == 0 ? 0 : -errno;
+		inodeRelease(dir);
+	}
+	fuse_reply_err(req, -retstat);
+}
+
+static void pfs_ll_create(fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode,
+				struct fuse_file_info* fi){
+	char path[PATH_MAX];
+	int retstat = inodePath(parent, name, path) == 0 ? pfs_create(path, mode, fi) : -errno;
+	if(retstat == 0){
+		retstat = pfs_ll_entry(req, parent, name, fi);
+		if(retstat < 0){
+			pfs_release(path, fi);
+		}
+	}
+	if(retstat < 0){
+		fuse_reply_err(req, -retstat);
+	}
+}
+
+#ifdef HAVE_SYS_XATTR_H
+static void pfs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char* name, const char* value,
+				size_t size, int flags){
+	char path[PATH_MAX];
+	int retstat = inodePath(ino, NULL, path) == 0 ? pfs_setxattr(path, name, value, size, flags) : -errno;
+	fuse_reply_err(req, -retstat);
+}
+
+//  size 0 asks how big the answer is
+static void pfs_ll_xattr_reply(fuse_req_t req, const char* buf, size_t size, int retstat){
+	if(retstat < 0){
+		fuse_reply_err(req, -retstat);
+	}
+	else if(size == 0){
+		fuse_reply_xattr(req, retstat);
+	}
+	else{
+		fuse_reply_buf(req, buf, retstat);
+	}
+}
+
+static void pfs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char* name, size_t size){
+	char path[PATH_MAX];
+	char* buf = size > 0 ? malloc(size) : NULL;
+	int retstat = inodePath(ino, NULL, path) == 0 ? pfs_getxattr(path, name, buf, size) : -errno;
+	pfs_ll_xattr_reply(req, buf, size, retstat);
+	free(buf);
+}
+
+static void pfs_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size){
+	char path[PATH_MAX];
+	char* buf = size > 0 ? malloc(size) : NULL;
+	int retstat = inodePath(ino, NULL, path) == 0 ? pfs_listxattr(path, buf, size) : -errno;
+	pfs_ll_xattr_reply(req, buf, size, retstat);
+	free(buf);
+}
+
+static void pfs_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char* name){
+	char path[PATH_MAX];
+	int retstat = inodePath(ino, NULL, path) == 0 ? pfs_removexattr(path, name) : -errno;
+	fuse_reply_err(req, -retstat);
+}
+#endif
+
+struct fuse_lowlevel_ops pfs_ll_oper = {
+  .init = pfs_ll_init,
+  .destroy = pfs_ll_destroy,
+  .lookup = pfs_ll_lookup,
+  .forget = pfs_ll_forget,
+  .getattr = pfs_ll_getattr,
+  .setattr = pfs_ll_setattr,
+  .readlink = pfs_ll_readlink,
+  .mknod = pfs_ll_mknod,
+  .mkdir = pfs_ll_mkdir,
+  .unlink = pfs_ll_unlink,
+  .rmdir = pfs_ll_rmdir,
+  .symlink = pfs_ll_symlink,
+  .rename = pfs_ll_rename,
+  .link = pfs_ll_link,
+  .open = pfs_ll_open,
+  .read = pfs_ll_read,
+  .write = pfs_ll_write,
+  .flush = pfs_ll_flush,
+  .release = pfs_ll_release,
+  .fsync = pfs_ll_fsync,
+  .opendir = pfs_ll_opendir,
+  .readdir = pfs_ll_readdir,
+  .releasedir = pfs_ll_releasedir,
+  .fsyncdir = pfs_ll_fsyncdir,
+  .statfs = pfs_ll_statfs,
+  
+#ifdef HAVE_SYS_XATTR_H
+  .setxattr = pfs_ll_setxattr,
+  .getxattr = pfs_ll_getxattr,
+  .listxattr = pfs_ll_listxattr,
+  .removexattr = pfs_ll_removexattr,
+#endif
+  
+  .access = pfs_ll_access,
+  .create = pfs_ll_create
+};
+
+//  Mount and serve through pfs_ll_oper until unmounted; what fuse_main
+//  does for the path frontend
+static int pfs_ll_main(char* mountpoint, struct state* data){
+	char* argv[2] = { "./pfs", mountpoint };
+	struct fuse_args args = FUSE_ARGS_INIT(2, argv);
+	char* mount = NULL;
+	int multithreaded, foreground;
+	int err = -1;
+	
+	if(inodeInit(data->rootdir) < 0){
+		fprintf(stderr,"Could not open %s\n",data->rootdir);
+		return 1;
+	}
+	//every directory the kernel holds on to keeps an fd open
+	struct rlimit fds;
+	if(getrlimit(RLIMIT_NOFILE, &fds) == 0 && fds.rlim_cur < fds.rlim_max){
+		fds.rlim_cur = fds.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &fds);
+	}
+	if(fuse_parse_cmdline(&args, &mount, &multithreaded, &foreground) == 0){
+		struct fuse_chan* ch = fuse_mount(mount, &args);
+		if(ch != NULL){
+			struct fuse_session* se = fuse_lowlevel_new(&args, &pfs_ll_oper, sizeof(pfs_ll_oper), data);
+			if(se != NULL){
+				if(fuse_set_signal_handlers(se) == 0){
+					fuse_session_add_chan(se, ch);
+					fuse_daemonize(foreground);
+					err = fuse_session_loop_mt(se);
+					fuse_remove_signal_handlers(se);
+					fuse_session_remove_chan(ch);
+				}
+				fuse_session_destroy(se);
+			}
+			fuse_unmount(mount, ch);
+		}
+		free(mount);
+	}
+	fuse_opt_free_args(&args);
+	inodeDestroy();
+	return err ? 1 : 0;
+}
+
+static void pfs_usage(){
+	fprintf(stderr, "usage: pfs [-m numMounts] [-v vnodes] [-H hash] [-t threads]\n           [-n N] [-r R] [-w W] [-W sync|async|drain|clone|dedup|chunk] [-Q queueMB] [-L lagMs]\n           [-U] [-C bufferKB] [-D dbconfig] [-I indexfile] [-A syncSecs]\n           [-B rebalanceMBps] [-T entry[:attr[:negative]]] [-K statCacheSecs]\n           [-F path|inode] logfileName backupMaster backupDir mountPoint\n");
+}
+
 int main(int argc, char *argv[])
 {
-	//insertImage("asdf.png");
-	if(argc < 5 || argc == 6 || argc > 7){
-		fprintf(stderr, "usage: pfs [-m numMounts] logfileName backupMaster backupDir mountPoint\n");
-		return 0;
+	struct state* data = calloc(1,sizeof(struct state));
+	pfs_data = data;
+	data->master = 0;
+	data->numMounts = 0;
+	data->vnodes = DEFAULT_VNODES;
+	data->copies = 0;
+	data->readQuorum = 1;
+	data->writeQuorum = 1;
+	data->writeMode = PFS_WRITE_SYNC;
+	data->writeBehindBytes = 64 * 1024 * 1024;
+	data->writeBehindLagMs = 2000;
+	data->antiEntropyMs = -1;
+	data->rebalanceBytes = 32 * 1024 * 1024;
+	data->entryTimeout = 1.0;
+	data->attrTimeout = 1.0;
+	data->negativeTimeout = 0.0;
+	data->attrCacheMs = 30000;
+	
+	const char* dbconfig = NULL;
+	int opt;
+	while((opt = getopt(argc, argv, "m:v:H:t:n:r:w:W:Q:L:UC:D:I:A:B:T:K:F:")) != -1){
+		switch(opt){
+			case 'm':
+				data->master = 1;
+				data->numMounts = atoi(optarg);
+				printf("NumMounts:%d\n",data->numMounts);
+				break;
+			case 'v':
+				data->vnodes = atoi(optarg);
+				break;
+			case 't':
+				data->threads = atoi(optarg);
+				break;
+			case 'n':
+				data->copies = atoi(optarg);
+				break;
+			case 'r':
+				data->readQuorum = atoi(optarg);
+				break;
+			case 'w':
+				data->writeQuorum = atoi(optarg);
+				break;
+			case 'W':
+				if(!strcmp(optarg,"sync")) data->writeMode = PFS_WRITE_SYNC;
+				else if(!strcmp(optarg,"async")) data->writeMode = PFS_WRITE_ASYNC;
+				else if(!strcmp(optarg,"drain")) data->writeMode = PFS_WRITE_DRAIN;
+				else if(!strcmp(optarg,"clone")) data->writeMode = PFS_WRITE_CLONE;
+				else if(!strcmp(optarg,"dedup")) data->writeMode = PFS_WRITE_DEDUP;
+				else if(!strcmp(optarg,"chunk")) data->writeMode = PFS_WRITE_CHUNK;
+				else{
+					pfs_usage();
+					return 0;
+				}
+				break;
+			case 'Q':
+				data->writeBehindBytes = (size_t) atol(optarg) * 1024 * 1024;
+				break;
+			case 'L':
+				data->writeBehindLagMs = atol(optarg);
+				break;
+			case 'U':
+				data->uring = 1;
+				break;
+			case 'C':
+				data->coalesceBytes = (size_t) atol(optarg) * 1024;
+				break;
+			case 'D':
+				dbconfig = optarg;
+				break;
+			case 'I':
+				data->indexFile = optarg;
+				break;
+			case 'A':
+				data->antiEntropyMs = atol(optarg) * 1000;
+				break;
+			case 'B':
+				data->rebalanceBytes = atol(optarg) * 1024 * 1024;
+				break;
+			case 'T':
+				//entry[:attr[:negative]], the later ones defaulting to the earlier
+				switch(sscanf(optarg, "%lf:%lf:%lf", &data->entryTimeout, &data->attrTimeout, &data->negativeTimeout)){
+					case 1:
+						data->attrTimeout = data->entryTimeout;
+						//fall through
+					case 2:
+						data->negativeTimeout = data->attrTimeout;
+						break;
+					case 3:
+						break;
+					default:
+						pfs_usage();
+						return 0;
+				}
+				break;
+			case 'K':
+				data->attrCacheMs = atol(optarg) * 1000;
+				break;
+			case 'F':
+				if(!strcmp(optarg,"path")) data->lowlevel = 0;
+				else if(!strcmp(optarg,"inode")) data->lowlevel = 1;
+				else{
+					pfs_usage();
+					return 0;
+				}
+				break;
+			case 'H':
+				if(setHashFunction(optarg) != 0){
+					fprintf(stderr,"Unknown hash %s, choose one of:",optarg);
+					for(const struct hashAlgorithm* algo = hashAlgorithms; algo->name != NULL; algo++){
+						fprintf(stderr," %s",algo->name);
+					}
+					fprintf(stderr,"\n");
+					return 0;
+				}
+				break;
+			default:
+				pfs_usage();
+				return 0;
+		}
 	}
 	
-	struct state* data = calloc(1,sizeof(struct state));
+	if(argc - optind != 4 || data->vnodes < 1){
+		pfs_usage();
+		return 0;
+	}
 	
-	if(argc == 7){
-		data->master = 1;
-		data->numMounts = atoi(argv[2]);
-		printf("NumMounts:%d\n",data->numMounts);
+	//by default the master plus numMounts - 2 replicas
+	if(data->copies == 0){
+		data->copies = data->numMounts > 2 ? data->numMounts - 1 : 1;
 	}
-	else{
-		data->master = 0;
-		data->numMounts = 0;
+	if(data->master == 1 && (data->copies < 1 || data->copies > data->numMounts + 1)){
+		fprintf(stderr,"N must be between 1 and numMounts + 1\n");
+		return 0;
+	}
+	if(data->readQuorum < 1 || data->readQuorum > data->copies ||
+	   data->writeQuorum < 1 || data->writeQuorum > data->copies){
+		fprintf(stderr,"R and W must be between 1 and N\n");
+		return 0;
+	}
+	if((data->writeMode != PFS_WRITE_SYNC || data->coalesceBytes > 0) && data->writeQuorum > 1){
+		fprintf(stderr,"write-behind, clone, dedup, chunk and coalescing acknowledge after the master write alone, so W must be 1\n");
+		return 0;
+	}
+	if((data->writeMode == PFS_WRITE_DEDUP || data->writeMode == PFS_WRITE_CHUNK) && data->indexFile == NULL){
+		fprintf(stderr,"dedup and chunk keep hashes and replica locations in the index, so they need -I\n");
+		return 0;
+	}
+	
+	//only the master keeps the catalog
+	if(data->master == 1 && databaseInit(dbconfig) < 0){
+		return 0;
 	}
 	
-	char* args[2];
+	//how long the kernel may keep lookups and attributes before asking again
+	char timeouts[128];
+	snprintf(timeouts, sizeof(timeouts), "entry_timeout=%g,attr_timeout=%g,negative_timeout=%g",
+		data->entryTimeout, data->attrTimeout, data->negativeTimeout);
+	char* args[4];
 	args[0] = "./pfs";
 	//args[1] = "-f";
 	args[1] = argv[argc-1];
+	args[2] = "-o";
+	args[3] = timeouts;
 	
 	data->rootdir = realpath(argv[argc-2], NULL);
 	data->backup = realpath(argv[argc-3],NULL);
 	data->logfile = log_open(argv[argc-4]);
+	//fuse_main changes to / before pfs_init opens the index
+	if(data->indexFile != NULL && data->indexFile[0] != '/'){
+		char cwd[PATH_MAX];
+		char* indexFile = malloc(2 * PATH_MAX);
+		snprintf(indexFile, 2 * PATH_MAX, "%s/%s", getcwd(cwd, PATH_MAX) != NULL ? cwd : ".", data->indexFile);
+		data->indexFile = indexFile;
+	}
 	
 	fprintf(stderr,"MountDir is: %s\n",args[1]);
 	fprintf(stderr,"Rootdir is: %s\n",data->rootdir);
 	fprintf(stderr,"Backup is: %s\n",data->backup);
+	fprintf(stderr,"Virtual nodes per drive: %d\n",data->vnodes);
+	fprintf(stderr,"Hash function: %s\n",getHashFunction());
+	fprintf(stderr,"N=%d R=%d W=%d\n",data->copies,data->readQuorum,data->writeQuorum);
+	fprintf(stderr,"Catalog: %s\n",dbconfig != NULL ? dbconfig : "off");
+	fprintf(stderr,"Index: %s\n",data->indexFile != NULL ? data->indexFile : "off");
+	fprintf(stderr,"Kernel timeouts: %s\n",timeouts);
+	fprintf(stderr,"Frontend: %s\n",data->lowlevel ? "inode" : "path");
 	printf("Argc:%d\n",argc);
-	for(int i = 0; i < 2; i++){
+	for(int i = 0; i < 4; i++){
 		printf("Args[%d]:%s\n",i,args[i]);
 	}
 	//exit(0);
+	if(data->lowlevel){
+		//the timeouts go out with each reply rather than as mount options
+		return pfs_ll_main(args[1], data);
+	}
 	fprintf(stderr,"About to call fuse_main\n");
-	return fuse_main(2,args,&pfs_oper,data);
+	return fuse_main(4,args,&pfs_oper,data);
 	
 }
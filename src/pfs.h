@@ -6,35 +6,53 @@
 // writing, the most current API version is 26
 #define FUSE_USE_VERSION 26
 
-// need this to get pwrite().  I have to use setvbuf() instead of
-// setlinebuf() later in consequence.
-#define _XOPEN_SOURCE 500
+// need this to get pwrite(), futimens() and the st_mtim fields.  I have
+// to use setvbuf() instead of setlinebuf() later in consequence.
+#define _XOPEN_SOURCE 700
 
 // maintain pfs state in here
 #include <limits.h>
 #include <stdio.h>
 #include <fuse.h>
+// entries in the daemon's stat cache
+#define PFS_ATTR_CACHE_ENTRIES 65536
+
+// how replica updates made through an open file are applied
+#define PFS_WRITE_SYNC 0    // before the call returns
+#define PFS_WRITE_ASYNC 1   // queued behind the master write; fsync/release don't wait
+#define PFS_WRITE_DRAIN 2   // queued, but fsync/release wait for the queue to drain
+#define PFS_WRITE_CLONE 3   // master only; release clones the replicas from it
+#define PFS_WRITE_DEDUP 4   // as clone, but replicas link to shared content objects
+#define PFS_WRITE_CHUNK 5   // as clone, but only chunks the replicas lack are sent
+
 struct state {
     FILE *logfile;
     char *rootdir;
     int numMounts;
     int master;
     char* backup;
+    int vnodes;
+    int threads;
+    int copies;         // N: master plus replicas
+    int readQuorum;     // R: copies consulted by getattr
+    int writeQuorum;    // W: copies that must take a change
+    int writeMode;
+    size_t writeBehindBytes;
+    long writeBehindLagMs;
+    int uring;          // data path through io_uring
+    size_t coalesceBytes;   // per handle replica write buffer, 0 for none
+    char* indexFile;    // local metadata index, NULL for none
+    long antiEntropyMs; // full anti-entropy pass interval; 0 only after failures, -1 off
+    long rebalanceBytes;    // bytes a second moved after a ring change, 0 for no limit
+    double entryTimeout;    // seconds the kernel keeps a lookup
+    double attrTimeout;     // seconds the kernel keeps attributes
+    double negativeTimeout; // seconds the kernel remembers a path doesn't exist
+    long attrCacheMs;       // how long the daemon's stat cache keeps an entry, 0 for off
+    int lowlevel;           // inode based low-level frontend instead of the path one
 };
 
 //hash function stuff
-unsigned long hashFunction(char *str);
-void addNode(char *mount);
-void removeNode(char *mount);
-struct node *search(char *key);
-void printList();
-int getSize();
-struct node
-{
-    unsigned long hash;
-    char *mount;
-    struct node *next;
-};
+#include "hash.h"
 
 //database stuff
 #include <mysql/mysql.h>
@@ -47,10 +65,16 @@ struct node
 int deleteImage(char path[]);
 int updatePath( char newPath[], char oldPath[]);
 int insertImage(char path[]);
+int databaseInit(const char* path);
+int databaseStart();
+void databaseDestroy();
 
 
 int mapNameToDrives(const char* path);
 struct fuse *setup_common(int argc, char *argv[],const struct fuse_operations *op,size_t op_size,char **mountpoint,int *multithreaded,int *fd, void *user_data,int compat);
-#define PRI_DATA ((struct state *) fuse_get_context()->private_data)
+// set once in main.  The low-level frontend has no fuse context to carry
+// it, and neither do the background threads.
+extern struct state* pfs_data;
+#define PRI_DATA pfs_data
 
 #endif
@@ -0,0 +1,156 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+struct batch
+{
+    pool_task task;
+    void *arg;
+    int *results;
+    int remaining;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+};
+
+struct job
+{
+    struct batch *batch;
+    int index;
+    struct job *next;
+};
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWork = PTHREAD_COND_INITIALIZER;
+static struct job *head = NULL;
+static struct job *tail = NULL;
+static pthread_t *threads = NULL;
+static int numThreads = 0;
+static int stopping = 0;
+
+static void runJob(struct job *j)
+{
+    struct batch *b = j->batch;
+    int result = b->task(j->index, b->arg);
+    if (b->results != NULL)
+        b->results[j->index] = result;
+
+    pthread_mutex_lock(&b->lock);
+    if (--b->remaining == 0)
+        pthread_cond_signal(&b->done);
+    pthread_mutex_unlock(&b->lock);
+}
+
+static void *worker(void *unused)
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&poolLock);
+        while (head == NULL && !stopping)
+            pthread_cond_wait(&poolWork, &poolLock);
+        if (head == NULL)
+        {
+            pthread_mutex_unlock(&poolLock);
+            return NULL;
+        }
+        struct job *j = head;
+        head = j->next;
+        if (head == NULL)
+            tail = NULL;
+        pthread_mutex_unlock(&poolLock);
+
+        runJob(j);
+    }
+}
+
+int poolInit(int n)
+{
+    int i;
+    if (numThreads > 0 || n <= 0)
+        return 0;
+
+    threads = calloc(n, sizeof(pthread_t));
+    if (threads == NULL)
+        return -1;
+    stopping = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+            break;
+    }
+    numThreads = i;
+    return numThreads > 0 ? 0 : -1;
+}
+
+// run task(0..n-1, arg) concurrently and store each return value in
+// results (if not NULL).  Without a pool the tasks just run in order.
+void poolRun(int n, pool_task task, void *arg, int *results)
+{
+    int i;
+    if (n <= 0)
+        return;
+
+    if (numThreads == 0 || n == 1)
+    {
+        for (i = 0; i < n; i++)
+        {
+            int result = task(i, arg);
+            if (results != NULL)
+                results[i] = result;
+        }
+        return;
+    }
+
+    struct batch b;
+    struct job jobs[n];
+    b.task = task;
+    b.arg = arg;
+    b.results = results;
+    b.remaining = n;
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.done, NULL);
+
+    for (i = 0; i < n; i++)
+    {
+        jobs[i].batch = &b;
+        jobs[i].index = i;
+        jobs[i].next = NULL;
+    }
+
+    pthread_mutex_lock(&poolLock);
+    for (i = 1; i < n; i++)
+    {
+        if (tail == NULL)
+            head = &jobs[i];
+        else
+            tail->next = &jobs[i];
+        tail = &jobs[i];
+    }
+    pthread_cond_broadcast(&poolWork);
+    pthread_mutex_unlock(&poolLock);
+
+    runJob(&jobs[0]);
+
+    pthread_mutex_lock(&b.lock);
+    while (b.remaining > 0)
+        pthread_cond_wait(&b.done, &b.lock);
+    pthread_mutex_unlock(&b.lock);
+
+    pthread_mutex_destroy(&b.lock);
+    pthread_cond_destroy(&b.done);
+}
+
+void poolDestroy()
+{
+    int i;
+    pthread_mutex_lock(&poolLock);
+    stopping = 1;
+    pthread_cond_broadcast(&poolWork);
+    pthread_mutex_unlock(&poolLock);
+
+    for (i = 0; i < numThreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    threads = NULL;
+    numThreads = 0;
+}
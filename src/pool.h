@@ -0,0 +1,14 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+// fixed pool of worker threads.  poolRun() hands out a batch of
+// independent tasks, runs the first one on the calling thread and
+// returns once every task has finished, so the batch takes as long as
+// its slowest task rather than the sum of them.
+typedef int (*pool_task)(int i, void *arg);
+
+int poolInit(int numThreads);
+void poolRun(int n, pool_task task, void *arg, int *results);
+void poolDestroy();
+
+#endif
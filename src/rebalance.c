@@ -0,0 +1,589 @@
+// need this for pthread_cond_timedwait() and clock_gettime() under -std=c99
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hash.h"
+#include "log.h"
+#include "rebalance.h"
+
+#define RING_FILE ".pfs-ring"
+
+// enough of a ring to place paths with: tokens sorted, and the drive
+// each one belongs to
+struct rb_ring
+{
+    const struct hashAlgorithm *hash;
+    int numDrives;
+    int replicas;
+    int size;
+    unsigned long *tokens;
+    int *drives;
+};
+
+struct rb_entry
+{
+    char *path;
+    unsigned long key;
+    struct stat st;
+};
+
+struct rb_entries
+{
+    struct rb_entry *entries;
+    int count;
+    int cap;
+};
+
+static char ringFile[PATH_MAX];
+static struct rb_ring before = { NULL, 0, 0, 0, NULL, NULL };
+static struct rb_ring after = { NULL, 0, 0, 0, NULL, NULL };
+static long rate = 0;
+static rb_walk walkFn = NULL;
+static rb_move moveFn = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t thread;
+static int running = 0;
+static int active = 0;              // files are still to be moved
+static unsigned long cursor = 0;    // every key below this has been moved
+static unsigned long scanned = 0;   // every key below this has been tried
+static unsigned long *failedKeys = NULL;    // keys tried whose move failed, ascending
+static int numFailed = 0;
+static int capFailed = 0;
+
+static void ringFree(struct rb_ring *r)
+{
+    free(r->tokens);
+    free(r->drives);
+    r->tokens = NULL;
+    r->drives = NULL;
+    r->size = 0;
+}
+
+static const struct hashAlgorithm *findHash(const char *name)
+{
+    const struct hashAlgorithm *algo;
+    for (algo = hashAlgorithms; algo->name != NULL; algo++)
+    {
+        if (strcmp(algo->name, name) == 0)
+            return algo;
+    }
+    return NULL;
+}
+
+// the drive owning key: the first token above it, wrapping round
+static int owner(const struct rb_ring *r, unsigned long key)
+{
+    int lo = 0;
+    int hi = r->size;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (r->tokens[mid] <= key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return r->drives[lo == r->size ? 0 : lo];
+}
+
+// the drives r puts the replicas of path on, the way pfs does: the
+// owner and the ones after it
+static int placement(const struct rb_ring *r, const char *path, int *drives)
+{
+    if (r->size == 0 || r->replicas <= 0)
+        return 0;
+    int first = owner(r, r->hash->fn(path, strlen(path)));
+    int n = r->replicas < r->numDrives ? r->replicas : r->numDrives;
+    int i;
+    for (i = 0; i < n; i++)
+        drives[i] = (first + i) % r->numDrives;
+    return n;
+}
+
+static int sameDrives(const int *a, int na, const int *b, int nb)
+{
+    int i;
+    int j;
+    if (na != nb)
+        return 0;
+    for (i = 0; i < na; i++)
+    {
+        for (j = 0; j < nb && b[j] != a[i]; j++)
+            ;
+        if (j == nb)
+            return 0;
+    }
+    return 1;
+}
+
+// the live ring as it stands
+static int snapshot(struct rb_ring *r, int numDrives, int replicas)
+{
+    const struct ring *live = ringReadLock();
+    int i;
+    r->hash = findHash(getHashFunction());
+    r->numDrives = numDrives;
+    r->replicas = replicas;
+    r->size = live->size;
+    r->tokens = malloc((live->size > 0 ? live->size : 1) * sizeof(unsigned long));
+    r->drives = malloc((live->size > 0 ? live->size : 1) * sizeof(int));
+    if (r->tokens == NULL || r->drives == NULL)
+    {
+        ringReadUnlock();
+        ringFree(r);
+        return -1;
+    }
+    for (i = 0; i < live->size; i++)
+    {
+        r->tokens[i] = live->tokens[i];
+        r->drives[i] = live->nodes[i].drive;
+    }
+    ringReadUnlock();
+    return 0;
+}
+
+// pfs-ring <hash> <drives> <replicas> <tokens>, then a token and its
+// drive per line
+static int ringLoad(struct rb_ring *r)
+{
+    char name[64];
+    int i;
+    FILE *f = fopen(ringFile, "r");
+    if (f == NULL)
+        return -1;
+    if (fscanf(f, "pfs-ring %63s %d %d %d", name, &r->numDrives, &r->replicas, &r->size) != 4 ||
+        (r->hash = findHash(name)) == NULL || r->size <= 0 || r->numDrives <= 0)
+    {
+        log_msg("ERROR rebalance: %s is not a ring, ignoring it\n", ringFile);
+        fclose(f);
+        r->size = 0;
+        return -1;
+    }
+    r->tokens = malloc((r->size > 0 ? r->size : 1) * sizeof(unsigned long));
+    r->drives = malloc((r->size > 0 ? r->size : 1) * sizeof(int));
+    for (i = 0; r->tokens != NULL && r->drives != NULL && i < r->size; i++)
+    {
+        if (fscanf(f, "%lu %d", &r->tokens[i], &r->drives[i]) != 2)
+            break;
+    }
+    fclose(f);
+    if (r->tokens == NULL || r->drives == NULL || i < r->size)
+    {
+        log_msg("ERROR rebalance: %s is cut short, ignoring it\n", ringFile);
+        ringFree(r);
+        return -1;
+    }
+    return 0;
+}
+
+static int ringEqual(const struct rb_ring *a, const struct rb_ring *b)
+{
+    return a->hash == b->hash && a->numDrives == b->numDrives && a->replicas == b->replicas &&
+           a->size == b->size && memcmp(a->tokens, b->tokens, a->size * sizeof(unsigned long)) == 0 &&
+           memcmp(a->drives, b->drives, a->size * sizeof(int)) == 0;
+}
+
+static int ringSave(const struct rb_ring *r)
+{
+    char tmp[PATH_MAX + 8];
+    int i;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", ringFile);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL)
+        return -1;
+    fprintf(f, "pfs-ring %s %d %d %d\n", r->hash->name, r->numDrives, r->replicas, r->size);
+    for (i = 0; i < r->size; i++)
+        fprintf(f, "%lu %d\n", r->tokens[i], r->drives[i]);
+    if (fflush(f) != 0 || fdatasync(fileno(f)) != 0 || fclose(f) != 0 || rename(tmp, ringFile) != 0)
+    {
+        log_msg("ERROR rebalance: could not save the ring to %s\n", ringFile);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// Log the key ranges whose replicas changed drives.  Placement only
+// changes at a token of either ring, so each stretch between adjacent
+// tokens moves as a whole.  With another hash every key moves.
+static void logRanges()
+{
+    if (before.hash != after.hash)
+    {
+        log_msg("rebalance: the hash changed from %s to %s, every key range moves\n",
+                before.hash->name, after.hash->name);
+        return;
+    }
+    int total = before.size + after.size;
+    unsigned long *bounds = malloc((total > 0 ? total : 1) * sizeof(unsigned long));
+    if (bounds == NULL)
+        return;
+    int i = 0;
+    int j = 0;
+    int n = 0;
+    while (i < before.size || j < after.size)
+    {
+        unsigned long next;
+        if (j == after.size || (i < before.size && before.tokens[i] < after.tokens[j]))
+            next = before.tokens[i++];
+        else
+            next = after.tokens[j++];
+        if (n == 0 || bounds[n - 1] != next)
+            bounds[n++] = next;
+    }
+
+    int moved = 0;
+    double share = 0;
+    int a[before.replicas > 0 ? before.replicas : 1];
+    int b[after.replicas > 0 ? after.replicas : 1];
+    for (i = 0; i < n; i++)
+    {
+        unsigned long start = bounds[i];
+        unsigned long end = bounds[(i + 1) % n];
+        int first = owner(&before, start);
+        int na = before.replicas < before.numDrives ? before.replicas : before.numDrives;
+        for (j = 0; j < na; j++)
+            a[j] = (first + j) % before.numDrives;
+        first = owner(&after, start);
+        int nb = after.replicas < after.numDrives ? after.replicas : after.numDrives;
+        for (j = 0; j < nb; j++)
+            b[j] = (first + j) % after.numDrives;
+        if (!sameDrives(a, na, b, nb))
+        {
+            moved++;
+            // end - start wraps round for the last stretch
+            share += (n == 1 ? 18446744073709551615.0 : (double) (end - start)) / 18446744073709551616.0;
+        }
+    }
+    free(bounds);
+    log_msg("rebalance: %d of %d key ranges, %.2f%% of the key space, change drives\n",
+            moved, n, share * 100);
+}
+
+static void collect(void *ctx, const char *path, const struct stat *st)
+{
+    struct rb_entries *e = ctx;
+    int from[before.replicas > 0 ? before.replicas : 1];
+    int to[after.replicas > 0 ? after.replicas : 1];
+    if (sameDrives(from, placement(&before, path, from), to, placement(&after, path, to)))
+        return;
+    if (e->count == e->cap)
+    {
+        int cap = e->cap > 0 ? 2 * e->cap : 1024;
+        struct rb_entry *more = realloc(e->entries, cap * sizeof(struct rb_entry));
+        if (more == NULL)
+            return;
+        e->entries = more;
+        e->cap = cap;
+    }
+    struct rb_entry *entry = &e->entries[e->count];
+    entry->path = strdup(path);
+    if (entry->path == NULL)
+        return;
+    entry->key = hashFunction(path);
+    entry->st = *st;
+    e->count++;
+}
+
+// key order, with parents before children where keys tie
+static int entryCompare(const void *a, const void *b)
+{
+    const struct rb_entry *ea = a;
+    const struct rb_entry *eb = b;
+    if (ea->key != eb->key)
+        return ea->key < eb->key ? -1 : 1;
+    return strcmp(ea->path, eb->path);
+}
+
+static long long nowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// hold the thread back until bytes more fit under the rate.  Caller
+// holds lock; returns 0 if stopped meanwhile.
+static int throttle(long long *next, long long bytes)
+{
+    if (rate <= 0)
+        return running;
+    *next += bytes * 1000000000LL / rate;
+    long long now = nowNs();
+    if (*next < now)
+        *next = now;
+    while (running && *next > nowNs())
+    {
+        struct timespec until;
+        long long wait = *next - nowNs();
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += wait / 1000000000LL;
+        until.tv_nsec += wait % 1000000000LL;
+        if (until.tv_nsec >= 1000000000L)
+        {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&wake, &lock, &until);
+    }
+    return running;
+}
+
+// where key is or would go in failedKeys.  Caller holds lock.
+static int findFailed(unsigned long key)
+{
+    int lo = 0;
+    int hi = numFailed;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (failedKeys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// has a move of a path with key failed?  Caller holds lock.
+static int hasFailed(unsigned long key)
+{
+    int i = findFailed(key);
+    return i < numFailed && failedKeys[i] == key;
+}
+
+// Caller holds lock.
+static void removeFailed(unsigned long key)
+{
+    int i = findFailed(key);
+    if (i == numFailed || failedKeys[i] != key)
+        return;
+    memmove(&failedKeys[i], &failedKeys[i + 1], (numFailed - i - 1) * sizeof(unsigned long));
+    numFailed--;
+}
+
+// keys come in ascending order.  Caller holds lock.
+static void addFailed(unsigned long key)
+{
+    if (numFailed > 0 && failedKeys[numFailed - 1] == key)
+        return;
+    if (numFailed == capFailed)
+    {
+        int cap = capFailed > 0 ? 2 * capFailed : 64;
+        unsigned long *more = realloc(failedKeys, cap * sizeof(unsigned long));
+        if (more == NULL)
+            return;
+        failedKeys = more;
+        capFailed = cap;
+    }
+    failedKeys[numFailed++] = key;
+}
+
+// Move one entry and account for it.  Caller holds lock; returns 0 if
+// stopped meanwhile.
+static int moveEntry(struct rb_entry *entry, long long *next, int *res)
+{
+    int from[before.replicas > 0 ? before.replicas : 1];
+    int to[after.replicas > 0 ? after.replicas : 1];
+    int numFrom = placement(&before, entry->path, from);
+    int numTo = placement(&after, entry->path, to);
+    long long size = S_ISREG(entry->st.st_mode) ? entry->st.st_size : 0;
+    if (!throttle(next, size))
+        return 0;
+
+    pthread_mutex_unlock(&lock);
+    *res = moveFn(entry->path, &entry->st, from, numFrom, to, numTo);
+    pthread_mutex_lock(&lock);
+    if (*res < 0)
+        log_msg("ERROR rebalance: could not move %s\n", entry->path);
+    return 1;
+}
+
+static void *rbThread(void *arg)
+{
+    struct rb_entries e = { NULL, 0, 0 };
+    long long bytes = 0;
+    long long totalBytes = 0;
+    long long next = nowNs();
+    long long lastReport = next;
+    int moved = 0;
+    int failed = 0;
+    int i;
+
+    walkFn(collect, &e);
+    qsort(e.entries, e.count, sizeof(struct rb_entry), entryCompare);
+    for (i = 0; i < e.count; i++)
+    {
+        if (S_ISREG(e.entries[i].st.st_mode))
+            totalBytes += e.entries[i].st.st_size;
+    }
+    log_msg("rebalance: %d files, %lld bytes to move\n", e.count, totalBytes);
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < e.count && running; i++)
+    {
+        struct rb_entry *entry = &e.entries[i];
+        int res;
+        if (!moveEntry(entry, &next, &res))
+            break;
+        if (res < 0)
+        {
+            // reads of it stay on the old drives
+            addFailed(entry->key);
+            failed++;
+        }
+        else
+            moved++;
+        bytes += S_ISREG(entry->st.st_mode) ? entry->st.st_size : 0;
+        // reads of it go to the new drives from here on, and of
+        // everything before it once nothing has failed
+        if (entry->key == (unsigned long) -1)
+            scanned = (unsigned long) -1;
+        else if (entry->key + 1 > scanned)
+            scanned = entry->key + 1;
+        if (numFailed == 0)
+            __atomic_store_n(&cursor, scanned, __ATOMIC_RELEASE);
+
+        long long now = nowNs();
+        if (now - lastReport >= 1000000000LL)
+        {
+            log_msg("rebalance: %d of %d files, %lld of %lld bytes (%.0f%%)\n", i + 1, e.count,
+                    bytes, totalBytes, totalBytes > 0 ? 100.0 * bytes / totalBytes : 100.0);
+            lastReport = now;
+        }
+    }
+    // one more go at the ones that failed, say on a drive that was away
+    if (i == e.count && numFailed > 0)
+    {
+        log_msg("rebalance: retrying %d failed files\n", failed);
+        for (i = 0; i < e.count && running; i++)
+        {
+            struct rb_entry *entry = &e.entries[i];
+            int res;
+            if (!hasFailed(entry->key))
+                continue;
+            if (!moveEntry(entry, &next, &res))
+                break;
+            if (res == 0)
+            {
+                removeFailed(entry->key);
+                moved++;
+                failed--;
+            }
+        }
+        if (numFailed == 0)
+            __atomic_store_n(&cursor, scanned, __ATOMIC_RELEASE);
+    }
+    int finished = i == e.count && failed == 0;
+    if (finished)
+        __atomic_store_n(&active, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < e.count; i++)
+        free(e.entries[i].path);
+    free(e.entries);
+
+    if (finished)
+    {
+        // the drives match the new ring now
+        ringSave(&after);
+        log_msg("rebalance: done, %d files moved\n", moved);
+    }
+    else
+        log_msg("rebalance: stopped with %d files moved and %d failed; the next mount carries on\n",
+                moved, failed);
+    return NULL;
+}
+
+// Compare the ring pfs was mounted with to the one the drives were laid
+// out for and, if they differ, start moving files to match
+int rbInit(const char *backup, int numDrives, int replicas, long bytesPerSec, rb_walk walk, rb_move move)
+{
+    snprintf(ringFile, PATH_MAX, "%s/" RING_FILE, backup);
+    rate = bytesPerSec;
+    walkFn = walk;
+    moveFn = move;
+    if (snapshot(&after, numDrives, replicas) < 0)
+        return -1;
+    if (ringLoad(&before) < 0)
+    {
+        // nothing to compare with: take the drives as laid out for this one
+        int res = access(ringFile, F_OK) == 0 ? -1 : ringSave(&after);
+        ringFree(&after);
+        return res;
+    }
+    if (ringEqual(&before, &after))
+    {
+        ringFree(&before);
+        ringFree(&after);
+        return 0;
+    }
+
+    logRanges();
+    cursor = 0;
+    scanned = 0;
+    active = 1;
+    running = 1;
+    if (pthread_create(&thread, NULL, rbThread, NULL) != 0)
+    {
+        running = 0;
+        active = 0;
+        ringFree(&before);
+        ringFree(&after);
+        return -1;
+    }
+    return 0;
+}
+
+// Where to read path from while it waits to be moved: fills drives with
+// its old replica drives and returns how many, or 0 if it is where the
+// ring says
+int rbOldDrives(const char *path, int *drives, int max)
+{
+    if (!__atomic_load_n(&active, __ATOMIC_ACQUIRE) || max <= 0)
+        return 0;
+    unsigned long key = hashFunction(path);
+    if (key < __atomic_load_n(&cursor, __ATOMIC_ACQUIRE))
+        return 0;
+    // past the cursor, the keys tried that didn't fail have been moved
+    pthread_mutex_lock(&lock);
+    int moved = key < scanned && !hasFailed(key);
+    pthread_mutex_unlock(&lock);
+    if (moved)
+        return 0;
+    int from[before.replicas > 0 ? before.replicas : 1];
+    int to[after.replicas > 0 ? after.replicas : 1];
+    int numFrom = placement(&before, path, from);
+    if (sameDrives(from, numFrom, to, placement(&after, path, to)))
+        return 0;
+    if (numFrom > max)
+        numFrom = max;
+    memcpy(drives, from, numFrom * sizeof(int));
+    return numFrom;
+}
+
+void rbDestroy()
+{
+    if (!running)
+        return;
+    pthread_mutex_lock(&lock);
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    __atomic_store_n(&active, 0, __ATOMIC_RELEASE);
+    ringFree(&before);
+    ringFree(&after);
+    free(failedKeys);
+    failedKeys = NULL;
+    numFailed = capFailed = 0;
+}
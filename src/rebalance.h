@@ -0,0 +1,25 @@
+#ifndef _REBALANCE_H_
+#define _REBALANCE_H_
+
+#include <sys/stat.h>
+
+// rebalancing.  The ring is saved next to the drives once the files on
+// them match it.  When a mount comes up with a different ring (drives
+// added or removed, reweighted, another hash or replica count), the key
+// ranges whose drives changed are worked out and a background thread
+// moves just the files in them, in key order and at no more than
+// bytesPerSec.  Until a file has been moved its old drives are still the
+// ones to read it from.
+typedef void (*rb_emit)(void *ctx, const char *path, const struct stat *st);
+// call emit for every path on the master, parents before children
+typedef void (*rb_walk)(rb_emit emit, void *ctx);
+// copy path, whose master copy is st, onto the drives in to and drop it
+// from those in from that aren't; 0 or -1
+typedef int (*rb_move)(const char *path, const struct stat *st, const int *from, int numFrom,
+                       const int *to, int numTo);
+
+int rbInit(const char *backup, int numDrives, int replicas, long bytesPerSec, rb_walk walk, rb_move move);
+int rbOldDrives(const char *path, int *drives, int max);
+void rbDestroy();
+
+#endif
@@ -56,7 +56,8 @@ sub mountDrives{
 	}
 	
 	#time to execute the programs
-	my $res = `./pfs -m $numMounts pfsmaster.log ../backup/ ../backup/master/ ~/MyPFS/`;
+	my $db = -e "pfsdb.conf" ? "-D pfsdb.conf" : "";
+	my $res = `./pfs -m $numMounts $db pfsmaster.log ../backup/ ../backup/master/ ~/MyPFS/`;
 	print $res."\n";
 	
 	for(my $i = 0; $i < $numMounts; $i++){
@@ -0,0 +1,346 @@
+// need this for MAP_POPULATE and syscall()
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#define URING_ENTRIES 64
+#define URING_FILES 256         // registered file slots per ring
+#define URING_GENERATIONS 4096
+
+// one ring per thread, talking to the kernel through the raw syscalls so
+// there is no liburing dependency
+struct uring
+{
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned sqEntries;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqPtr;
+    size_t sqLen;
+    void *cqPtr;
+    size_t cqLen;
+    size_t sqesLen;
+    int registered;             // file table set up
+    int files[URING_FILES];     // fd in each registered slot, or -1
+    unsigned gens[URING_FILES]; // fdGen of that fd when it was registered
+    unsigned used[URING_FILES]; // last batch each slot was used in
+    unsigned batch;             // the batch being queued, from 1
+    int hand;                   // where to look for a slot to take next
+};
+
+static int enabled = 0;
+static pthread_key_t ringKey;
+static __thread struct uring *myRing = NULL;
+
+// bumped whenever an fd is closed, so rings re-register a reused fd
+// number instead of doing I/O on the file it used to name
+static unsigned fdGen[URING_GENERATIONS];
+
+static void ringFree(struct uring *r)
+{
+    if (r->sqes != NULL && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->sqesLen);
+    if (r->cqPtr != NULL && r->cqPtr != MAP_FAILED && r->cqPtr != r->sqPtr)
+        munmap(r->cqPtr, r->cqLen);
+    if (r->sqPtr != NULL && r->sqPtr != MAP_FAILED)
+        munmap(r->sqPtr, r->sqLen);
+    if (r->fd >= 0)
+        close(r->fd);
+    free(r);
+}
+
+static void ringDestructor(void *r)
+{
+    ringFree(r);
+}
+
+static struct uring *ringNew()
+{
+    struct io_uring_params p;
+    struct uring *r = calloc(1, sizeof(struct uring));
+    int i;
+    if (r == NULL)
+        return NULL;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (r->fd < 0)
+    {
+        free(r);
+        return NULL;
+    }
+
+    r->sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cqLen > r->sqLen)
+            r->sqLen = r->cqLen;
+        r->cqLen = r->sqLen;
+    }
+    r->sqPtr = mmap(NULL, r->sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    r->fd, IORING_OFF_SQ_RING);
+    if (r->sqPtr == MAP_FAILED)
+    {
+        ringFree(r);
+        return NULL;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cqPtr = r->sqPtr;
+    else
+        r->cqPtr = mmap(NULL, r->cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        r->fd, IORING_OFF_CQ_RING);
+    r->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->cqPtr == MAP_FAILED || r->sqes == MAP_FAILED)
+    {
+        ringFree(r);
+        return NULL;
+    }
+
+    r->sqHead = (unsigned *) ((char *) r->sqPtr + p.sq_off.head);
+    r->sqTail = (unsigned *) ((char *) r->sqPtr + p.sq_off.tail);
+    r->sqMask = (unsigned *) ((char *) r->sqPtr + p.sq_off.ring_mask);
+    r->sqArray = (unsigned *) ((char *) r->sqPtr + p.sq_off.array);
+    r->sqEntries = p.sq_entries;
+    r->cqHead = (unsigned *) ((char *) r->cqPtr + p.cq_off.head);
+    r->cqTail = (unsigned *) ((char *) r->cqPtr + p.cq_off.tail);
+    r->cqMask = (unsigned *) ((char *) r->cqPtr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cqPtr + p.cq_off.cqes);
+
+    // a sparse table; slots are filled in as fds are used
+    for (i = 0; i < URING_FILES; i++)
+        r->files[i] = -1;
+    r->registered = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES,
+                            r->files, URING_FILES) == 0;
+    return r;
+}
+
+static struct uring *getRing()
+{
+    if (myRing == NULL)
+    {
+        myRing = ringNew();
+        if (myRing != NULL)
+            pthread_setspecific(ringKey, myRing);
+    }
+    return myRing;
+}
+
+// registered slot for fd, or -1 to use the plain fd.  A slot another
+// SQE of this batch still uses is never pointed at anything else; if
+// they all are, fd goes in plain.
+static int fileSlot(struct uring *r, int fd)
+{
+    int slot;
+    int i;
+    if (!r->registered || fd < 0)
+        return -1;
+
+    unsigned gen = __atomic_load_n(&fdGen[fd % URING_GENERATIONS], __ATOMIC_ACQUIRE);
+    for (slot = 0; slot < URING_FILES; slot++)
+    {
+        if (r->files[slot] == fd && r->gens[slot] == gen)
+        {
+            r->used[slot] = r->batch;
+            return slot;
+        }
+    }
+    // an empty slot, or else the next one round not in this batch
+    for (slot = 0; slot < URING_FILES && r->files[slot] != -1; slot++)
+        ;
+    for (i = 0; slot == URING_FILES && i < URING_FILES; i++)
+    {
+        int next = (r->hand + i) % URING_FILES;
+        if (r->used[next] != r->batch)
+        {
+            slot = next;
+            r->hand = (next + 1) % URING_FILES;
+        }
+    }
+    if (slot == URING_FILES)
+        return -1;
+
+    struct io_uring_files_update update;
+    int fds[1] = { fd };
+    memset(&update, 0, sizeof(update));
+    update.offset = slot;
+    update.fds = (unsigned long) fds;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) != 1)
+    {
+        r->files[slot] = -1;
+        return -1;
+    }
+    r->files[slot] = fd;
+    r->gens[slot] = gen;
+    r->used[slot] = r->batch;
+    return slot;
+}
+
+// this thread's ring can't be trusted any more; the next call makes
+// another
+static void ringDrop(struct uring *r)
+{
+    pthread_setspecific(ringKey, NULL);
+    myRing = NULL;
+    ringFree(r);
+}
+
+// A batch is being given up on after io_uring_enter failed.  Take back
+// the SQEs the kernel hasn't consumed and wait out the inflight ones it
+// has, so their CQEs aren't reaped into the next batch's array and their
+// buffers are left alone.  If that fails too, the ring goes.
+static void ringAbort(struct uring *r, int inflight)
+{
+    __atomic_store_n(r->sqTail, __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    while (inflight > 0)
+    {
+        if (syscall(__NR_io_uring_enter, r->fd, 0, inflight, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ringDrop(r);
+            return;
+        }
+        unsigned head = *r->cqHead;
+        while (head != __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE))
+        {
+            head++;
+            inflight--;
+        }
+        __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+    }
+}
+
+// probe once at startup; returns -1 if the kernel won't give us a ring
+int uringInit()
+{
+    if (pthread_key_create(&ringKey, ringDestructor) != 0)
+        return -1;
+    enabled = 1;
+    if (getRing() == NULL)
+    {
+        enabled = 0;
+        return -1;
+    }
+    return 0;
+}
+
+// fd is about to be closed
+void uringForget(int fd)
+{
+    if (fd >= 0)
+        __atomic_add_fetch(&fdGen[fd % URING_GENERATIONS], 1, __ATOMIC_RELEASE);
+}
+
+// run ios[0..n-1] as one batch and wait for all of them.  Returns 0 with
+// each result filled in, or -errno if the backend can't be used (the
+// caller then falls back to plain syscalls).
+int uringSubmit(struct uring_io *ios, int n)
+{
+    int done = 0;
+    struct uring *r;
+
+    if (!enabled || (r = getRing()) == NULL)
+        return -ENOSYS;
+
+    while (done < n)
+    {
+        int batch = n - done;
+        int i;
+        if (batch > (int) r->sqEntries)
+            batch = r->sqEntries;
+
+        // slots taken for this batch stay put until it is reaped
+        if (++r->batch == 0)
+        {
+            memset(r->used, 0, sizeof(r->used));
+            r->batch = 1;
+        }
+        unsigned tail = *r->sqTail;
+        for (i = 0; i < batch; i++)
+        {
+            struct uring_io *io = &ios[done + i];
+            unsigned index = tail & *r->sqMask;
+            struct io_uring_sqe *sqe = &r->sqes[index];
+            int slot = fileSlot(r, io->fd);
+
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->fd = slot >= 0 ? slot : io->fd;
+            if (slot >= 0)
+                sqe->flags = IOSQE_FIXED_FILE;
+            switch (io->op)
+            {
+                case URING_READ:
+                    sqe->opcode = IORING_OP_READ;
+                    break;
+                case URING_WRITE:
+                    sqe->opcode = IORING_OP_WRITE;
+                    break;
+                case URING_FDATASYNC:
+                    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+                    // fall through
+                default:
+                    sqe->opcode = IORING_OP_FSYNC;
+                    break;
+            }
+            if (io->op == URING_READ || io->op == URING_WRITE)
+            {
+                sqe->addr = (unsigned long) io->buf;
+                sqe->len = io->len;
+                sqe->off = io->offset;
+            }
+            sqe->user_data = done + i;
+            r->sqArray[index] = index;
+            tail++;
+        }
+        __atomic_store_n(r->sqTail, tail, __ATOMIC_RELEASE);
+
+        int submitted = 0;
+        int reaped = 0;
+        while (reaped < batch)
+        {
+            int toSubmit = batch - submitted;
+            int ret = syscall(__NR_io_uring_enter, r->fd, toSubmit, batch - reaped,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                int err = errno;
+                ringAbort(r, submitted - reaped);
+                return -err;
+            }
+            submitted += ret;
+
+            unsigned head = *r->cqHead;
+            while (head != __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE))
+            {
+                struct io_uring_cqe *cqe = &r->cqes[head & *r->cqMask];
+                ios[cqe->user_data].result = cqe->res;
+                head++;
+                reaped++;
+            }
+            __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+        }
+        done += batch;
+    }
+    return 0;
+}
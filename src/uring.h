@@ -0,0 +1,31 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <sys/types.h>
+
+// optional io_uring backend.  uringSubmit() queues a whole batch of
+// reads/writes/syncs on the calling thread's ring, enters the kernel
+// once and reaps every completion together.  Each thread gets its own
+// ring, and fds are registered with it lazily so repeated I/O on the
+// same handle skips the per-call file lookup.
+#define URING_NONE 0
+#define URING_READ 1
+#define URING_WRITE 2
+#define URING_FSYNC 3
+#define URING_FDATASYNC 4
+
+struct uring_io
+{
+    int op;
+    int fd;
+    void *buf;
+    size_t len;
+    off_t offset;
+    int result;     // bytes transferred, or -errno
+};
+
+int uringInit();
+int uringSubmit(struct uring_io *ios, int n);
+void uringForget(int fd);
+
+#endif
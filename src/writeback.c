@@ -0,0 +1,282 @@
+// need this for clock_gettime() under -std=c99
+#define _XOPEN_SOURCE 500
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "writeback.h"
+
+struct wb_entry
+{
+    int kind;
+    char *data;
+    size_t size;
+    off_t offset;
+    struct wb_entry *next;
+};
+
+struct wb_queue
+{
+    wb_apply apply;
+    void *owner;
+    struct wb_entry *head;
+    struct wb_entry *tail;
+    struct timespec oldest;     // when head was queued
+    int busy;                   // a worker is applying a batch from it
+    int scheduled;              // on the ready list
+    wb_done done;               // set once closed; run when drained
+    struct wb_queue *nextReady;
+    struct wb_queue *prev;      // every live queue, for the lag check
+    struct wb_queue *next;
+};
+
+static pthread_mutex_t wbLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wbWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wbSpace = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wbDrained = PTHREAD_COND_INITIALIZER;
+static struct wb_queue *readyHead = NULL;
+static struct wb_queue *readyTail = NULL;
+static struct wb_queue *queues = NULL;
+static size_t queuedBytes = 0;
+static size_t maxQueuedBytes = 0;
+static long maxLag = 0;
+static pthread_t *threads = NULL;
+static int numThreads = 0;
+static int stopping = 0;
+
+static long elapsedMs(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// age of the oldest update still waiting.  Called with wbLock held.
+static long lagMs()
+{
+    long lag = 0;
+    struct wb_queue *q;
+    for (q = queues; q != NULL; q = q->next)
+    {
+        if (q->head != NULL)
+        {
+            long age = elapsedMs(&q->oldest);
+            if (age > lag)
+                lag = age;
+        }
+    }
+    return lag;
+}
+
+static void schedule(struct wb_queue *q)
+{
+    q->scheduled = 1;
+    q->nextReady = NULL;
+    if (readyTail == NULL)
+        readyHead = q;
+    else
+        readyTail->nextReady = q;
+    readyTail = q;
+}
+
+static void unlink_queue(struct wb_queue *q)
+{
+    if (q->prev != NULL)
+        q->prev->next = q->next;
+    else
+        queues = q->next;
+    if (q->next != NULL)
+        q->next->prev = q->prev;
+}
+
+// a queue is only ever worked on by one thread at a time, which keeps
+// the updates to each file in order
+static void *worker(void *unused)
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&wbLock);
+        while (readyHead == NULL && !stopping)
+            pthread_cond_wait(&wbWork, &wbLock);
+        if (readyHead == NULL)
+        {
+            pthread_mutex_unlock(&wbLock);
+            return NULL;
+        }
+        struct wb_queue *q = readyHead;
+        readyHead = q->nextReady;
+        if (readyHead == NULL)
+            readyTail = NULL;
+        q->scheduled = 0;
+        q->busy = 1;
+        struct wb_entry *batch = q->head;
+        q->head = q->tail = NULL;
+        pthread_mutex_unlock(&wbLock);
+
+        size_t applied = 0;
+        struct wb_entry *e = batch;
+        while (e != NULL)
+        {
+            struct wb_entry *next = e->next;
+            q->apply(q->owner, e->kind, e->data, e->size, e->offset);
+            applied += e->size;
+            free(e->data);
+            free(e);
+            e = next;
+        }
+
+        pthread_mutex_lock(&wbLock);
+        queuedBytes -= applied;
+        q->busy = 0;
+        wb_done done = NULL;
+        if (q->head != NULL)
+        {
+            schedule(q);
+        }
+        else if (q->done != NULL)
+        {
+            done = q->done;
+            unlink_queue(q);
+        }
+        pthread_cond_broadcast(&wbSpace);
+        pthread_cond_broadcast(&wbDrained);
+        pthread_mutex_unlock(&wbLock);
+
+        if (done != NULL)
+        {
+            done(q->owner);
+            free(q);
+        }
+    }
+}
+
+int wbInit(int n, size_t maxBytes, long maxLagMs)
+{
+    int i;
+    if (numThreads > 0 || n <= 0)
+        return 0;
+
+    maxQueuedBytes = maxBytes;
+    maxLag = maxLagMs;
+    threads = calloc(n, sizeof(pthread_t));
+    if (threads == NULL)
+        return -1;
+    stopping = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (pthread_create(&threads[i], NULL, worker, NULL) != 0)
+            break;
+    }
+    numThreads = i;
+    return numThreads > 0 ? 0 : -1;
+}
+
+struct wb_queue *wbQueueNew(wb_apply apply, void *owner)
+{
+    struct wb_queue *q = calloc(1, sizeof(struct wb_queue));
+    if (q == NULL)
+        return NULL;
+    q->apply = apply;
+    q->owner = owner;
+
+    pthread_mutex_lock(&wbLock);
+    q->next = queues;
+    if (queues != NULL)
+        queues->prev = q;
+    queues = q;
+    pthread_mutex_unlock(&wbLock);
+    return q;
+}
+
+// queue a copy of buf.  Blocks while the backlog is over its byte or lag
+// bound; a single update larger than the byte bound is let through once
+// the queue is otherwise empty.
+void wbSubmit(struct wb_queue *q, int kind, const char *buf, size_t size, off_t offset)
+{
+    struct wb_entry *e = malloc(sizeof(struct wb_entry));
+    e->kind = kind;
+    e->data = NULL;
+    e->size = size;
+    e->offset = offset;
+    e->next = NULL;
+    if (buf != NULL && size > 0)
+    {
+        e->data = malloc(size);
+        memcpy(e->data, buf, size);
+    }
+    else
+    {
+        e->size = 0;
+    }
+
+    pthread_mutex_lock(&wbLock);
+    while ((queuedBytes > 0 && queuedBytes + e->size > maxQueuedBytes) ||
+           (maxLag > 0 && lagMs() > maxLag))
+        pthread_cond_wait(&wbSpace, &wbLock);
+
+    if (q->head == NULL)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &q->oldest);
+        q->head = e;
+    }
+    else
+    {
+        q->tail->next = e;
+    }
+    q->tail = e;
+    queuedBytes += e->size;
+    if (!q->busy && !q->scheduled)
+    {
+        schedule(q);
+        pthread_cond_signal(&wbWork);
+    }
+    pthread_mutex_unlock(&wbLock);
+}
+
+// wait until everything queued on q so far has been applied
+void wbDrain(struct wb_queue *q)
+{
+    pthread_mutex_lock(&wbLock);
+    while (q->head != NULL || q->busy)
+        pthread_cond_wait(&wbDrained, &wbLock);
+    pthread_mutex_unlock(&wbLock);
+}
+
+// no more updates will come for q.  done(owner) runs, and q is freed,
+// once the backlog is applied; right away if it is already empty.
+void wbClose(struct wb_queue *q, wb_done done)
+{
+    pthread_mutex_lock(&wbLock);
+    if (q->head == NULL && !q->busy)
+    {
+        unlink_queue(q);
+        pthread_mutex_unlock(&wbLock);
+        done(q->owner);
+        free(q);
+        return;
+    }
+    q->done = done;
+    pthread_mutex_unlock(&wbLock);
+}
+
+// apply whatever is still queued, then stop the workers
+void wbDestroy()
+{
+    int i;
+    if (numThreads == 0)
+        return;
+    pthread_mutex_lock(&wbLock);
+    while (queuedBytes > 0 || readyHead != NULL)
+        pthread_cond_wait(&wbDrained, &wbLock);
+    stopping = 1;
+    pthread_cond_broadcast(&wbWork);
+    pthread_mutex_unlock(&wbLock);
+
+    for (i = 0; i < numThreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    threads = NULL;
+    numThreads = 0;
+}
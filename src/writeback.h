@@ -0,0 +1,24 @@
+#ifndef _WRITEBACK_H_
+#define _WRITEBACK_H_
+
+#include <sys/types.h>
+
+// write-behind queue.  Updates are copied into an ordered queue per open
+// file and applied by background workers, so the caller only waits for
+// its own local write.  The total backlog is bounded both in bytes and
+// in how long the oldest queued update may wait; submitters block while
+// either bound is exceeded.
+struct wb_queue;
+
+// apply one queued update; kind, buf, size and offset are as submitted
+typedef void (*wb_apply)(void *owner, int kind, const char *buf, size_t size, off_t offset);
+typedef void (*wb_done)(void *owner);
+
+int wbInit(int numThreads, size_t maxBytes, long maxLagMs);
+struct wb_queue *wbQueueNew(wb_apply apply, void *owner);
+void wbSubmit(struct wb_queue *q, int kind, const char *buf, size_t size, off_t offset);
+void wbDrain(struct wb_queue *q);
+void wbClose(struct wb_queue *q, wb_done done);
+void wbDestroy();
+
+#endif